@@ -71,12 +71,19 @@ endif
 
 CGIT_CORE_OBJ_NAMES += src/core/cgit.o
 CGIT_CORE_OBJ_NAMES += src/core/cache.o
+CGIT_CORE_OBJ_NAMES += src/core/cache-compress.o
+CGIT_CORE_OBJ_NAMES += src/core/cache-http.o
+CGIT_CORE_OBJ_NAMES += src/core/cache-gc.o
+CGIT_CORE_OBJ_NAMES += src/core/cache-journal.o
 CGIT_CORE_OBJ_NAMES += src/core/cache-processing.o
+CGIT_CORE_OBJ_NAMES += src/core/cache-shm.o
+CGIT_CORE_OBJ_NAMES += src/core/cache-stats.o
 CGIT_CORE_OBJ_NAMES += src/core/cgit-auth.o
 CGIT_CORE_OBJ_NAMES += src/core/cgit-config.o
 CGIT_CORE_OBJ_NAMES += src/core/cgit-context.o
 CGIT_CORE_OBJ_NAMES += src/core/cgit-repo.o
 CGIT_CORE_OBJ_NAMES += src/core/cgit-repolist.o
+CGIT_CORE_OBJ_NAMES += src/core/cgit-scgi.o
 CGIT_CORE_OBJ_NAMES += src/core/cmd.o
 CGIT_CORE_OBJ_NAMES += src/core/configfile.o
 CGIT_CORE_OBJ_NAMES += src/core/filter.o
@@ -84,6 +91,7 @@ CGIT_CORE_OBJ_NAMES += src/core/filter-exec.o
 CGIT_CORE_OBJ_NAMES += src/core/filter-lua.o
 CGIT_CORE_OBJ_NAMES += src/core/html.o
 CGIT_CORE_OBJ_NAMES += src/core/parsing.o
+CGIT_CORE_OBJ_NAMES += src/core/repo-index.o
 CGIT_CORE_OBJ_NAMES += src/core/scan-tree.o
 CGIT_CORE_OBJ_NAMES += src/core/shared.o
 CGIT_CORE_OBJ_NAMES += src/core/shared-diff.o
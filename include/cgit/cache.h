@@ -18,26 +18,52 @@ typedef void (*cache_fill_fn)(void);
 /* Print cached content to stdout, generate the content if necessary.
  *
  * Parameters
- *   size    max number of cache files
+ *   size    max number of cache files (but at least one per shard)
  *   path    directory used to store cache files
  *   key     the key used to lookup cache files
- *   ttl     max cache time in seconds for this key
+ *   ttl     max cache time in minutes for this key
+ *   stale   minutes an expired slot may still be served while it is
+ *           regenerated in the background, 0 to regenerate it in place
  *   fn      content generator function for this key
  *
  * Return value
  *   0 indicates success, everything else is an error
  */
 extern int cache_process(int size, const char *path, const char *key, int ttl,
-			 cache_fill_fn fn);
+			 int stale, cache_fill_fn fn);
+
+
+/* Print a fragment of a page, i.e. a part without HTTP headers, like
+ * cache_process() does for whole pages. The fragment is never served
+ * stale, nor streamed while it's generated.
+ */
+extern int cache_fragment(int size, const char *path, const char *key,
+			  int ttl, cache_fill_fn fn);
 
 
 /* List info about all cache entries on stdout */
 extern int cache_ls(const char *path);
 
+/* Remove cold cache entries, and the least recently used ones while the
+ * cache holds more than max_bytes (0 for no limit). With verbose set, a
+ * summary is printed on stdout.
+ */
+extern int cache_gc(const char *path, uintmax_t max_bytes, int verbose);
+
+/* Remove the entries of the repository 'url', i.e. of its pages and
+ * fragments. With verbose set, a summary is printed on stdout.
+ */
+extern int cache_invalidate_repo(const char *path, const char *url,
+				 int verbose);
+
+/* Print the counters of the cache, like its hits and misses, on stdout */
+extern int cache_print_stats(const char *path);
+
 /* Print a message to stdout */
 __attribute__((format (printf,1,2)))
 extern void cache_log(const char *format, ...);
 
 extern unsigned long hash_str(const char *str);
+extern uint64_t hash_str64(const char *str);
 
 #endif /* CGIT_CACHE_H */
@@ -223,19 +223,33 @@ struct cgit_config {
 	char *root_desc;
 	char *root_readme;
 	char *script_name;
+	char *scgi_listen;
 	char *section;
 	char *repository_sort;
 	char *virtual_root;	/* Always ends with '/'. */
 	char *strict_export;
 	int cache_size;
+	int cache_compression;
 	int cache_dynamic_ttl;
+	int cache_fragment_ttl;
 	int cache_max_create_time;
+	int cache_max_stale;
+	unsigned long cache_max_bytes;
+	int cache_negative_ttl;
+	int cache_gc;
+	int cache_stats;
+	char *cache_invalidate_repo;
+	char *cache_warm_repo;
+	char *cache_warm_url;
 	int cache_repo_ttl;
+	int cache_resolve_refs;
 	int cache_root_ttl;
 	int cache_scanrc_ttl;
+	unsigned long cache_shm_size;
 	int cache_static_ttl;
 	int cache_about_ttl;
 	int cache_snapshot_ttl;
+	int cache_tee;
 	int case_sensitive_sort;
 	int embedded;
 	int enable_filter_overrides;
@@ -252,7 +266,9 @@ struct cgit_config {
 	int enable_html_serving;
 	int enable_tree_linenumbers;
 	int enable_git_config;
+	int enable_cache_stats;
 	int local_time;
+	int log_output_stats;
 	int max_atom_items;
 	int max_repo_count;
 	int max_commit_count;
@@ -266,6 +282,10 @@ struct cgit_config {
 	int renamelimit;
 	int remove_suffix;
 	int scan_hidden_path;
+	int scan_threads;
+	int scgi_max_requests;
+	int scgi_repo_cache;
+	int scgi_workers;
 	int section_from_path;
 	int snapshots;
 	int section_sort;
@@ -296,6 +316,7 @@ struct cgit_page {
 	const char *title;
 	int status;
 	const char *statusmsg;
+	int cached;
 };
 
 struct cgit_environment {
@@ -311,6 +332,11 @@ struct cgit_environment {
 	const char *server_port;
 	const char *http_cookie;
 	const char *http_referer;
+	const char *http_accept_encoding;
+	const char *http_if_none_match;
+	const char *http_if_modified_since;
+	const char *http_if_range;
+	const char *http_range;
 	unsigned int content_length;
 	int authenticated;
 };
@@ -338,8 +364,13 @@ extern struct cgit_context ctx;
 extern const struct cgit_snapshot_format cgit_snapshot_formats[];
 
 extern char *cgit_default_repo_desc;
+extern int cgit_reserve_repos(int n);
+extern void cgit_init_repo(struct cgit_repo *repo);
 extern struct cgit_repo *cgit_add_repo(const char *url);
+extern void cgit_hash_repo(int i);
+extern void cgit_sort_repolist(int (*cmp)(const void *a, const void *b));
 extern struct cgit_repo *cgit_get_repoinfo(const char *url);
+extern int cgit_get_repo_modtime(const struct cgit_repo *repo, time_t *mtime);
 extern void cgit_repo_config_cb(const char *name, const char *value);
 
 extern int chk_zero(int result, char *msg);
@@ -400,6 +431,8 @@ extern void cgit_cleanup_filters(void);
 extern void cgit_init_filters(void);
 
 extern void cgit_prepare_repo_env(struct cgit_repo * repo);
+extern void cgit_print_fragment(const char *section, const char *inputs,
+				int all_refs, void (*fn)(void));
 
 extern int readfile(const char *path, char **buf, size_t *size);
 
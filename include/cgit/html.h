@@ -10,6 +10,8 @@
 #include "cgit.h"
 
 extern void html_raw(const char *txt, size_t size);
+extern void html_flush(void);
+extern void html_output_stats(uintmax_t *writes, uintmax_t *bytes);
 extern void html(const char *txt);
 
 __attribute__((format (printf,1,2)))
@@ -0,0 +1,14 @@
+/* Copyright (C) Dominic R and contributors (see AUTHORS)
+ *
+ * Licensed under GNU General Public License v2
+ *   (see COPYING for full license text)
+ */
+
+extern int repo_index_write(FILE *f, int start, const char *stats);
+extern int repo_index_load(const char *file);
+extern void repo_index_decode_url(const char *url);
+extern int repo_index_update_modtime(const char *url);
+extern int repo_index_is_pending(int i);
+extern void repo_index_decode_all(void);
+extern int repo_index_print(const char *file,
+			    void (*print)(FILE *f, struct cgit_repo *repo));
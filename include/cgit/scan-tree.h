@@ -6,3 +6,5 @@
 
 extern void scan_projects(const char *path, const char *projectsfile, repo_config_fn fn);
 extern void scan_tree(const char *path, repo_config_fn fn);
+extern void scan_stats(struct strbuf *out);
+extern void scan_track_dirs(const char *prev, FILE *next);
@@ -79,6 +79,10 @@ __attribute__((format (printf,1,0)))
 extern void cgit_vprint_error(const char *fmt, va_list ap);
 extern const struct date_mode cgit_date_mode(enum date_mode_type type);
 extern void cgit_print_age(time_t t, int tz, time_t max_relative);
+extern time_t cgit_parse_http_date(const char *date);
+extern int cgit_is_not_modified(const char *etag, time_t modified);
+extern void cgit_print_not_modified(const char *etag, time_t modified,
+				    time_t expires);
 extern void cgit_print_http_headers(void);
 extern void cgit_redirect(const char *url, bool permanent);
 extern void cgit_print_docstart(void);
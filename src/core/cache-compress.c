@@ -0,0 +1,236 @@
+/* Copyright (C) Dominic R and contributors (see AUTHORS)
+ *
+ * Licensed under GNU General Public License v2
+ *   (see COPYING for full license text)
+ */
+
+/* With cache-compression=gzip, the body of a compressible page is stored
+ * gzip'ed in its cache slot, and "Content-Encoding: gzip" is added to the
+ * stored headers. Such a slot is sent as-is to clients which accept gzip,
+ * and inflated on the fly for the others, so a page is only compressed
+ * once per slot instead of once per request. The two variants have
+ * different ETags: the stored one gets CACHE_GZIP_ETAG_SUFFIX, which is
+ * dropped again for the inflated one.
+ */
+
+#include "cgit.h"
+#include "cache.h"
+#include "cache-internal.h"
+#include "git-zlib.h"
+
+/* Bodies outside of these bounds are stored as they are. */
+#define CACHE_MIN_COMPRESS 256
+#define CACHE_MAX_COMPRESS (16 * 1024 * 1024)
+
+#define ENCODING_HEADERS "Content-Encoding: gzip\nVary: Accept-Encoding\n"
+
+static const char *compressible_types[] = {
+	"text/",
+	"application/atom+xml",
+	"application/javascript",
+	"application/json",
+	"application/xml",
+	"image/svg+xml",
+};
+
+static int is_compressible(const char *type)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(compressible_types); i++)
+		if (istarts_with(type, compressible_types[i]))
+			return 1;
+	return 0;
+}
+
+/* Does the client accept a gzip'ed response? */
+int cache_accepts_gzip(void)
+{
+	const char *p = ctx.env.http_accept_encoding;
+	size_t len;
+
+	while (p && *p) {
+		p += strspn(p, " \t,");
+		len = strcspn(p, " \t;,");
+		if ((len == 4 && !strncasecmp(p, "gzip", 4)) ||
+		    (len == 1 && *p == '*')) {
+			p += len;
+			p += strspn(p, " \t");
+			/* "gzip;q=0" explicitly refuses gzip */
+			if (*p == ';') {
+				p++;
+				p += strspn(p, " \t");
+				if ((*p == 'q' || *p == 'Q') && p[1] == '=')
+					return strtod(p + 2, NULL) > 0;
+			}
+			return 1;
+		}
+		p += strcspn(p, ",");
+	}
+	return 0;
+}
+
+/* Replace the body of the freshly filled slot in the lockfile with its
+ * gzip'ed version, if compression is enabled and the page is worth it.
+ * Returns 0 on success and errno otherwise.
+ */
+int cache_compress_slot(struct cache_slot *slot)
+{
+	struct strbuf content = STRBUF_INIT;
+	struct strbuf out = STRBUF_INIT;
+	off_t start = cache_response_offset(slot);
+	const char *type, *p, *eol, *hdrend;
+	size_t hdrlen, bodylen;
+	git_zstream stream;
+	struct stat st;
+	int err = 0;
+
+	if (!ctx.cfg.cache_compression || slot->fragment)
+		return 0;
+	if (fstat(slot->lock_fd, &st))
+		return errno;
+	if (st.st_size - start < CACHE_MIN_COMPRESS ||
+	    st.st_size - start > CACHE_MAX_COMPRESS)
+		return 0;
+	if (lseek(slot->lock_fd, start, SEEK_SET) != start ||
+	    strbuf_read(&content, slot->lock_fd, st.st_size - start) < 0) {
+		err = errno;
+		goto out;
+	}
+
+	hdrlen = cache_header_len(content.buf, content.len);
+	if (!hdrlen)
+		goto out;
+	if (cache_find_header(content.buf, hdrlen, "Content-Encoding:"))
+		goto out;
+	type = cache_find_header(content.buf, hdrlen, "Content-Type:");
+	if (!type || !is_compressible(type))
+		goto out;
+	bodylen = content.len - hdrlen;
+	if (bodylen < CACHE_MIN_COMPRESS)
+		goto out;
+
+	/* Content-Length no longer applies to the encoded body, and the
+	 * ETag has to tell the encoded body from the identity one.
+	 */
+	hdrend = content.buf + hdrlen - 1;
+	for (p = content.buf; p < hdrend; p = eol + 1) {
+		eol = memchr(p, '\n', hdrend - p);
+		if (istarts_with(p, "Content-Length:"))
+			continue;
+		if (istarts_with(p, "ETag:") && eol[-1] == '"') {
+			strbuf_add(&out, p, eol - p - 1);
+			strbuf_addstr(&out, CACHE_GZIP_ETAG_SUFFIX "\"\n");
+		} else
+			strbuf_add(&out, p, eol - p + 1);
+	}
+	strbuf_addstr(&out, ENCODING_HEADERS "\n");
+
+	memset(&stream, 0, sizeof(stream));
+	git_deflate_init_gzip(&stream, Z_DEFAULT_COMPRESSION);
+	strbuf_grow(&out, git_deflate_bound(&stream, bodylen));
+	stream.next_in = (unsigned char *)content.buf + hdrlen;
+	stream.avail_in = bodylen;
+	stream.next_out = (unsigned char *)out.buf + out.len;
+	stream.avail_out = out.alloc - out.len - 1;
+	if (git_deflate(&stream, Z_FINISH) != Z_STREAM_END) {
+		git_deflate_end(&stream);
+		goto out;
+	}
+	strbuf_setlen(&out, (char *)stream.next_out - out.buf);
+	git_deflate_end(&stream);
+	if (out.len >= content.len)
+		goto out;
+
+	if (lseek(slot->lock_fd, start, SEEK_SET) != start ||
+	    write_in_full(slot->lock_fd, out.buf, out.len) < 0 ||
+	    ftruncate(slot->lock_fd, start + out.len)) {
+		err = errno;
+		goto out;
+	}
+out:
+	strbuf_release(&content);
+	strbuf_release(&out);
+	return err;
+}
+
+/* Print a compressed slot to a client which doesn't accept gzip: the
+ * stored headers without Content-Encoding (and with the ETag of the
+ * identity variant), followed by the inflated body. The response is
+ * taken from the mapped slot, or read in full if it isn't mapped.
+ */
+int cache_print_inflated(struct cache_slot *slot)
+{
+	static const char etag_end[] = CACHE_GZIP_ETAG_SUFFIX "\"";
+	struct strbuf hdr = STRBUF_INIT, resp = STRBUF_INIT;
+	off_t start = cache_response_offset(slot);
+	const char *data, *p, *eol, *hdrend;
+	unsigned char *out;
+	git_zstream stream;
+	size_t hdrlen, len;
+	int status, err = 0;
+
+	if (slot->data == slot->map && slot->datalen == slot->cache_st.st_size &&
+	    slot->datalen >= start) {
+		data = slot->data + start;
+		len = slot->datalen - start;
+	} else {
+		if (lseek(slot->cache_fd, start, SEEK_SET) != start ||
+		    strbuf_read(&resp, slot->cache_fd, 0) < 0) {
+			err = errno;
+			strbuf_release(&resp);
+			return err;
+		}
+		data = resp.buf;
+		len = resp.len;
+	}
+	hdrlen = cache_header_len(data, len);
+	if (!hdrlen) {
+		strbuf_release(&resp);
+		return EINVAL;
+	}
+
+	hdrend = data + hdrlen - 1;
+	for (p = data; p < hdrend; p = eol + 1) {
+		eol = memchr(p, '\n', hdrend - p);
+		if (istarts_with(p, "Content-Encoding:"))
+			continue;
+		if (istarts_with(p, "ETag:") &&
+		    eol - p > strlen(etag_end) &&
+		    !memcmp(eol - strlen(etag_end), etag_end, strlen(etag_end))) {
+			strbuf_add(&hdr, p, eol - p - strlen(etag_end));
+			strbuf_addstr(&hdr, "\"\n");
+		} else
+			strbuf_add(&hdr, p, eol - p + 1);
+	}
+	strbuf_addch(&hdr, '\n');
+	if (write_in_full(STDOUT_FILENO, hdr.buf, hdr.len) < 0)
+		err = errno;
+	strbuf_release(&hdr);
+	if (err) {
+		strbuf_release(&resp);
+		return err;
+	}
+
+	/* The whole body is there, so it's inflated in one go */
+	out = xmalloc(CACHE_BUFSIZE * 16);
+	memset(&stream, 0, sizeof(stream));
+	git_inflate_init_gzip_only(&stream);
+	stream.next_in = (unsigned char *)data + hdrlen;
+	stream.avail_in = len - hdrlen;
+	do {
+		stream.next_out = out;
+		stream.avail_out = CACHE_BUFSIZE * 16;
+		status = git_inflate(&stream, Z_NO_FLUSH);
+		if (write_in_full(STDOUT_FILENO, out, stream.next_out - out) < 0) {
+			err = errno;
+			break;
+		}
+	} while (status == Z_OK);
+	if (!err && status != Z_STREAM_END)
+		err = EINVAL;
+	git_inflate_end(&stream);
+	free(out);
+	strbuf_release(&resp);
+	return err;
+}
@@ -0,0 +1,297 @@
+/* Copyright (C) Dominic R and contributors (see AUTHORS)
+ *
+ * Licensed under GNU General Public License v2
+ *   (see COPYING for full license text)
+ */
+
+/* With cache-max-bytes set, the total size of the cache slots is kept in
+ * the usage file in the cache root: every process which replaces a slot
+ * adds the difference in size, under an fcntl() lock. Once the total
+ * exceeds the budget, a background process runs cache_gc(), which also
+ * recounts the total from scratch, so that drift from crashed processes
+ * doesn't accumulate.
+ *
+ * Recency is the atime of a slot, which cache hits update explicitly
+ * (see cache_touch_slot()), so it doesn't depend on mount options.
+ * Removed slots are dropped from the journals of their repositories
+ * afterwards.
+ */
+
+#include "cgit.h"
+#include "cache.h"
+#include "cache-internal.h"
+#include "html.h"
+
+/* The garbage collector evicts down to this percentage of the budget,
+ * so that it doesn't have to run again for the next few slots.
+ */
+#define CACHE_GC_TARGET 90
+
+/* Lockfiles older than this (in seconds) were left by crashed processes */
+#define CACHE_GC_LOCK_AGE (60 * 60)
+
+struct gc_entry {
+	char *name;
+	off_t size;
+	time_t used;
+};
+
+struct gc_state {
+	struct gc_entry *entries;
+	int nr, alloc;
+	uintmax_t bytes;
+	uintmax_t removed_bytes;
+	int removed;
+};
+
+static void usage_name(struct strbuf *name, const char *path)
+{
+	strbuf_addstr(name, path);
+	strbuf_ensure_end(name, '/');
+	strbuf_addstr(name, CACHE_USAGE_FILE);
+}
+
+/* Read-modify-write the usage file under an fcntl() lock. If 'set' is
+ * non-zero, the usage is set to 'value', otherwise 'value' is added to
+ * it. Returns the new usage, or 0 if the usage file can't be updated.
+ */
+static uintmax_t update_usage(const char *path, intmax_t value, int set)
+{
+	struct flock lock = {
+		.l_type = F_WRLCK,
+		.l_whence = SEEK_SET,
+	};
+	struct strbuf name = STRBUF_INIT;
+	char buf[32];
+	uintmax_t usage = 0;
+	ssize_t len;
+	int fd;
+
+	usage_name(&name, path);
+	fd = open(name.buf, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+	strbuf_release(&name);
+	if (fd < 0)
+		return 0;
+	while (fcntl(fd, F_SETLKW, &lock) < 0)
+		if (errno != EINTR)
+			goto out;
+
+	len = pread(fd, buf, sizeof(buf) - 1, 0);
+	if (len > 0) {
+		buf[len] = '\0';
+		usage = strtoumax(buf, NULL, 10);
+	}
+	if (set)
+		usage = value;
+	else if (value < 0 && usage < (uintmax_t)-value)
+		usage = 0;
+	else
+		usage += value;
+
+	len = xsnprintf(buf, sizeof(buf), "%"PRIuMAX"\n", usage);
+	if (ftruncate(fd, 0) || pwrite(fd, buf, len, 0) != len)
+		usage = 0;
+out:
+	close(fd);
+	return usage;
+}
+
+/* Add 'delta' bytes to the usage of the cache in 'path', and start a
+ * garbage collection in the background if it's over budget.
+ */
+void cache_add_usage(const char *path, intmax_t delta)
+{
+	if (!ctx.cfg.cache_max_bytes || !delta)
+		return;
+	if (update_usage(path, delta, 0) > ctx.cfg.cache_max_bytes)
+		cache_gc_in_background(path);
+}
+
+/* The age, in seconds, after which an unused slot can't be served
+ * anymore by any of the page types, or 0 if there is no such age, i.e.
+ * if the slots of some page type never expire.
+ */
+static time_t cold_age(void)
+{
+	int ttls[] = {
+		ctx.cfg.cache_root_ttl,
+		ctx.cfg.cache_repo_ttl,
+		ctx.cfg.cache_static_ttl,
+		ctx.cfg.cache_dynamic_ttl,
+		ctx.cfg.cache_about_ttl,
+		ctx.cfg.cache_snapshot_ttl,
+		ctx.cfg.cache_fragment_ttl,
+	};
+	int i, max = 0;
+
+	for (i = 0; i < ARRAY_SIZE(ttls); i++) {
+		if (ttls[i] < 0)
+			return 0;
+		if (ttls[i] > max)
+			max = ttls[i];
+	}
+	if (!max)
+		return 0;
+	return (time_t)(max + ctx.cfg.cache_max_stale) * 60;
+}
+
+static int remove_file(struct gc_state *gc, const char *name, off_t size)
+{
+	if (unlink(name) && errno != ENOENT) {
+		cache_log("[cgit] Unable to remove %s: %s (%d)\n",
+			  name, strerror(errno), errno);
+		return -1;
+	}
+	gc->removed++;
+	gc->removed_bytes += size;
+	return 0;
+}
+
+/* Collect the slots below 'dir', which is 'depth' levels of shards
+ * below the cache root, and remove the cold slots and stale lockfiles.
+ */
+static void scan_dir(struct gc_state *gc, struct strbuf *dir, int depth,
+		     time_t now, time_t max_age)
+{
+	struct dirent *ent;
+	struct stat st;
+	size_t prefixlen, len;
+	DIR *d;
+
+	d = opendir(dir->buf);
+	if (!d)
+		return;
+	strbuf_ensure_end(dir, '/');
+	prefixlen = dir->len;
+	while ((ent = readdir(d)) != NULL) {
+		len = strspn(ent->d_name, "0123456789abcdef");
+		strbuf_setlen(dir, prefixlen);
+		strbuf_addstr(dir, ent->d_name);
+		if (depth < 2) {
+			if (len == 2 && !ent->d_name[2])
+				scan_dir(gc, dir, depth + 1, now, max_age);
+			continue;
+		}
+		if (len != CACHE_NAME_LEN || lstat(dir->buf, &st))
+			continue;
+		if (!strcmp(ent->d_name + len, ".lock")) {
+			if (st.st_mtime + CACHE_GC_LOCK_AGE < now)
+				remove_file(gc, dir->buf, 0);
+			continue;
+		}
+		if (ent->d_name[len])
+			continue;
+		if (max_age && st.st_mtime + max_age < now &&
+		    st.st_atime + max_age < now) {
+			remove_file(gc, dir->buf, st.st_size);
+			continue;
+		}
+		ALLOC_GROW(gc->entries, gc->nr + 1, gc->alloc);
+		gc->entries[gc->nr].name = xstrdup(dir->buf);
+		gc->entries[gc->nr].size = st.st_size;
+		gc->entries[gc->nr].used = st.st_atime > st.st_mtime ?
+			st.st_atime : st.st_mtime;
+		gc->nr++;
+		gc->bytes += st.st_size;
+	}
+	closedir(d);
+}
+
+static int cmp_gc_entry(const void *a, const void *b)
+{
+	const struct gc_entry *x = a, *y = b;
+
+	return (x->used > y->used) - (x->used < y->used);
+}
+
+/* Remove the slots which haven't been used for longer than any page type
+ * may be cached, and then the least recently used ones until the cache
+ * fits in 'max_bytes' (0 for no limit). Returns 0 on success, EAGAIN if
+ * a garbage collection is already running, and errno otherwise.
+ */
+int cache_gc(const char *path, uintmax_t max_bytes, int verbose)
+{
+	struct flock lock = {
+		.l_type = F_WRLCK,
+		.l_whence = SEEK_SET,
+	};
+	struct gc_state gc = { NULL };
+	struct strbuf dir = STRBUF_INIT;
+	uintmax_t target;
+	time_t now = time(NULL);
+	int i, fd, err = 0;
+
+	if (!path) {
+		cache_log("[cgit] cache path not specified\n");
+		return EINVAL;
+	}
+
+	strbuf_addstr(&dir, path);
+	strbuf_ensure_end(&dir, '/');
+	strbuf_addstr(&dir, CACHE_GC_LOCK_FILE);
+	fd = open(dir.buf, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		err = errno;
+		goto out;
+	}
+	if (fcntl(fd, F_SETLK, &lock) < 0) {
+		if (verbose)
+			cache_log("[cgit] cache gc is already running\n");
+		err = EAGAIN;
+		goto out;
+	}
+
+	strbuf_reset(&dir);
+	strbuf_addstr(&dir, path);
+	scan_dir(&gc, &dir, 0, now, cold_age());
+
+	if (max_bytes && gc.bytes > max_bytes) {
+		target = max_bytes / 100 * CACHE_GC_TARGET;
+		QSORT(gc.entries, gc.nr, cmp_gc_entry);
+		for (i = 0; i < gc.nr && gc.bytes > target; i++)
+			if (!remove_file(&gc, gc.entries[i].name,
+					 gc.entries[i].size))
+				gc.bytes -= gc.entries[i].size;
+	}
+	if (max_bytes)
+		update_usage(path, gc.bytes, 1);
+	cache_journal_compact(path);
+
+	if (verbose)
+		printf("removed %d files (%"PRIuMAX" bytes), "
+		       "kept %"PRIuMAX" bytes\n",
+		       gc.removed, gc.removed_bytes, gc.bytes);
+out:
+	for (i = 0; i < gc.nr; i++)
+		free(gc.entries[i].name);
+	free(gc.entries);
+	if (fd >= 0)
+		close(fd);
+	strbuf_release(&dir);
+	return err;
+}
+
+/* Run cache_gc() in a detached child process */
+void cache_gc_in_background(const char *path)
+{
+	pid_t pid;
+	int fd;
+
+	html_flush();
+	fflush(stdout);
+
+	pid = fork();
+	if (pid < 0) {
+		cache_log("[cgit] Unable to start cache gc: %s (%d)\n",
+			  strerror(errno), errno);
+		return;
+	}
+	if (pid > 0)
+		return;
+
+	fd = open("/dev/null", O_RDWR);
+	if (fd < 0 || dup2(fd, STDIN_FILENO) < 0 || dup2(fd, STDOUT_FILENO) < 0)
+		_exit(1);
+	close(fd);
+	_exit(cache_gc(path, ctx.cfg.cache_max_bytes, 0) ? 1 : 0);
+}
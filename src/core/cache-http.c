@@ -0,0 +1,272 @@
+/* Copyright (C) Dominic R and contributors (see AUTHORS)
+ *
+ * Licensed under GNU General Public License v2
+ *   (see COPYING for full license text)
+ */
+
+/* The HTTP side of the cache: the headers of a response are parsed once
+ * when its slot is filled, into the slot header (see cache-internal.h),
+ * which tells a hit where the body starts and how long it is. A hit then
+ * prints the stored headers with the exact Content-Length, and can
+ * answer conditional requests and single byte ranges of the body.
+ */
+
+#include "cgit.h"
+#include "cache.h"
+#include "cache-internal.h"
+#include "ui-shared.h"
+
+/* Return the length of the header block at the start of buf, including
+ * the terminating empty line, or 0 if buf doesn't hold a complete one.
+ */
+size_t cache_header_len(const char *buf, size_t len)
+{
+	const char *end = memmem(buf, len, "\n\n", 2);
+
+	return end ? end - buf + 2 : 0;
+}
+
+/* Find the value of the header 'name' (e.g. "Content-Type:") in hdr. */
+const char *cache_find_header(const char *hdr, size_t len, const char *name)
+{
+	const char *p, *eol, *end = hdr + len;
+	size_t n = strlen(name);
+
+	for (p = hdr; p < end && (eol = memchr(p, '\n', end - p)); p = eol + 1) {
+		if (eol - p >= n && !strncasecmp(p, name, n))
+			return p + n + strspn(p + n, " ");
+	}
+	return NULL;
+}
+
+/* Get the value of the header 'name' in hdr, without the line end. */
+static char *header_value(const char *hdr, size_t len, const char *name)
+{
+	const char *value = cache_find_header(hdr, len, name);
+
+	if (!value)
+		return NULL;
+	return xmemdupz(value, strchrnul(value, '\n') - value);
+}
+
+/* Copy the value of the header 'name' into the field 'dst' of the slot
+ * header, unless it's too long for it.
+ */
+static void copy_header(char *dst, size_t size, const char *hdr, size_t len,
+			const char *name)
+{
+	const char *value = cache_find_header(hdr, len, name);
+	size_t n;
+
+	if (!value)
+		return;
+	n = strchrnul(value, '\n') - value;
+	if (n < size)
+		memcpy(dst, value, n);
+}
+
+/* Is the stored response a plain "200 OK"? */
+static int is_ok(const char *resp, size_t hdrlen)
+{
+	const char *status = cache_find_header(resp, hdrlen, "Status:");
+
+	return !status || atoi(status) == 200;
+}
+
+/* Fill in the slot header for the response 'resp', which is 'size' bytes
+ * long, and of which the first 'len' bytes are in memory. Unless 'http'
+ * is set, the response has no headers (e.g. it's a fragment of a page).
+ */
+void cache_init_header(struct cache_slot_header *hdr, const char *resp,
+		       size_t len, off_t size, int http)
+{
+	size_t hdrlen = cache_header_len(resp, len);
+	const char *status;
+
+	memset(hdr, 0, sizeof(*hdr));
+	memcpy(hdr->magic, CACHE_SLOT_MAGIC, sizeof(hdr->magic));
+	hdr->version = CACHE_SLOT_VERSION;
+	hdr->generated = time(NULL);
+	hdr->body_length = size;
+
+	/* Without HTTP headers (or with more than we've read), the response
+	 * is printed as it is.
+	 */
+	if (!http || (ctx.env.no_http && !strcmp(ctx.env.no_http, "1")) ||
+	    !hdrlen)
+		return;
+
+	hdr->flags |= CACHE_SLOT_HTTP;
+	hdr->body_offset = hdrlen;
+	hdr->body_length = size - hdrlen;
+	status = cache_find_header(resp, hdrlen, "Status:");
+	if (status && atoi(status) >= 400)
+		hdr->flags |= CACHE_SLOT_ERROR;
+	copy_header(hdr->content_type, sizeof(hdr->content_type), resp, hdrlen,
+		    "Content-Type:");
+	copy_header(hdr->encoding, sizeof(hdr->encoding), resp, hdrlen,
+		    "Content-Encoding:");
+	copy_header(hdr->etag, sizeof(hdr->etag), resp, hdrlen, "ETag:");
+	if (!strcmp(hdr->encoding, "gzip"))
+		hdr->flags |= CACHE_SLOT_GZIP;
+}
+
+/* If the request is conditional and the client already has the stored
+ * response 'resp', of which 'len' bytes are in memory, print a 304
+ * response instead of it, and return 1. Otherwise return 0.
+ */
+int cache_print_not_modified(const char *resp, size_t len)
+{
+	size_t hdrlen = cache_header_len(resp, len);
+	char *etag, *value;
+	time_t modified = 0, expires = 0;
+	size_t n;
+	int ret = 0;
+
+	if (!hdrlen || (!ctx.env.http_if_none_match &&
+			!ctx.env.http_if_modified_since))
+		return 0;
+	if (!is_ok(resp, hdrlen))
+		return 0;
+
+	if ((value = header_value(resp, hdrlen, "Last-Modified:"))) {
+		modified = cgit_parse_http_date(value);
+		free(value);
+	}
+	if ((value = header_value(resp, hdrlen, "Expires:"))) {
+		expires = cgit_parse_http_date(value);
+		free(value);
+	}
+	/* The stored ETag is quoted */
+	etag = header_value(resp, hdrlen, "ETag:");
+	if (etag && (n = strlen(etag)) > 1 && etag[0] == '"' &&
+	    etag[n - 1] == '"') {
+		memmove(etag, etag + 1, n - 2);
+		etag[n - 2] = '\0';
+	}
+	/* A gzip'ed slot is inflated for this client, see cache-compress.c */
+	if (etag && !cache_accepts_gzip() &&
+	    strip_suffix(etag, CACHE_GZIP_ETAG_SUFFIX, &n))
+		etag[n] = '\0';
+
+	if (cgit_is_not_modified(etag, modified)) {
+		cgit_print_not_modified(etag, modified, expires);
+		ret = 1;
+	}
+	free(etag);
+	return ret;
+}
+
+/* Does If-Range, if the request has it, match the stored response? Only
+ * the strong comparison applies, i.e. ETags must not be weak, and dates
+ * must be the exact Last-Modified.
+ */
+static int if_range_matches(const struct cache_slot_header *hdr,
+			    const char *resp)
+{
+	const char *if_range = ctx.env.http_if_range;
+	char *modified;
+	int ret;
+
+	if (!if_range)
+		return 1;
+	if (*if_range == '"')
+		return hdr->etag[0] == '"' && !strcmp(if_range, hdr->etag);
+	modified = header_value(resp, hdr->body_offset, "Last-Modified:");
+	ret = modified && !strcmp(if_range, modified);
+	free(modified);
+	return ret;
+}
+
+/* Parse the Range header of the request for the stored response. Only a
+ * single range is supported, other requests get the whole body. Returns
+ * 206 for a satisfiable range, which is stored in [*from, *to), 416 for
+ * an unsatisfiable one, and 200 for the whole body.
+ */
+static int parse_range(const struct cache_slot_header *hdr, const char *resp,
+		       off_t *from, off_t *to)
+{
+	const char *p = ctx.env.http_range;
+	uintmax_t first, last, length = hdr->body_length;
+	char *end;
+
+	if (!p || !skip_prefix(p, "bytes=", &p) || strchr(p, ',') ||
+	    !if_range_matches(hdr, resp))
+		return 200;
+	if (*p == '-') {
+		last = strtoumax(p + 1, &end, 10);
+		if (end == p + 1 || *end)
+			return 200;
+		if (!last || !length)
+			return 416;
+		first = last < length ? length - last : 0;
+		last = length - 1;
+	} else {
+		first = strtoumax(p, &end, 10);
+		if (end == p || *end != '-')
+			return 200;
+		p = end + 1;
+		last = length - 1;
+		if (*p) {
+			last = strtoumax(p, &end, 10);
+			if (end == p || *end || last < first)
+				return 200;
+		}
+		if (first >= length)
+			return 416;
+		if (last >= length)
+			last = length - 1;
+	}
+	*from = first;
+	*to = last + 1;
+	return 206;
+}
+
+/* Print the stored headers of the response 'resp', with the exact
+ * Content-Length of what follows them, honoring a Range header of the
+ * request. [*from, *to) is set to the part of the body to print after
+ * the headers. Returns 0 on success and errno otherwise.
+ */
+int cache_print_head(const struct cache_slot_header *hdr, const char *resp,
+		     off_t *from, off_t *to)
+{
+	struct strbuf out = STRBUF_INIT;
+	const char *p, *eol, *end = resp + hdr->body_offset - 1;
+	int ok = is_ok(resp, hdr->body_offset);
+	int code = 200, err = 0;
+
+	*from = 0;
+	*to = hdr->body_length;
+	if (ok)
+		code = parse_range(hdr, resp, from, to);
+	if (code == 416) {
+		*to = 0;
+		strbuf_addf(&out, "Status: 416 Range Not Satisfiable\n"
+			    "Content-Range: bytes */%"PRIuMAX"\n\n",
+			    (uintmax_t)hdr->body_length);
+		goto write;
+	}
+
+	if (code == 206)
+		strbuf_addstr(&out, "Status: 206 Partial Content\n");
+	for (p = resp; p < end; p = eol + 1) {
+		eol = memchr(p, '\n', end - p);
+		if (istarts_with(p, "Content-Length:") ||
+		    (code == 206 && istarts_with(p, "Status:")))
+			continue;
+		strbuf_add(&out, p, eol - p + 1);
+	}
+	if (ok)
+		strbuf_addstr(&out, "Accept-Ranges: bytes\n");
+	if (code == 206)
+		strbuf_addf(&out, "Content-Range: bytes %"PRIuMAX"-%"PRIuMAX
+			    "/%"PRIuMAX"\n", (uintmax_t)*from,
+			    (uintmax_t)*to - 1, (uintmax_t)hdr->body_length);
+	strbuf_addf(&out, "Content-Length: %"PRIuMAX"\n\n",
+		    (uintmax_t)(*to - *from));
+write:
+	if (write_in_full(STDOUT_FILENO, out.buf, out.len) < 0)
+		err = errno;
+	strbuf_release(&out);
+	return err;
+}
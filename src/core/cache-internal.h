@@ -11,10 +11,70 @@
 
 #define CACHE_BUFSIZE (1024 * 4)
 
+/* Slots are mapped rather than read; the pages of slots up to this size
+ * are faulted in by mmap() itself, since all of them will be printed.
+ */
+#define CACHE_POPULATE_SIZE (256 * 1024)
+
+/* Slots are named after the 64-bit hash of their key, in 16 hex digits,
+ * and stored in two levels of shard directories. There is a shard per
+ * CACHE_SHARD_SLOTS slots of cache-size, up to CACHE_SHARDS, and with all
+ * of them the shard is named after the first two bytes of the hash:
+ * <root>/01/23/0123456789abcdef. The layout file in the root marks a
+ * cache which doesn't hold slots of the old flat layout anymore.
+ */
+#define CACHE_NAME_LEN 16
+#define CACHE_SHARDS (256 * 256)
+#define CACHE_SHARD_SLOTS 16
+#define CACHE_LAYOUT_FILE ".layout"
+#define CACHE_USAGE_FILE ".usage"
+#define CACHE_GC_LOCK_FILE ".gc.lock"
+#define CACHE_JOURNAL_DIR ".repos"
+#define CACHE_STATS_FILE ".stats"
+
+/* A slot holds its key and a '\0', the slot header, and the response as
+ * printed by the page: the HTTP headers, an empty line and the body. The
+ * slot header is written once the response is complete; slots without a
+ * valid one, e.g. from earlier versions, never match their key.
+ */
+#define CACHE_SLOT_MAGIC "cgitslot"
+#define CACHE_SLOT_VERSION 1
+
+#define CACHE_SLOT_GZIP (1 << 0)	/* the body is gzip'ed */
+#define CACHE_SLOT_ERROR (1 << 1)	/* the status is 4xx or 5xx */
+#define CACHE_SLOT_HTTP (1 << 2)	/* the response has HTTP headers */
+
+/* The gzip'ed variant of a response gets its own ETag, with this suffix */
+#define CACHE_GZIP_ETAG_SUFFIX "-gzip"
+
+struct cache_slot_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t flags;
+	uint64_t body_offset;	/* from the start of the response */
+	uint64_t body_length;
+	int64_t generated;
+	char content_type[96];
+	char encoding[16];
+	char etag[80];		/* e.g. the id of a blob */
+};
+
 struct cache_slot {
+	const char *root;
+	const char *repo;	/* the url of the repository, if any */
 	const char *key;
 	size_t keylen;
+	uint64_t hash;
 	int ttl;
+	int negative_ttl;
+	int shard_limit;
+	int max_stale;
+	int lock_attempts;
+	int max_wait;
+	int fragment;
+	int tee;
+	int teed;
+	pid_t tee_pid;
 	cache_fill_fn fn;
 	int cache_fd;
 	int lock_fd;
@@ -22,19 +82,97 @@ struct cache_slot {
 	const char *cache_name;
 	const char *lock_name;
 	int match;
+	int compressed;
+	int negative;
 	struct stat cache_st;
-	int bufsize;
+	struct cache_slot_header hdr;
+	char *map;		/* the mapped slot file, if any */
+	size_t mapsize;
+	const char *data;	/* the start of the slot: the map, or buf */
+	size_t datalen;
 	char buf[CACHE_BUFSIZE];
 };
 
+static inline off_t cache_response_offset(const struct cache_slot *slot)
+{
+	return slot->keylen + 1 + sizeof(struct cache_slot_header);
+}
+
 int cache_open_slot(struct cache_slot *slot);
 int cache_close_slot(struct cache_slot *slot);
 int cache_print_slot(struct cache_slot *slot);
 int cache_is_expired(struct cache_slot *slot);
+int cache_is_stale(struct cache_slot *slot);
 int cache_is_modified(struct cache_slot *slot);
 int cache_close_lock(struct cache_slot *slot);
 int cache_lock_slot(struct cache_slot *slot);
 int cache_unlock_slot(struct cache_slot *slot, int replace_old_slot);
 int cache_fill_slot(struct cache_slot *slot);
+int cache_create_shard(const char *name);
+void cache_touch_slot(struct cache_slot *slot);
+void cache_slot_name(struct strbuf *name, const char *path, uint64_t hash,
+		     int size);
+
+/* The number of shards of a cache of 'size' slots */
+static inline int cache_shards(int size)
+{
+	int shards = DIV_ROUND_UP(size, CACHE_SHARD_SLOTS);
+
+	return shards > 0 && shards < CACHE_SHARDS ? shards : CACHE_SHARDS;
+}
+
+/* The number of slots a shard may hold, so that all of them together
+ * don't hold more than 'size' (except if that's less than one each).
+ */
+static inline int cache_shard_limit(int size)
+{
+	int limit = size / cache_shards(size);
+
+	return limit > 0 ? limit : 1;
+}
+
+size_t cache_header_len(const char *buf, size_t len);
+const char *cache_find_header(const char *hdr, size_t len, const char *name);
+void cache_init_header(struct cache_slot_header *hdr, const char *resp,
+		       size_t len, off_t size, int http);
+int cache_print_not_modified(const char *resp, size_t len);
+int cache_print_head(const struct cache_slot_header *hdr, const char *resp,
+		     off_t *from, off_t *to);
+
+int cache_accepts_gzip(void);
+int cache_compress_slot(struct cache_slot *slot);
+int cache_print_inflated(struct cache_slot *slot);
+
+int cache_shm_print(struct cache_slot *slot);
+void cache_shm_store(struct cache_slot *slot);
+void cache_shm_remove(struct cache_slot *slot);
+
+void cache_journal_add(struct cache_slot *slot);
+void cache_journal_compact(const char *path);
+
+enum cache_stat {
+	CACHE_STAT_HIT,		/* served from the cache directory */
+	CACHE_STAT_SHM_HIT,	/* served from the shared memory tier */
+	CACHE_STAT_MISS,	/* no slot for the key */
+	CACHE_STAT_EXPIRED,	/* regenerated while the client waited */
+	CACHE_STAT_STALE,	/* served stale, regenerated in the background */
+	CACHE_STAT_NOT_MODIFIED,	/* answered with a 304 */
+	CACHE_STAT_LOCK_BUSY,	/* another process was filling the slot */
+	CACHE_STAT_LOCK_WAITED,	/* served after waiting for that process */
+	CACHE_STAT_LOCK_FAILED,	/* generated without the cache */
+	CACHE_STAT_FILL,
+	CACHE_STAT_FILL_FAILED,
+	CACHE_STAT_FILL_MS,	/* total time spent filling slots */
+	CACHE_STAT_BYTES,	/* bytes of responses printed from slots */
+	CACHE_STAT_MAX
+};
+
+#define CACHE_FILL_BUCKETS 12
+
+void cache_stat(const char *path, enum cache_stat stat, uint64_t n);
+void cache_stat_fill(const char *path, uint64_t ms);
+
+void cache_add_usage(const char *path, intmax_t delta);
+void cache_gc_in_background(const char *path);
 
 #endif
@@ -0,0 +1,247 @@
+/* Copyright (C) Dominic R and contributors (see AUTHORS)
+ *
+ * Licensed under GNU General Public License v2
+ *   (see COPYING for full license text)
+ */
+
+/* Every slot created for a page (or fragment) of a repository is listed
+ * in the journal of that repository, a file in the journal directory of
+ * the cache root named after the hash of the repository url. Each line
+ * holds the name of a slot, appended with O_APPEND so that concurrent
+ * processes don't need a lock. A slot is only listed when it's created,
+ * not when it's regenerated, but may still be listed more than once.
+ *
+ * cache_invalidate_repo() removes all slots listed in the journal of a
+ * repository, e.g. after a push. It first renames the journal, so that
+ * slots created meanwhile go to a new one. cache_journal_compact(), run
+ * by cache_gc(), drops the slots which no longer exist from all journals
+ * the same way, so that they don't grow without a push.
+ */
+
+#include "cgit.h"
+#include "cache.h"
+#include "cache-internal.h"
+#include "strmap.h"
+
+static void journal_name(struct strbuf *name, const char *path,
+			 const char *url)
+{
+	strbuf_addstr(name, path);
+	strbuf_ensure_end(name, '/');
+	strbuf_addf(name, "%s/%016"PRIx64, CACHE_JOURNAL_DIR, hash_str64(url));
+}
+
+/* List the slot in the journal of its repository, if it has one. */
+void cache_journal_add(struct cache_slot *slot)
+{
+	struct strbuf name = STRBUF_INIT;
+	char line[CACHE_NAME_LEN + 2];
+	char *slash;
+	int fd;
+
+	if (!slot->repo)
+		return;
+	journal_name(&name, slot->root, slot->repo);
+	fd = open(name.buf, O_WRONLY | O_APPEND | O_CREAT, S_IRUSR | S_IWUSR);
+	if (fd < 0 && errno == ENOENT) {
+		/* Create the journal directory on first use */
+		slash = strrchr(name.buf, '/');
+		*slash = '\0';
+		if (!mkdir(name.buf, S_IRWXU) || errno == EEXIST) {
+			*slash = '/';
+			fd = open(name.buf, O_WRONLY | O_APPEND | O_CREAT,
+				  S_IRUSR | S_IWUSR);
+		} else
+			*slash = '/';
+	}
+	if (fd < 0) {
+		cache_log("[cgit] Unable to open journal %s: %s (%d)\n",
+			  name.buf, strerror(errno), errno);
+		goto out;
+	}
+	xsnprintf(line, sizeof(line), "%016"PRIx64"\n", slot->hash);
+	if (write_in_full(fd, line, CACHE_NAME_LEN + 1) < 0)
+		cache_log("[cgit] Unable to write journal %s: %s (%d)\n",
+			  name.buf, strerror(errno), errno);
+	close(fd);
+out:
+	strbuf_release(&name);
+}
+
+/* Remove the slot named 'hex' below 'path', from the cache directory and
+ * the shared memory tier. Returns the size of the removed slot, or -1 if
+ * there was none.
+ */
+static off_t remove_slot(const char *path, const char *hex)
+{
+	struct cache_slot slot = { NULL };
+	struct strbuf name = STRBUF_INIT;
+	struct stat st;
+	off_t size = -1;
+
+	slot.root = path;
+	slot.hash = strtoull(hex, NULL, 16);
+	cache_shm_remove(&slot);
+
+	cache_slot_name(&name, path, slot.hash, ctx.cfg.cache_size);
+	if (!lstat(name.buf, &st) && !unlink(name.buf))
+		size = st.st_size;
+	else if (errno != ENOENT)
+		cache_log("[cgit] Unable to remove %s: %s (%d)\n",
+			  name.buf, strerror(errno), errno);
+	strbuf_release(&name);
+	return size;
+}
+
+/* Move the journal 'name' aside to 'old', and read it into 'buf'.
+ * Returns 0 on success, and errno otherwise (ENOENT if there is no
+ * journal).
+ */
+static int take_journal(const char *name, struct strbuf *old,
+			struct strbuf *buf)
+{
+	int err = 0;
+
+	strbuf_reset(old);
+	strbuf_addf(old, "%s.%"PRIuMAX, name, (uintmax_t)getpid());
+	if (rename(name, old->buf))
+		return errno;
+	if (strbuf_read_file(buf, old->buf, 0) < 0)
+		err = errno;
+	unlink(old->buf);
+	return err;
+}
+
+/* Is 'p' the name of a slot, as listed in journals? */
+static int is_slot_name(const char *p, size_t len)
+{
+	return len == CACHE_NAME_LEN &&
+	       strspn(p, "0123456789abcdef") == CACHE_NAME_LEN;
+}
+
+/* Rewrite the journal 'name' below 'path', keeping each slot which still
+ * exists once. The kept names are appended to a new journal, which may
+ * already list slots created meanwhile.
+ */
+static void compact_journal(const char *path, const char *name)
+{
+	struct strbuf old = STRBUF_INIT, buf = STRBUF_INIT;
+	struct strbuf keep = STRBUF_INIT, slot = STRBUF_INIT;
+	struct strset seen = STRSET_INIT;
+	char *p, *eol;
+	int fd, err;
+
+	err = take_journal(name, &old, &buf);
+	if (err) {
+		if (err != ENOENT)
+			cache_log("[cgit] Unable to read journal %s: %s (%d)\n",
+				  name, strerror(err), err);
+		goto out;
+	}
+	for (p = buf.buf; (eol = strchr(p, '\n')); p = eol + 1) {
+		if (!is_slot_name(p, eol - p))
+			continue;
+		*eol = '\0';
+		strbuf_reset(&slot);
+		cache_slot_name(&slot, path, strtoull(p, NULL, 16),
+				ctx.cfg.cache_size);
+		if (access(slot.buf, F_OK) || !strset_add(&seen, p))
+			continue;
+		strbuf_addf(&keep, "%s\n", p);
+	}
+	if (!keep.len)
+		goto out;
+	fd = open(name, O_WRONLY | O_APPEND | O_CREAT, S_IRUSR | S_IWUSR);
+	if (fd < 0 || write_in_full(fd, keep.buf, keep.len) < 0)
+		cache_log("[cgit] Unable to write journal %s: %s (%d)\n",
+			  name, strerror(errno), errno);
+	if (fd >= 0)
+		close(fd);
+out:
+	strset_clear(&seen);
+	strbuf_release(&old);
+	strbuf_release(&buf);
+	strbuf_release(&keep);
+	strbuf_release(&slot);
+}
+
+/* Drop the slots which no longer exist, e.g. because the garbage
+ * collector removed them, from all journals of the cache in 'path'.
+ */
+void cache_journal_compact(const char *path)
+{
+	struct strbuf name = STRBUF_INIT;
+	struct dirent *ent;
+	size_t len;
+	DIR *d;
+
+	strbuf_addstr(&name, path);
+	strbuf_ensure_end(&name, '/');
+	strbuf_addstr(&name, CACHE_JOURNAL_DIR);
+	d = opendir(name.buf);
+	if (!d)
+		goto out;
+	strbuf_addch(&name, '/');
+	len = name.len;
+	while ((ent = readdir(d)) != NULL) {
+		/* Skip journals which are being taken by others */
+		if (!is_slot_name(ent->d_name, strlen(ent->d_name)))
+			continue;
+		strbuf_setlen(&name, len);
+		strbuf_addstr(&name, ent->d_name);
+		compact_journal(path, name.buf);
+	}
+	closedir(d);
+out:
+	strbuf_release(&name);
+}
+
+/* Remove the slots of the repository 'url' from the cache in 'path'.
+ * With verbose set, a summary is printed on stdout. Returns 0 on success
+ * and errno otherwise.
+ */
+int cache_invalidate_repo(const char *path, const char *url, int verbose)
+{
+	struct strbuf name = STRBUF_INIT;
+	struct strbuf old = STRBUF_INIT;
+	struct strbuf buf = STRBUF_INIT;
+	char *p, *eol;
+	intmax_t delta = 0;
+	off_t size;
+	int removed = 0, err = 0;
+
+	if (!path) {
+		cache_log("[cgit] cache path not specified\n");
+		return EINVAL;
+	}
+
+	journal_name(&name, path, url);
+	err = take_journal(name.buf, &old, &buf);
+	if (err == ENOENT) {
+		err = 0;
+		goto out;
+	}
+
+	for (p = buf.buf; (eol = strchr(p, '\n')); p = eol + 1) {
+		if (!is_slot_name(p, eol - p))
+			continue;
+		*eol = '\0';
+		size = remove_slot(path, p);
+		if (size < 0)
+			continue;
+		removed++;
+		delta -= size;
+	}
+	cache_add_usage(path, delta);
+out:
+	if (err)
+		cache_log("[cgit] Unable to read journal %s: %s (%d)\n",
+			  name.buf, strerror(err), err);
+	else if (verbose)
+		printf("removed %d cache slots of %s (%"PRIuMAX" bytes)\n",
+		       removed, url, (uintmax_t)-delta);
+	strbuf_release(&name);
+	strbuf_release(&old);
+	strbuf_release(&buf);
+	return err;
+}
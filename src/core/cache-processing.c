@@ -31,13 +31,295 @@ unsigned long hash_str(const char *str)
 	return h;
 }
 
+/* 64-bit FNV-1a, which names the cache slots */
+#define FNV64_OFFSET 0xcbf29ce484222325ULL
+#define FNV64_PRIME  0x00000100000001b3ULL
+
+uint64_t hash_str64(const char *str)
+{
+	uint64_t h = FNV64_OFFSET;
+	unsigned char *s = (unsigned char *)str;
+
+	if (!s)
+		return h;
+
+	while (*s) {
+		h ^= *s++;
+		h *= FNV64_PRIME;
+	}
+	return h;
+}
+
+/* Check whether 'name' consists of exactly 'len' lowercase hex digits */
+static int is_hex_name(const char *name, size_t len)
+{
+	return strlen(name) == len && strspn(name, "0123456789abcdef") == len;
+}
+
+struct shard_entry {
+	time_t mtime;
+	off_t size;
+	char name[CACHE_NAME_LEN + 1];
+};
+
+static int cmp_shard_entry(const void *a, const void *b)
+{
+	const struct shard_entry *x = a, *y = b;
+
+	return (x->mtime > y->mtime) - (x->mtime < y->mtime);
+}
+
+/* Make room for the slot about to be filled, by removing the oldest
+ * other slots in its shard until less than `shard_limit` are left. The
+ * slots are only looked at if there are too many.
+ */
+static void evict_from_shard(struct cache_slot *slot)
+{
+	struct shard_entry *entries = NULL;
+	int nr = 0, alloc = 0, i;
+	intmax_t freed = 0;
+	struct strbuf name = STRBUF_INIT;
+	const char *base = strrchr(slot->cache_name, '/') + 1;
+	size_t prefixlen = base - slot->cache_name;
+	struct dirent *ent;
+	struct stat st;
+	DIR *dir;
+
+	strbuf_add(&name, slot->cache_name, prefixlen);
+	dir = opendir(name.buf);
+	if (!dir)
+		goto out;
+	while ((ent = readdir(dir)) != NULL) {
+		if (!is_hex_name(ent->d_name, CACHE_NAME_LEN) ||
+		    !strcmp(ent->d_name, base))
+			continue;
+		ALLOC_GROW(entries, nr + 1, alloc);
+		memcpy(entries[nr].name, ent->d_name, CACHE_NAME_LEN + 1);
+		nr++;
+	}
+	closedir(dir);
+	if (nr < slot->shard_limit)
+		goto out;
+
+	for (i = 0; i < nr; i++) {
+		strbuf_setlen(&name, prefixlen);
+		strbuf_addstr(&name, entries[i].name);
+		if (stat(name.buf, &st)) {
+			/* Removed meanwhile, so it's gone first */
+			entries[i].mtime = 0;
+			entries[i].size = 0;
+			continue;
+		}
+		entries[i].mtime = st.st_mtime;
+		entries[i].size = st.st_size;
+	}
+	QSORT(entries, nr, cmp_shard_entry);
+	for (i = 0; i <= nr - slot->shard_limit; i++) {
+		strbuf_setlen(&name, prefixlen);
+		strbuf_addstr(&name, entries[i].name);
+		if (unlink(name.buf) && errno != ENOENT)
+			cache_log("[cgit] Unable to evict slot %s: %s (%d)\n",
+				  name.buf, strerror(errno), errno);
+		else
+			freed += entries[i].size;
+	}
+	cache_add_usage(slot->root, -freed);
+out:
+	free(entries);
+	strbuf_release(&name);
+}
+
+/* Remove the slots of the flat layout used by earlier versions, which
+ * were named after the 32-bit hash of their key. They lack the slot
+ * header, so they couldn't be served anymore anyway. Once done, the
+ * layout file marks the cache as migrated.
+ */
+static void migrate_legacy_slots(const char *path)
+{
+	struct strbuf name = STRBUF_INIT;
+	struct dirent *ent;
+	size_t prefixlen;
+	DIR *dir;
+	int fd;
+
+	strbuf_addstr(&name, path);
+	strbuf_ensure_end(&name, '/');
+	prefixlen = name.len;
+	dir = opendir(path);
+	if (!dir)
+		goto out;
+	while ((ent = readdir(dir)) != NULL) {
+		if (strspn(ent->d_name, "0123456789abcdef") != 8 ||
+		    (ent->d_name[8] && strcmp(ent->d_name + 8, ".lock")))
+			continue;
+		strbuf_setlen(&name, prefixlen);
+		strbuf_addstr(&name, ent->d_name);
+		unlink(name.buf);
+	}
+	closedir(dir);
+
+	strbuf_setlen(&name, prefixlen);
+	strbuf_addstr(&name, CACHE_LAYOUT_FILE);
+	fd = open(name.buf, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
+	if (fd < 0 || write_in_full(fd, "sharded\n", 8) < 0)
+		cache_log("[cgit] Unable to write %s: %s (%d)\n",
+			  name.buf, strerror(errno), errno);
+	if (fd >= 0)
+		close(fd);
+out:
+	strbuf_release(&name);
+}
+
+/* Migrate a cache which hasn't been marked as sharded yet. */
+static void check_layout(const char *path)
+{
+	struct strbuf name = STRBUF_INIT;
+
+	strbuf_addstr(&name, path);
+	strbuf_ensure_end(&name, '/');
+	strbuf_addstr(&name, CACHE_LAYOUT_FILE);
+	if (access(name.buf, F_OK) && errno == ENOENT)
+		migrate_legacy_slots(path);
+	strbuf_release(&name);
+}
+
+/* Get the filename of the slot with the key hash 'hash' in a cache of
+ * 'size' slots: the full hash, in the shard picked by its first two bytes.
+ */
+void cache_slot_name(struct strbuf *name, const char *path, uint64_t hash,
+		     int size)
+{
+	unsigned shard = (unsigned)(hash >> 48) % cache_shards(size);
+
+	strbuf_addstr(name, path);
+	strbuf_ensure_end(name, '/');
+	strbuf_addf(name, "%02x/%02x/%016"PRIx64,
+		    shard >> 8, shard & 0xff, hash);
+}
+
+/* If the expired slot may still be served, regenerate it in a detached
+ * child process and return 1; the current request is then served from
+ * the stale slot. Otherwise return 0, and the caller has to regenerate
+ * the slot itself.
+ */
+static int refresh_slot(struct cache_slot *slot)
+{
+	pid_t pid;
+	int fd;
+
+	if (!cache_is_stale(slot))
+		return 0;
+
+	/* Don't let the child inherit any pending output */
+	html_flush();
+	fflush(stdout);
+
+	pid = fork();
+	if (pid < 0) {
+		cache_log("[cgit] Unable to refresh slot %s: %s (%d)\n",
+			  slot->cache_name, strerror(errno), errno);
+		return 0;
+	}
+	if (pid > 0)
+		return 1;
+
+	/* The client must not wait for, nor see, the output of the child */
+	fd = open("/dev/null", O_RDWR);
+	if (fd < 0 || dup2(fd, STDIN_FILENO) < 0 || dup2(fd, STDOUT_FILENO) < 0)
+		exit(1);
+	close(fd);
+
+	/* Nobody is waiting for the content */
+	slot->tee = 0;
+
+	/* If the slot is already being regenerated, we're done */
+	if (cache_lock_slot(slot))
+		exit(0);
+	if (cache_is_modified(slot) || cache_fill_slot(slot)) {
+		cache_unlock_slot(slot, 0);
+		exit(1);
+	}
+	exit(cache_unlock_slot(slot, 1) ? 1 : 0);
+}
+
+/* Answer a conditional request for the slot, going by the headers of
+ * the response, which are in the slot buffer after the slot header.
+ */
+static int print_not_modified(struct cache_slot *slot)
+{
+	off_t start = cache_response_offset(slot);
+
+	if (!(slot->hdr.flags & CACHE_SLOT_HTTP) || slot->datalen <= start ||
+	    !cache_print_not_modified(slot->data + start,
+				      slot->datalen - start))
+		return 0;
+	cache_stat(slot->root, CACHE_STAT_NOT_MODIFIED, 1);
+	return 1;
+}
+
+static int print_slot(struct cache_slot *slot)
+{
+	int err = 0;
+
+	/* In tee mode, the client has already seen the content */
+	if (!slot->teed && !print_not_modified(slot) &&
+	    (err = cache_print_slot(slot)) != 0) {
+		cache_log("[cgit] error printing cache %s: %s (%d)\n",
+			  slot->cache_name,
+			  strerror(err),
+			  err);
+	}
+	/* Keep fresh slots in memory for the next request */
+	if (!err && !cache_is_expired(slot))
+		cache_shm_store(slot);
+	cache_close_slot(slot);
+	return err;
+}
+
+/* Another process holds the lock, i.e. is generating the content for
+ * this slot right now. Rather than generating the same content in
+ * parallel, wait for it to show up in the cache, polling with increasing
+ * delays, at most `lock_attempts` times and for at most `max_wait`
+ * seconds. Returns 1 if the slot now holds fresh content for our key
+ * (the slot is then open for printing), and 0 otherwise, in which case
+ * *err is the result of the last attempt to lock the slot ourselves.
+ */
+static int wait_for_slot(struct cache_slot *slot, int *err)
+{
+	int attempt, delay = 50, waited = 0;
+
+	for (attempt = 0; attempt < slot->lock_attempts; attempt++) {
+		if (waited >= slot->max_wait * 1000)
+			break;
+		if (delay > slot->max_wait * 1000 - waited)
+			delay = slot->max_wait * 1000 - waited;
+		sleep_millisec(delay);
+		waited += delay;
+		delay *= 2;
+
+		if (!cache_open_slot(slot) && slot->match &&
+		    !cache_is_expired(slot))
+			return 1;
+		cache_close_slot(slot);
+
+		*err = cache_lock_slot(slot);
+		if (*err != EAGAIN && *err != EACCES)
+			break;
+	}
+	return 0;
+}
+
 static int process_slot(struct cache_slot *slot)
 {
 	int err;
 
+	if (cache_shm_print(slot))
+		return 0;
+
 	err = cache_open_slot(slot);
 	if (!err && slot->match) {
-		if (cache_is_expired(slot)) {
+		if (cache_is_expired(slot) && !refresh_slot(slot)) {
+			cache_stat(slot->root, CACHE_STAT_EXPIRED, 1);
 			if (!cache_lock_slot(slot)) {
 				/* If the cachefile has been replaced between
 				 * `open_slot` and `lock_slot`, we'll just
@@ -59,43 +341,56 @@ static int process_slot(struct cache_slot *slot)
 					cache_unlock_slot(slot, 0);
 					cache_close_lock(slot);
 				} else {
-					cache_close_slot(slot);
+					/* The new slot is mapped already */
+					close(slot->cache_fd);
 					cache_unlock_slot(slot, 1);
 					slot->cache_fd = slot->lock_fd;
 				}
 			}
+		} else {
+			cache_stat(slot->root, cache_is_expired(slot) ?
+				   CACHE_STAT_STALE : CACHE_STAT_HIT, 1);
+			cache_touch_slot(slot);
 		}
-		if ((err = cache_print_slot(slot)) != 0) {
-			cache_log("[cgit] error printing cache %s: %s (%d)\n",
-				  slot->cache_name,
-				  strerror(err),
-				  err);
-		}
-		cache_close_slot(slot);
-		return err;
+		return print_slot(slot);
 	}
+	cache_stat(slot->root, CACHE_STAT_MISS, 1);
 
 	/* If the cache slot does not exist (or its key doesn't match the
 	 * current key), lets try to create a new cache slot for this
 	 * request. If this fails (for whatever reason), lets just generate
 	 * the content without caching it and fool the caller to believe
 	 * everything worked out (but print a warning on stdout).
+	 *
+	 * If some other process is already creating the slot, we'd rather
+	 * wait for it to finish and print its result.
 	 */
 
 	cache_close_slot(slot);
-	if ((err = cache_lock_slot(slot)) != 0) {
+	err = cache_lock_slot(slot);
+	if (err == EAGAIN || err == EACCES) {
+		cache_stat(slot->root, CACHE_STAT_LOCK_BUSY, 1);
+		if (wait_for_slot(slot, &err)) {
+			cache_stat(slot->root, CACHE_STAT_LOCK_WAITED, 1);
+			return print_slot(slot);
+		}
+	}
+	if (err) {
 		cache_log("[cgit] Unable to lock slot %s: %s (%d)\n",
 			  slot->lock_name, strerror(err), err);
+		cache_stat(slot->root, CACHE_STAT_LOCK_FAILED, 1);
 		slot->fn();
 		return 0;
 	}
+	evict_from_shard(slot);
 
 	if ((err = cache_fill_slot(slot)) != 0) {
 		cache_log("[cgit] Unable to fill slot %s: %s (%d)\n",
 			  slot->lock_name, strerror(err), err);
 		cache_unlock_slot(slot, 0);
 		cache_close_lock(slot);
-		slot->fn();
+		if (!slot->teed)
+			slot->fn();
 		return 0;
 	}
 	// We've got a valid cache slot in the lock file, which
@@ -106,23 +401,17 @@ static int process_slot(struct cache_slot *slot)
 	// Lets avoid such a race by just printing the content of
 	// the lock file.
 	slot->cache_fd = slot->lock_fd;
-	cache_unlock_slot(slot, 1);
-	if ((err = cache_print_slot(slot)) != 0) {
-		cache_log("[cgit] error printing cache %s: %s (%d)\n",
-			  slot->cache_name,
-			  strerror(err),
-			  err);
-	}
-	cache_close_slot(slot);
-	return err;
+	if (!cache_unlock_slot(slot, 1))
+		cache_journal_add(slot);
+	return print_slot(slot);
 }
 
-/* Print cached content to stdout, generate the content if necessary. */
-int cache_process(int size, const char *path, const char *key, int ttl,
-		  cache_fill_fn fn)
+/* Print cached content to stdout, generate the content if necessary.
+ * A fragment is a part of a page, without HTTP headers of its own.
+ */
+static int process(int size, const char *path, const char *key, int ttl,
+		   int stale, cache_fill_fn fn, int fragment)
 {
-	unsigned long hash;
-	int i;
 	struct strbuf filename = STRBUF_INIT;
 	struct strbuf lockname = STRBUF_INIT;
 	struct cache_slot slot;
@@ -142,22 +431,33 @@ int cache_process(int size, const char *path, const char *key, int ttl,
 	}
 	if (!key)
 		key = "";
-	hash = hash_str(key) % size;
-	strbuf_addstr(&filename, path);
-	strbuf_ensure_end(&filename, '/');
-	for (i = 0; i < 8; i++) {
-		strbuf_addf(&filename, "%x", (unsigned char)(hash & 0xf));
-		hash >>= 4;
-	}
+	check_layout(path);
+	cache_slot_name(&filename, path, hash_str64(key), size);
 	strbuf_addbuf(&lockname, &filename);
 	strbuf_addstr(&lockname, ".lock");
 	slot.fn = fn;
 	slot.ttl = ttl;
+	slot.negative_ttl = ctx.cfg.cache_negative_ttl;
+	slot.shard_limit = cache_shard_limit(size);
+	slot.max_stale = stale;
+	slot.lock_attempts = ctx.cfg.max_lock_attempts;
+	slot.tee = fragment ? 0 : ctx.cfg.cache_tee;
+	slot.teed = 0;
+	slot.fragment = fragment;
+	slot.max_wait = ctx.cfg.cache_max_create_time;
 	slot.stdout_fd = -1;
+	slot.compressed = 0;
+	slot.negative = 0;
+	slot.map = NULL;
+	slot.data = slot.buf;
+	slot.datalen = 0;
+	slot.root = path;
+	slot.repo = ctx.repo ? ctx.repo->url : NULL;
 	slot.cache_name = filename.buf;
 	slot.lock_name = lockname.buf;
 	slot.key = key;
 	slot.keylen = strlen(key);
+	slot.hash = hash_str64(key);
 	result = process_slot(&slot);
 
 	strbuf_release(&filename);
@@ -165,6 +465,18 @@ int cache_process(int size, const char *path, const char *key, int ttl,
 	return result;
 }
 
+int cache_process(int size, const char *path, const char *key, int ttl,
+		  int stale, cache_fill_fn fn)
+{
+	return process(size, path, key, ttl, stale, fn, 0);
+}
+
+int cache_fragment(int size, const char *path, const char *key, int ttl,
+		   cache_fill_fn fn)
+{
+	return process(size, path, key, ttl, 0, fn, 1);
+}
+
 /* Return a strftime formatted date/time
  * NB: the result from this function is to shared memory
  */
@@ -180,53 +492,69 @@ static char *sprintftime(const char *format, time_t time)
 	return buf;
 }
 
-int cache_ls(const char *path)
+/* List the slots below 'fullname', which is 'depth' levels of shards
+ * below the cache root.
+ */
+static int ls_dir(struct strbuf *fullname, int depth)
 {
 	DIR *dir;
 	struct dirent *ent;
 	int err = 0;
 	struct cache_slot slot = { NULL };
-	struct strbuf fullname = STRBUF_INIT;
 	size_t prefixlen;
 
-	if (!path) {
-		cache_log("[cgit] cache path not specified\n");
-		return -1;
-	}
-	dir = opendir(path);
+	dir = opendir(fullname->buf);
 	if (!dir) {
 		err = errno;
 		cache_log("[cgit] unable to open path %s: %s (%d)\n",
-			  path, strerror(err), err);
+			  fullname->buf, strerror(err), err);
 		return err;
 	}
-	strbuf_addstr(&fullname, path);
-	strbuf_ensure_end(&fullname, '/');
-	prefixlen = fullname.len;
+	strbuf_ensure_end(fullname, '/');
+	prefixlen = fullname->len;
 	while ((ent = readdir(dir)) != NULL) {
-		if (strlen(ent->d_name) != 8)
+		if (!is_hex_name(ent->d_name,
+				 depth < 2 ? 2 : CACHE_NAME_LEN))
+			continue;
+		strbuf_setlen(fullname, prefixlen);
+		strbuf_addstr(fullname, ent->d_name);
+		if (depth < 2) {
+			ls_dir(fullname, depth + 1);
 			continue;
-		strbuf_setlen(&fullname, prefixlen);
-		strbuf_addstr(&fullname, ent->d_name);
-		slot.cache_name = fullname.buf;
+		}
+		slot.cache_name = fullname->buf;
 		if ((err = cache_open_slot(&slot)) != 0) {
 			cache_log("[cgit] unable to open path %s: %s (%d)\n",
-				  fullname.buf, strerror(err), err);
+				  fullname->buf, strerror(err), err);
 			continue;
 		}
-		htmlf("%s %s %10"PRIuMAX" %s\n",
-		      fullname.buf,
+		htmlf("%s %s %10"PRIuMAX" %.*s\n",
+		      fullname->buf,
 		      sprintftime("%Y-%m-%d %H:%M:%S",
 				  slot.cache_st.st_mtime),
 		      (uintmax_t)slot.cache_st.st_size,
-		      slot.buf);
+		      (int)strnlen(slot.data, slot.datalen), slot.data);
 		cache_close_slot(&slot);
 	}
 	closedir(dir);
-	strbuf_release(&fullname);
 	return 0;
 }
 
+int cache_ls(const char *path)
+{
+	struct strbuf fullname = STRBUF_INIT;
+	int err;
+
+	if (!path) {
+		cache_log("[cgit] cache path not specified\n");
+		return -1;
+	}
+	strbuf_addstr(&fullname, path);
+	err = ls_dir(&fullname, 0);
+	strbuf_release(&fullname);
+	return err;
+}
+
 /* Print a message to stdout */
 void cache_log(const char *format, ...)
 {
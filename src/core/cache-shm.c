@@ -0,0 +1,265 @@
+/* Copyright (C) Dominic R and contributors (see AUTHORS)
+ *
+ * Licensed under GNU General Public License v2
+ *   (see COPYING for full license text)
+ */
+
+/* With cache-shm-size set, small cache slots are also kept in a hash
+ * table in a shared memory file in /dev/shm, which is consulted before
+ * the cache directory. A hit in this tier is served without any file
+ * system operation beyond mapping the table (once per process).
+ *
+ * The table is direct-mapped: the 64-bit hash of a key selects a single
+ * entry, which holds the same content as the slot file, together with
+ * the mtime of that file. Each entry is protected by a sequence
+ * count: a writer makes it odd while it copies a slot in, and readers
+ * copy the entry out and only use the copy if the count was even and
+ * unchanged in the meantime. Readers thus never wait, and a slot is only
+ * visible once it has been completely written.
+ *
+ * Hits in this tier still touch the slot file now and then, like hits
+ * from the cache directory do, so that the garbage collection doesn't
+ * take the hottest slots for unused ones. The time of the last touch is
+ * kept in the entry.
+ */
+
+#include "cgit.h"
+#include "cache.h"
+#include "cache-internal.h"
+#include "html.h"
+
+#define SHM_ENTRY_SIZE (64 * 1024)
+#define SHM_VERSION 3
+
+struct shm_entry {
+	uint32_t seq;
+	uint32_t len;
+	uint64_t hash;
+	int64_t mtime;
+	int64_t touched;
+	uint32_t keylen;
+	char data[FLEX_ARRAY];
+};
+
+#define SHM_DATA_SIZE (SHM_ENTRY_SIZE - offsetof(struct shm_entry, data))
+
+#ifdef __GNUC__
+
+static char *table;
+static size_t table_entries;
+static int table_failed;
+
+/* Map the table for the cache in 'path'. The name of the file includes
+ * the size and format of the table, so that a process using a different
+ * configuration doesn't get to see it.
+ */
+static int map_table(const char *path)
+{
+	struct strbuf name = STRBUF_INIT;
+	size_t size;
+	struct stat st;
+	int fd;
+
+	if (table)
+		return 0;
+	if (table_failed)
+		return -1;
+
+	table_entries = ctx.cfg.cache_shm_size / SHM_ENTRY_SIZE;
+	size = table_entries * SHM_ENTRY_SIZE;
+	strbuf_addf(&name, "/dev/shm/cgit-%016"PRIx64"-%"PRIuMAX"-%d",
+		    hash_str64(path), (uintmax_t)size, SHM_VERSION);
+	fd = open(name.buf, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+	if (fd < 0 || fstat(fd, &st) ||
+	    (st.st_size != size && ftruncate(fd, size))) {
+		cache_log("[cgit] Unable to open %s: %s (%d)\n",
+			  name.buf, strerror(errno), errno);
+		goto fail;
+	}
+	table = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (table == MAP_FAILED) {
+		cache_log("[cgit] Unable to map %s: %s (%d)\n",
+			  name.buf, strerror(errno), errno);
+		table = NULL;
+		goto fail;
+	}
+	close(fd);
+	strbuf_release(&name);
+	return 0;
+fail:
+	if (fd >= 0)
+		close(fd);
+	strbuf_release(&name);
+	table_failed = 1;
+	return -1;
+}
+
+/* Update the atime of the slot file, at most once a minute per entry */
+static void touch_slot(struct cache_slot *slot, struct shm_entry *entry)
+{
+	struct timespec times[2] = {
+		{ .tv_nsec = UTIME_NOW },
+		{ .tv_nsec = UTIME_OMIT },
+	};
+	int64_t now = time(NULL), touched;
+
+	touched = __atomic_load_n(&entry->touched, __ATOMIC_RELAXED);
+	if (touched + 60 > now ||
+	    !__atomic_compare_exchange_n(&entry->touched, &touched, now, 0,
+					 __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		return;
+	utimensat(AT_FDCWD, slot->cache_name, times, 0);
+}
+
+static struct shm_entry *get_entry(struct cache_slot *slot)
+{
+	if (!ctx.cfg.cache_shm_size || map_table(slot->root) ||
+	    !table_entries)
+		return NULL;
+	return (struct shm_entry *)(table +
+		(slot->hash % table_entries) * SHM_ENTRY_SIZE);
+}
+
+/* Print the slot from the shared memory tier, if it's there and hasn't
+ * expired. Returns 1 if the slot was printed, and 0 otherwise.
+ */
+int cache_shm_print(struct cache_slot *slot)
+{
+	struct shm_entry *entry = get_entry(slot);
+	uint32_t seq, len, keylen;
+	off_t start = cache_response_offset(slot), from, to;
+	const char *resp;
+	int64_t mtime;
+	char *buf;
+	int hit = 0, err = 0;
+
+	if (!entry)
+		return 0;
+
+	seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
+	if (seq & 1)
+		return 0;
+	len = entry->len;
+	keylen = entry->keylen;
+	if (entry->hash != slot->hash || keylen != slot->keylen ||
+	    len > SHM_DATA_SIZE || len < start)
+		return 0;
+	mtime = entry->mtime;
+	buf = xmalloc(len);
+	memcpy(buf, entry->data, len);
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&entry->seq, __ATOMIC_RELAXED) != seq)
+		goto out;
+
+	if (memcmp(buf, slot->key, keylen + 1))
+		goto out;
+	memcpy(&slot->hdr, buf + keylen + 1, sizeof(slot->hdr));
+	slot->cache_st.st_mtime = mtime;
+	slot->negative = !!(slot->hdr.flags & CACHE_SLOT_ERROR);
+	if (cache_is_expired(slot))
+		goto out;
+	if ((slot->hdr.flags & CACHE_SLOT_GZIP) && !cache_accepts_gzip())
+		goto out;
+
+	hit = 1;
+	cache_stat(slot->root, CACHE_STAT_SHM_HIT, 1);
+	touch_slot(slot, entry);
+	resp = buf + start;
+	if ((slot->hdr.flags & CACHE_SLOT_HTTP) &&
+	    cache_print_not_modified(resp, len - start)) {
+		cache_stat(slot->root, CACHE_STAT_NOT_MODIFIED, 1);
+		goto out;
+	}
+	html_flush();
+	from = 0;
+	to = len - start;
+	if (slot->hdr.flags & CACHE_SLOT_HTTP) {
+		err = cache_print_head(&slot->hdr, resp, &from, &to);
+		resp += slot->hdr.body_offset;
+	}
+	cache_stat(slot->root, CACHE_STAT_BYTES, to - from);
+	if (!err && write_in_full(STDOUT_FILENO, resp + from, to - from) < 0)
+		err = errno;
+	if (err)
+		cache_log("[cgit] error printing cache %s from memory: %s (%d)\n",
+			  slot->cache_name, strerror(err), err);
+out:
+	free(buf);
+	return hit;
+}
+
+/* Copy the open slot into the shared memory tier, if it fits. If another
+ * process is writing to the same entry, the slot is just left out.
+ */
+void cache_shm_store(struct cache_slot *slot)
+{
+	struct shm_entry *entry;
+	uint32_t seq;
+	off_t size = slot->cache_st.st_size;
+
+	if (size > SHM_DATA_SIZE || size < cache_response_offset(slot) ||
+	    (slot->negative && !slot->negative_ttl) ||
+	    !(entry = get_entry(slot)))
+		return;
+
+	seq = __atomic_load_n(&entry->seq, __ATOMIC_RELAXED);
+	if (seq & 1 ||
+	    !__atomic_compare_exchange_n(&entry->seq, &seq, seq + 1, 0,
+					 __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	if (slot->data == slot->map && slot->datalen == size)
+		memcpy(entry->data, slot->data, size);
+	else if (pread_in_full(slot->cache_fd, entry->data, size, 0) != size) {
+		/* Leave an entry which doesn't match any key */
+		entry->len = 0;
+		__atomic_store_n(&entry->seq, seq + 2, __ATOMIC_RELEASE);
+		return;
+	}
+	entry->len = size;
+	entry->hash = slot->hash;
+	entry->mtime = slot->cache_st.st_mtime;
+	entry->touched = 0;
+	entry->keylen = slot->keylen;
+	__atomic_store_n(&entry->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* Drop the slot from the shared memory tier, e.g. because it has been
+ * removed from the cache directory. If another process is writing to
+ * its entry, the slot is left alone.
+ */
+void cache_shm_remove(struct cache_slot *slot)
+{
+	struct shm_entry *entry = get_entry(slot);
+	uint32_t seq;
+
+	if (!entry || entry->hash != slot->hash)
+		return;
+	seq = __atomic_load_n(&entry->seq, __ATOMIC_RELAXED);
+	if (seq & 1 ||
+	    !__atomic_compare_exchange_n(&entry->seq, &seq, seq + 1, 0,
+					 __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	if (entry->hash == slot->hash)
+		entry->len = 0;
+	__atomic_store_n(&entry->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+#else
+
+int cache_shm_print(struct cache_slot *slot)
+{
+	return 0;
+}
+
+void cache_shm_store(struct cache_slot *slot)
+{
+}
+
+void cache_shm_remove(struct cache_slot *slot)
+{
+}
+
+#endif
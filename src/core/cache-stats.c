@@ -0,0 +1,196 @@
+/* Copyright (C) Dominic R and contributors (see AUTHORS)
+ *
+ * Licensed under GNU General Public License v2
+ *   (see COPYING for full license text)
+ */
+
+/* Counters of the cache (hits, misses, lock contention, fill times and
+ * so on) are kept in the stats file in the cache root, which every
+ * process maps and updates with atomic additions. They are printed by
+ * the cache_stats page and "cgit --cache-stats", and count since the
+ * stats file was created (i.e. remove it to reset them).
+ */
+
+#include "cgit.h"
+#include "cache.h"
+#include "cache-internal.h"
+#include "html.h"
+
+#define STATS_MAGIC "cgitstat"
+#define STATS_VERSION 1
+
+/* The upper bounds, in milliseconds, of the buckets of the fill time
+ * histogram; the last bucket holds the slower fills.
+ */
+static const uint64_t fill_buckets[CACHE_FILL_BUCKETS - 1] = {
+	5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000,
+};
+
+static const char *stat_names[CACHE_STAT_MAX] = {
+	[CACHE_STAT_HIT] = "hits",
+	[CACHE_STAT_SHM_HIT] = "memory_hits",
+	[CACHE_STAT_MISS] = "misses",
+	[CACHE_STAT_EXPIRED] = "expired",
+	[CACHE_STAT_STALE] = "stale",
+	[CACHE_STAT_NOT_MODIFIED] = "not_modified",
+	[CACHE_STAT_LOCK_BUSY] = "lock_busy",
+	[CACHE_STAT_LOCK_WAITED] = "lock_waited",
+	[CACHE_STAT_LOCK_FAILED] = "lock_failed",
+	[CACHE_STAT_FILL] = "fills",
+	[CACHE_STAT_FILL_FAILED] = "fill_failed",
+	[CACHE_STAT_FILL_MS] = "fill_ms",
+	[CACHE_STAT_BYTES] = "bytes_served",
+};
+
+struct cache_stats {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+	int64_t created;
+	uint64_t stats[CACHE_STAT_MAX];
+	uint64_t fill_ms[CACHE_FILL_BUCKETS];
+};
+
+#ifdef __GNUC__
+
+static struct cache_stats *stats;
+static int stats_failed;
+
+static void stats_name(struct strbuf *name, const char *path)
+{
+	strbuf_addstr(name, path);
+	strbuf_ensure_end(name, '/');
+	strbuf_addstr(name, CACHE_STATS_FILE);
+}
+
+/* Map the stats file of the cache in 'path', creating it if needed. A
+ * file of another version is started over.
+ */
+static struct cache_stats *map_stats(const char *path)
+{
+	struct strbuf name = STRBUF_INIT;
+	struct stat st;
+	void *map;
+	int fd;
+
+	if (stats || stats_failed || !path)
+		return stats;
+
+	stats_failed = 1;
+	stats_name(&name, path);
+	fd = open(name.buf, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+	if (fd < 0 || fstat(fd, &st) ||
+	    (st.st_size < sizeof(*stats) && ftruncate(fd, sizeof(*stats)))) {
+		cache_log("[cgit] Unable to open %s: %s (%d)\n",
+			  name.buf, strerror(errno), errno);
+		goto out;
+	}
+	map = mmap(NULL, sizeof(*stats), PROT_READ | PROT_WRITE, MAP_SHARED,
+		   fd, 0);
+	if (map == MAP_FAILED) {
+		cache_log("[cgit] Unable to map %s: %s (%d)\n",
+			  name.buf, strerror(errno), errno);
+		goto out;
+	}
+	stats = map;
+	stats_failed = 0;
+	if (memcmp(stats->magic, STATS_MAGIC, sizeof(stats->magic)) ||
+	    stats->version != STATS_VERSION) {
+		memset(stats, 0, sizeof(*stats));
+		stats->version = STATS_VERSION;
+		stats->created = time(NULL);
+		memcpy(stats->magic, STATS_MAGIC, sizeof(stats->magic));
+	}
+out:
+	if (fd >= 0)
+		close(fd);
+	strbuf_release(&name);
+	return stats;
+}
+
+/* Add 'n' to the counter 'stat' of the cache in 'path' */
+void cache_stat(const char *path, enum cache_stat stat, uint64_t n)
+{
+	if (map_stats(path))
+		__atomic_fetch_add(&stats->stats[stat], n, __ATOMIC_RELAXED);
+}
+
+/* Count a fill of a slot which took 'ms' milliseconds */
+void cache_stat_fill(const char *path, uint64_t ms)
+{
+	int i;
+
+	if (!map_stats(path))
+		return;
+	for (i = 0; i < ARRAY_SIZE(fill_buckets); i++)
+		if (ms <= fill_buckets[i])
+			break;
+	__atomic_fetch_add(&stats->fill_ms[i], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stats->stats[CACHE_STAT_FILL], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stats->stats[CACHE_STAT_FILL_MS], ms,
+			   __ATOMIC_RELAXED);
+}
+
+static uint64_t get_stat(enum cache_stat stat)
+{
+	return __atomic_load_n(&stats->stats[stat], __ATOMIC_RELAXED);
+}
+
+static uint64_t get_fill_ms(int bucket)
+{
+	return __atomic_load_n(&stats->fill_ms[bucket], __ATOMIC_RELAXED);
+}
+
+/* Print the counters of the cache in 'path' as "name value" lines. The
+ * hit ratio is the share of lookups which were served from the cache,
+ * fresh or stale, rather than generated while the client waited.
+ */
+int cache_print_stats(const char *path)
+{
+	uint64_t served, lookups;
+	int i;
+
+	if (!path) {
+		cache_log("[cgit] cache path not specified\n");
+		return EINVAL;
+	}
+	if (!map_stats(path))
+		return EIO;
+
+	htmlf("since %"PRId64"\n", stats->created);
+	for (i = 0; i < CACHE_STAT_MAX; i++)
+		htmlf("%s %"PRIu64"\n", stat_names[i], get_stat(i));
+	for (i = 0; i < ARRAY_SIZE(fill_buckets); i++)
+		htmlf("fill_ms_le_%"PRIu64" %"PRIu64"\n", fill_buckets[i],
+		      get_fill_ms(i));
+	htmlf("fill_ms_gt_%"PRIu64" %"PRIu64"\n", fill_buckets[i - 1],
+	      get_fill_ms(i));
+
+	served = get_stat(CACHE_STAT_HIT) + get_stat(CACHE_STAT_SHM_HIT) +
+		 get_stat(CACHE_STAT_STALE);
+	lookups = served + get_stat(CACHE_STAT_MISS) +
+		  get_stat(CACHE_STAT_EXPIRED);
+	if (lookups)
+		htmlf("hit_ratio %.4f\n", (double)served / lookups);
+	else
+		html("hit_ratio 0\n");
+	return 0;
+}
+
+#else
+
+void cache_stat(const char *path, enum cache_stat stat, uint64_t n)
+{
+}
+
+void cache_stat_fill(const char *path, uint64_t ms)
+{
+}
+
+int cache_print_stats(const char *path)
+{
+	cache_log("[cgit] cache stats are not supported by this build\n");
+	return ENOSYS;
+}
+
+#endif
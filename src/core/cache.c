@@ -7,9 +7,10 @@
  *
  *
  * The cache is just a directory structure where each file is a cache slot,
- * and each filename is based on the hash of some key (e.g. the cgit url).
- * Each file contains the full key followed by the cached content for that
- * key.
+ * and each filename is based on the hash of some key (e.g. the cgit url),
+ * see cache-internal.h for the layout.
+ * Each file contains the full key, followed by a header describing the
+ * cached response, and the response itself.
  *
  */
 
@@ -21,14 +22,56 @@
 #include <sys/sendfile.h>
 #endif
 
-/* Open an existing cache slot and fill the cache buffer with
- * (part of) the content of the cache file. Return 0 on success
+/* Map the slot file 'fd' of 'st_size' bytes. Returns the mapping, or NULL
+ * if the file has to be read instead.
+ */
+static char *map_file(int fd, off_t st_size)
+{
+	size_t size = st_size;
+	int flags = MAP_SHARED;
+	void *map;
+
+	if (!size || size != st_size)
+		return NULL;
+#ifdef MAP_POPULATE
+	if (size <= CACHE_POPULATE_SIZE)
+		flags |= MAP_POPULATE;
+#endif
+	map = mmap(NULL, size, PROT_READ, flags, fd, 0);
+	if (map == MAP_FAILED)
+		return NULL;
+	if (size > CACHE_POPULATE_SIZE)
+		madvise(map, size, MADV_SEQUENTIAL);
+	return map;
+}
+
+/* Map the open cache slot, so that its key and headers are checked, and
+ * its content printed, without copying it. Slot files are only ever
+ * replaced, never changed in place, so the mapping stays valid. Returns 0
+ * on success, and -1 if the slot has to be read instead.
+ */
+static int map_slot(struct cache_slot *slot)
+{
+	size_t size = slot->cache_st.st_size;
+	char *map = map_file(slot->cache_fd, slot->cache_st.st_size);
+
+	if (!map)
+		return -1;
+	slot->map = map;
+	slot->mapsize = size;
+	slot->data = map;
+	slot->datalen = size;
+	return 0;
+}
+
+/* Open an existing cache slot and map it, or fill the cache buffer with
+ * the start of the cache file if it can't be mapped. Return 0 on success
  * and errno otherwise.
  */
 int cache_open_slot(struct cache_slot *slot)
 {
-	char *bufz;
-	ssize_t bufkeylen = -1;
+	const char *bufz;
+	ssize_t len, bufkeylen = -1;
 
 	slot->cache_fd = open(slot->cache_name, O_RDONLY);
 	if (slot->cache_fd == -1)
@@ -37,17 +80,33 @@ int cache_open_slot(struct cache_slot *slot)
 	if (fstat(slot->cache_fd, &slot->cache_st))
 		return errno;
 
-	slot->bufsize = xread(slot->cache_fd, slot->buf, sizeof(slot->buf));
-	if (slot->bufsize < 0)
-		return errno;
+	if (map_slot(slot)) {
+		len = xread(slot->cache_fd, slot->buf, sizeof(slot->buf));
+		if (len < 0)
+			return errno;
+		slot->data = slot->buf;
+		slot->datalen = len;
+	}
 
-	bufz = memchr(slot->buf, 0, slot->bufsize);
+	bufz = memchr(slot->data, 0, slot->datalen);
 	if (bufz)
-		bufkeylen = bufz - slot->buf;
+		bufkeylen = bufz - slot->data;
+
+	/* A slot without a valid header never matches */
+	if (bufz && slot->datalen - bufkeylen - 1 >= sizeof(slot->hdr))
+		memcpy(&slot->hdr, bufz + 1, sizeof(slot->hdr));
+	if (!bufz || slot->datalen - bufkeylen - 1 < sizeof(slot->hdr) ||
+	    memcmp(slot->hdr.magic, CACHE_SLOT_MAGIC, sizeof(slot->hdr.magic)) ||
+	    slot->hdr.version != CACHE_SLOT_VERSION) {
+		memset(&slot->hdr, 0, sizeof(slot->hdr));
+		bufkeylen = -1;
+	}
 
 	if (slot->key)
 		slot->match = bufkeylen == slot->keylen &&
-		    !memcmp(slot->key, slot->buf, bufkeylen + 1);
+		    !memcmp(slot->key, slot->data, bufkeylen + 1);
+	slot->compressed = !!(slot->hdr.flags & CACHE_SLOT_GZIP);
+	slot->negative = !!(slot->hdr.flags & CACHE_SLOT_ERROR);
 
 	return 0;
 }
@@ -56,6 +115,15 @@ int cache_open_slot(struct cache_slot *slot)
 int cache_close_slot(struct cache_slot *slot)
 {
 	int err = 0;
+
+	if (slot->map) {
+		munmap(slot->map, slot->mapsize);
+		if (slot->data == slot->map) {
+			slot->data = slot->buf;
+			slot->datalen = 0;
+		}
+		slot->map = NULL;
+	}
 	if (slot->cache_fd > 0) {
 		if (close(slot->cache_fd))
 			err = errno;
@@ -65,19 +133,34 @@ int cache_close_slot(struct cache_slot *slot)
 	return err;
 }
 
-/* Print the content of the active cache slot (but skip the key). */
-int cache_print_slot(struct cache_slot *slot)
+/* A mapped slot is written from the mapping in one go, unless it's large
+ * and sendfile() can spare us the page faults.
+ */
+static int write_mapped(struct cache_slot *slot, off_t size)
 {
-	off_t off;
+	if (!slot->map || slot->data != slot->map || size > slot->mapsize)
+		return 0;
 #ifdef HAVE_LINUX_SENDFILE
-	off_t size;
+	return slot->mapsize <= CACHE_POPULATE_SIZE;
+#else
+	return 1;
 #endif
+}
 
-	off = slot->keylen + 1;
+/* Print the part [off, size) of the active cache slot */
+static int print_range(struct cache_slot *slot, off_t off, off_t size)
+{
+	if (off >= size)
+		return 0;
+	cache_stat(slot->root, CACHE_STAT_BYTES, size - off);
 
-#ifdef HAVE_LINUX_SENDFILE
-	size = slot->cache_st.st_size;
+	if (write_mapped(slot, size)) {
+		if (write_in_full(STDOUT_FILENO, slot->map + off, size - off) < 0)
+			return errno;
+		return 0;
+	}
 
+#ifdef HAVE_LINUX_SENDFILE
 	do {
 		ssize_t ret;
 		ret = sendfile(STDOUT_FILENO, slot->cache_fd, &off, size - off);
@@ -99,23 +182,92 @@ int cache_print_slot(struct cache_slot *slot)
 
 	do {
 		ssize_t ret;
-		ret = xread(slot->cache_fd, slot->buf, sizeof(slot->buf));
+		ret = xread(slot->cache_fd, slot->buf,
+			    size - off < sizeof(slot->buf) ?
+			    size - off : sizeof(slot->buf));
 		if (ret < 0)
 			return errno;
 		if (ret == 0)
 			return 0;
 		if (write_in_full(STDOUT_FILENO, slot->buf, ret) < 0)
 			return errno;
-	} while (1);
+		off += ret;
+	} while (off < size);
+	return 0;
+}
+
+/* Print the response in the active cache slot (but skip the key and the
+ * slot header). If its headers are in the slot buffer, they're printed
+ * with the Content-Length of the body, or of the requested range of it.
+ */
+int cache_print_slot(struct cache_slot *slot)
+{
+	off_t start = cache_response_offset(slot);
+	off_t from, to;
+	int err;
+
+	html_flush();
+	if (slot->compressed && !cache_accepts_gzip())
+		return cache_print_inflated(slot);
+
+	if (!(slot->hdr.flags & CACHE_SLOT_HTTP) ||
+	    start + slot->hdr.body_offset > slot->datalen)
+		return print_range(slot, start, slot->cache_st.st_size);
+
+	err = cache_print_head(&slot->hdr, slot->data + start, &from, &to);
+	if (err)
+		return err;
+	start += slot->hdr.body_offset;
+	return print_range(slot, start + from, start + to);
+}
+
+/* Record the use of the slot in its atime, which the garbage collector
+ * goes by. This is done explicitly, since atime updates by the kernel
+ * depend on the mount options, and at most once a minute.
+ */
+void cache_touch_slot(struct cache_slot *slot)
+{
+	struct timespec times[2] = {
+		{ .tv_nsec = UTIME_NOW },
+		{ .tv_nsec = UTIME_OMIT },
+	};
+
+	if (slot->cache_st.st_atime + 60 > time(NULL))
+		return;
+	futimens(slot->cache_fd, times);
+}
+
+/* The ttl of the slot: error pages are kept for at most negative_ttl
+ * minutes, whatever the ttl of the page they were requested as.
+ */
+static int slot_ttl(struct cache_slot *slot)
+{
+	if (slot->negative && slot->negative_ttl >= 0 &&
+	    (slot->ttl < 0 || slot->negative_ttl < slot->ttl))
+		return slot->negative_ttl;
+	return slot->ttl;
 }
 
 /* Check if the slot has expired */
 int cache_is_expired(struct cache_slot *slot)
 {
-	if (slot->ttl < 0)
+	int ttl = slot_ttl(slot);
+
+	if (ttl < 0)
 		return 0;
 	else
-		return slot->cache_st.st_mtime + slot->ttl * 60 < time(NULL);
+		return slot->cache_st.st_mtime + ttl * 60 < time(NULL);
+}
+
+/* Check if an expired slot may still be served while it's regenerated.
+ * Error pages are always regenerated while the client waits.
+ */
+int cache_is_stale(struct cache_slot *slot)
+{
+	if (slot->ttl < 0 || slot->max_stale <= 0 || slot->negative)
+		return 0;
+	return slot->cache_st.st_mtime + (slot->ttl + slot->max_stale) * 60 >=
+		time(NULL);
 }
 
 /* Check if the slot has been modified since we opened it.
@@ -145,12 +297,34 @@ int cache_close_lock(struct cache_slot *slot)
 	return err;
 }
 
+/* Create the shard directories for the slot 'name', if needed.
+ * Returns 0 on success and errno otherwise.
+ */
+int cache_create_shard(const char *name)
+{
+	struct strbuf dir = STRBUF_INIT;
+	char *slash;
+	int err = 0;
+
+	strbuf_add(&dir, name, strrchr(name, '/') - name);
+	slash = strrchr(dir.buf, '/');
+	*slash = '\0';
+	if (mkdir(dir.buf, S_IRWXU) && errno != EEXIST)
+		err = errno;
+	*slash = '/';
+	if (!err && mkdir(dir.buf, S_IRWXU) && errno != EEXIST)
+		err = errno;
+	strbuf_release(&dir);
+	return err;
+}
+
 /* Create a lockfile used to store the generated content for a cache
  * slot, and write the slot key + \0 into it.
  * Returns 0 on success and errno otherwise.
  */
 int cache_lock_slot(struct cache_slot *slot)
 {
+	struct cache_slot_header hdr = { { 0 } };
 	struct flock lock = {
 		.l_type = F_WRLCK,
 		.l_whence = SEEK_SET,
@@ -160,6 +334,10 @@ int cache_lock_slot(struct cache_slot *slot)
 
 	slot->lock_fd = open(slot->lock_name, O_RDWR | O_CREAT,
 			     S_IRUSR | S_IWUSR);
+	if (slot->lock_fd == -1 && errno == ENOENT &&
+	    !cache_create_shard(slot->lock_name))
+		slot->lock_fd = open(slot->lock_name, O_RDWR | O_CREAT,
+				     S_IRUSR | S_IWUSR);
 	if (slot->lock_fd == -1)
 		return errno;
 	if (fcntl(slot->lock_fd, F_SETLK, &lock) < 0) {
@@ -168,7 +346,12 @@ int cache_lock_slot(struct cache_slot *slot)
 		slot->lock_fd = -1;
 		return saved_errno;
 	}
-	if (xwrite(slot->lock_fd, slot->key, slot->keylen + 1) < 0)
+	/* The slot header is written once the response is complete; until
+	 * then, slot->hdr still describes the slot which may be served if
+	 * that fails.
+	 */
+	if (xwrite(slot->lock_fd, slot->key, slot->keylen + 1) < 0 ||
+	    xwrite(slot->lock_fd, &hdr, sizeof(hdr)) < 0)
 		return errno;
 	return 0;
 }
@@ -179,11 +362,22 @@ int cache_lock_slot(struct cache_slot *slot)
  */
 int cache_unlock_slot(struct cache_slot *slot, int replace_old_slot)
 {
+	struct stat st;
+	intmax_t delta = 0;
 	int err;
 
-	if (replace_old_slot)
+	/* Error pages with a negative_ttl of 0 aren't kept at all */
+	if (slot->negative && !slot->negative_ttl)
+		replace_old_slot = 0;
+
+	if (replace_old_slot) {
+		if (ctx.cfg.cache_max_bytes && !fstat(slot->lock_fd, &st)) {
+			delta = st.st_size;
+			if (!stat(slot->cache_name, &st))
+				delta -= st.st_size;
+		}
 		err = rename(slot->lock_name, slot->cache_name);
-	else
+	} else
 		err = unlink(slot->lock_name);
 
 	/* Restore stdout and close the temporary FD. */
@@ -196,33 +390,188 @@ int cache_unlock_slot(struct cache_slot *slot, int replace_old_slot)
 	if (err)
 		return errno;
 
+	if (replace_old_slot && slot->root)
+		cache_add_usage(slot->root, delta);
 	return 0;
 }
 
-/* Generate the content for the current cache slot by redirecting
- * stdout to the lock-fd and invoking the callback function
+/* Copy everything read from 'in' to both the lockfile and the client.
+ * The lockfile always gets the complete content, even if the client
+ * goes away halfway through.
  */
-int cache_fill_slot(struct cache_slot *slot)
+static NORETURN void tee_slot(struct cache_slot *slot, int in)
+{
+	char buf[CACHE_BUFSIZE];
+	int client = slot->stdout_fd;
+	ssize_t len;
+
+	signal(SIGPIPE, SIG_IGN);
+	while ((len = xread(in, buf, sizeof(buf))) > 0) {
+		if (client >= 0 && write_in_full(client, buf, len) < 0)
+			client = -1;
+		if (write_in_full(slot->lock_fd, buf, len) < 0)
+			_exit(1);
+	}
+	_exit(len < 0);
+}
+
+/* Redirect stdout to a pipe, with a child process copying the content to
+ * both the lockfile and the client. Returns 0 on success and errno
+ * otherwise.
+ */
+static int start_tee(struct cache_slot *slot)
+{
+	int fd[2];
+
+	if (pipe(fd))
+		return errno;
+	slot->tee_pid = fork();
+	if (slot->tee_pid < 0) {
+		int saved_errno = errno;
+		close(fd[0]);
+		close(fd[1]);
+		return saved_errno;
+	}
+	if (!slot->tee_pid) {
+		close(fd[1]);
+		tee_slot(slot, fd[0]);
+	}
+	close(fd[0]);
+	if (dup2(fd[1], STDOUT_FILENO) == -1) {
+		int saved_errno = errno;
+		close(fd[1]);
+		return saved_errno;
+	}
+	close(fd[1]);
+	return 0;
+}
+
+/* Close the pipe to the tee process and wait for it to write the last
+ * of the content. Returns 0 on success and errno otherwise.
+ */
+static int finish_tee(struct cache_slot *slot)
 {
+	int status;
+
+	if (dup2(slot->stdout_fd, STDOUT_FILENO) == -1)
+		return errno;
+	while (waitpid(slot->tee_pid, &status, 0) < 0)
+		if (errno != EINTR)
+			return errno;
+	if (!WIFEXITED(status) || WEXITSTATUS(status))
+		return EIO;
+	return 0;
+}
+
+static int fill_slot(struct cache_slot *slot)
+{
+	off_t start = cache_response_offset(slot);
+	struct cache_slot_header hdr;
+	struct stat st;
+	char buf[CACHE_BUFSIZE];
+	char *map;
+	const char *data;
+	size_t datalen;
+	ssize_t len;
+	int err;
+
+	/* Anything printed so far belongs to the real stdout */
+	html_flush();
+
 	/* Preserve stdout */
 	slot->stdout_fd = dup(STDOUT_FILENO);
 	if (slot->stdout_fd == -1)
 		return errno;
 
-	/* Redirect stdout to lockfile */
-	if (dup2(slot->lock_fd, STDOUT_FILENO) == -1)
+	/* Redirect stdout to lockfile, or to the tee process */
+	if (slot->tee) {
+		fflush(stdout);
+		if ((err = start_tee(slot)) != 0)
+			return err;
+		slot->teed = 1;
+	} else if (dup2(slot->lock_fd, STDOUT_FILENO) == -1)
 		return errno;
 
 	/* Generate cache content */
 	slot->fn();
 
 	/* Make sure any buffered data is flushed to the file */
+	html_flush();
 	if (fflush(stdout))
 		return errno;
-
-	/* update stat info */
-	if (fstat(slot->lock_fd, &slot->cache_st))
+	if (slot->teed && (err = finish_tee(slot)) != 0)
+		return err;
+
+	/* Store the body compressed, if enabled */
+	if ((err = cache_compress_slot(slot)))
+		return err;
+
+	/* Map the new slot, like cache_open_slot() does, or read back its
+	 * start if that fails, and describe the response in its header. The
+	 * old slot, which is served if any of this fails, is only replaced
+	 * once it's all done; a mapping sees the header written.
+	 */
+	if (fstat(slot->lock_fd, &st))
 		return errno;
+	map = map_file(slot->lock_fd, st.st_size);
+	if (map) {
+		data = map;
+		datalen = st.st_size;
+	} else {
+		len = pread(slot->lock_fd, buf, sizeof(buf), 0);
+		if (len < 0)
+			return errno;
+		data = buf;
+		datalen = len;
+	}
+	if (datalen < start) {
+		err = EIO;
+		goto fail;
+	}
+	cache_init_header(&hdr, data + start, datalen - start,
+			  st.st_size - start, !slot->fragment);
+	if (pwrite(slot->lock_fd, &hdr, sizeof(hdr),
+		   slot->keylen + 1) != sizeof(hdr)) {
+		err = errno ? errno : EIO;
+		goto fail;
+	}
 
+	if (slot->map)
+		munmap(slot->map, slot->mapsize);
+	slot->map = map;
+	slot->mapsize = map ? datalen : 0;
+	if (!map) {
+		memcpy(slot->buf, buf, datalen);
+		memcpy(slot->buf + slot->keylen + 1, &hdr, sizeof(hdr));
+		data = slot->buf;
+	}
+	slot->data = data;
+	slot->datalen = datalen;
+	slot->cache_st = st;
+	slot->hdr = hdr;
+	slot->compressed = !!(slot->hdr.flags & CACHE_SLOT_GZIP);
+	slot->negative = !!(slot->hdr.flags & CACHE_SLOT_ERROR);
 	return 0;
+
+fail:
+	if (map)
+		munmap(map, datalen);
+	return err;
+}
+
+/* Generate the content for the current cache slot by redirecting
+ * stdout to the lock-fd and invoking the callback function. In tee mode
+ * the content is sent to the client while it's generated as well, and
+ * slot->teed is set once the client has seen any of it.
+ */
+int cache_fill_slot(struct cache_slot *slot)
+{
+	uint64_t start = getnanotime();
+	int err = fill_slot(slot);
+
+	if (err)
+		cache_stat(slot->root, CACHE_STAT_FILL_FAILED, 1);
+	else
+		cache_stat_fill(slot->root, (getnanotime() - start) / 1000000);
+	return err;
 }
@@ -7,12 +7,42 @@
 #define USE_THE_REPOSITORY_VARIABLE
 
 #include "cgit.h"
+#include "parse.h"
 #include "configfile.h"
 #include "html.h"
 #include "scan-tree.h"
 #include "ui-stats.h"
 #include "cgit-main.h"
 
+/* Files read while parsing the configuration, with their mtime at the
+ * time they were read stored in the util pointer. A resident worker uses
+ * this list to notice when it has to re-read its configuration.
+ */
+static struct string_list config_files = STRING_LIST_INIT_DUP;
+
+void cgit_track_config_file(const char *path)
+{
+	struct string_list_item *item;
+	struct stat st;
+
+	item = string_list_insert(&config_files, path);
+	item->util = (void *)(intptr_t)(stat(path, &st) ? 0 : st.st_mtime);
+}
+
+int cgit_config_changed(void)
+{
+	struct string_list_item *item;
+	struct stat st;
+	time_t mtime;
+
+	for_each_string_list_item(item, &config_files) {
+		mtime = stat(item->string, &st) ? 0 : st.st_mtime;
+		if (mtime != (time_t)(intptr_t)item->util)
+			return 1;
+	}
+	return 0;
+}
+
 static void add_mimetype(const char *name, const char *value)
 {
 	struct string_list_item *item;
@@ -167,6 +197,8 @@ static void config_cb(const char *name, const char *value)
 		ctx.cfg.enable_index_owner = atoi(value);
 	else if (!strcmp(name, "enable-blame"))
 		ctx.cfg.enable_blame = atoi(value);
+	else if (!strcmp(name, "enable-cache-stats"))
+		ctx.cfg.enable_cache_stats = atoi(value);
 	else if (!strcmp(name, "enable-commit-graph"))
 		ctx.cfg.enable_commit_graph = atoi(value);
 	else if (!strcmp(name, "enable-log-filecount"))
@@ -190,22 +222,44 @@ static void config_cb(const char *name, const char *value)
 	}
 	else if (!strcmp(name, "cache-size"))
 		ctx.cfg.cache_size = atoi(value);
+	else if (!strcmp(name, "cache-compression"))
+		ctx.cfg.cache_compression = !strcmp(value, "gzip");
 	else if (!strcmp(name, "cache-root"))
 		ctx.cfg.cache_root = xstrdup(expand_macros(value));
 	else if (!strcmp(name, "cache-root-ttl"))
 		ctx.cfg.cache_root_ttl = atoi(value);
 	else if (!strcmp(name, "cache-repo-ttl"))
 		ctx.cfg.cache_repo_ttl = atoi(value);
+	else if (!strcmp(name, "cache-resolve-refs"))
+		ctx.cfg.cache_resolve_refs = atoi(value);
 	else if (!strcmp(name, "cache-scanrc-ttl"))
 		ctx.cfg.cache_scanrc_ttl = atoi(value);
-	else if (!strcmp(name, "cache-static-ttl"))
+	else if (!strcmp(name, "cache-shm-size")) {
+		if (!git_parse_ulong(value, &ctx.cfg.cache_shm_size))
+			ctx.cfg.cache_shm_size = 0;
+	} else if (!strcmp(name, "cache-static-ttl"))
 		ctx.cfg.cache_static_ttl = atoi(value);
 	else if (!strcmp(name, "cache-dynamic-ttl"))
 		ctx.cfg.cache_dynamic_ttl = atoi(value);
+	else if (!strcmp(name, "cache-fragment-ttl"))
+		ctx.cfg.cache_fragment_ttl = atoi(value);
+	else if (!strcmp(name, "cache-max-bytes")) {
+		if (!git_parse_ulong(value, &ctx.cfg.cache_max_bytes))
+			ctx.cfg.cache_max_bytes = 0;
+	} else if (!strcmp(name, "cache-max-create-time"))
+		ctx.cfg.cache_max_create_time = atoi(value);
+	else if (!strcmp(name, "cache-max-stale"))
+		ctx.cfg.cache_max_stale = atoi(value);
+	else if (!strcmp(name, "cache-negative-ttl"))
+		ctx.cfg.cache_negative_ttl = atoi(value);
 	else if (!strcmp(name, "cache-about-ttl"))
 		ctx.cfg.cache_about_ttl = atoi(value);
 	else if (!strcmp(name, "cache-snapshot-ttl"))
 		ctx.cfg.cache_snapshot_ttl = atoi(value);
+	else if (!strcmp(name, "cache-tee"))
+		ctx.cfg.cache_tee = atoi(value);
+	else if (!strcmp(name, "cache-warm-url"))
+		ctx.cfg.cache_warm_url = xstrdup(value);
 	else if (!strcmp(name, "case-sensitive-sort"))
 		ctx.cfg.case_sensitive_sort = atoi(value);
 	else if (!strcmp(name, "about-filter"))
@@ -220,6 +274,10 @@ static void config_cb(const char *name, const char *value)
 		ctx.cfg.auth_filter = cgit_new_filter(value, AUTH);
 	else if (!strcmp(name, "embedded"))
 		ctx.cfg.embedded = atoi(value);
+	else if (!strcmp(name, "log-output-stats"))
+		ctx.cfg.log_output_stats = atoi(value);
+	else if (!strcmp(name, "max-lock-attempts"))
+		ctx.cfg.max_lock_attempts = atoi(value);
 	else if (!strcmp(name, "max-atom-items"))
 		ctx.cfg.max_atom_items = atoi(value);
 	else if (!strcmp(name, "max-message-length"))
@@ -246,6 +304,8 @@ static void config_cb(const char *name, const char *value)
 			scan_tree(expand_macros(value), cgit_repo_config);
 	else if (!strcmp(name, "scan-hidden-path"))
 		ctx.cfg.scan_hidden_path = atoi(value);
+	else if (!strcmp(name, "scan-threads"))
+		ctx.cfg.scan_threads = atoi(value);
 	else if (!strcmp(name, "section-from-path"))
 		ctx.cfg.section_from_path = atoi(value);
 	else if (!strcmp(name, "repository-sort"))
@@ -290,8 +350,10 @@ static void config_cb(const char *name, const char *value)
 			ctx.cfg.branch_sort = 0;
 	} else if (skip_prefix(name, "mimetype.", &arg))
 		add_mimetype(arg, value);
-	else if (!strcmp(name, "include"))
+	else if (!strcmp(name, "include")) {
+		cgit_track_config_file(expand_macros(value));
 		parse_configfile(expand_macros(value), config_cb);
+	}
 }
 
 static void querystring_cb(const char *name, const char *value)
@@ -352,8 +414,71 @@ static void querystring_cb(const char *name, const char *value)
 	}
 }
 
+/* Add the parameter 'name' to the key, unless it's missing. An empty
+ * value is kept, since pages may treat it differently from a missing one.
+ * Control characters are escaped too, as the fields of a cache key are
+ * separated by newlines.
+ */
+static void add_key_param(struct strbuf *key, const char *name,
+			  const char *value)
+{
+	if (!value)
+		return;
+	if (key->len)
+		strbuf_addch(key, '&');
+	strbuf_addf(key, "%s=", name);
+	for (; *value; value++) {
+		if (*value == '%' || *value == '&' || *value == '=' ||
+		    iscntrl((unsigned char)*value))
+			strbuf_addf(key, "%%%02X", (unsigned char)*value);
+		else
+			strbuf_addch(key, *value);
+	}
+}
+
+static void add_key_int(struct strbuf *key, const char *name, int value)
+{
+	if (value)
+		add_key_param(key, name, fmt("%d", value));
+}
+
+/* Build the cache key of the request from the parsed query rather than
+ * the raw query string, so that equivalent requests share their cache
+ * slot: the parameters are sorted by name, parameters with their default
+ * value are left out, and "url=" and PATH_INFO give the same key.
+ */
+void cgit_query_cache_key(struct strbuf *key)
+{
+	int difftype = ctx.qry.has_difftype ? ctx.qry.difftype : ctx.cfg.difftype;
+
+	add_key_int(key, "all", ctx.qry.show_all);
+	if (ctx.qry.context != 3 && ctx.qry.context > 0)
+		add_key_int(key, "context", ctx.qry.context);
+	if (difftype != ctx.cfg.difftype)
+		add_key_int(key, "dt", difftype);
+	add_key_int(key, "follow", ctx.qry.follow);
+	add_key_param(key, "h", ctx.qry.head);
+	add_key_param(key, "id", ctx.qry.oid);
+	add_key_param(key, "id2", ctx.qry.oid2);
+	add_key_int(key, "ignorews", ctx.qry.ignorews);
+	add_key_param(key, "name", ctx.qry.name);
+	add_key_int(key, "ofs", ctx.qry.ofs);
+	add_key_param(key, "p", ctx.qry.page);
+	add_key_param(key, "path", ctx.qry.path);
+	add_key_param(key, "period", ctx.qry.period);
+	add_key_param(key, "q", ctx.qry.search);
+	add_key_param(key, "qt", ctx.qry.grep);
+	add_key_param(key, "r", ctx.repo ? ctx.repo->url : ctx.qry.repo);
+	add_key_param(key, "s", ctx.qry.sort);
+	add_key_int(key, "showmsg", ctx.qry.showmsg);
+	/* An empty url is the index page, like no url at all */
+	if (ctx.qry.url && *ctx.qry.url)
+		add_key_param(key, "url", ctx.qry.url);
+}
+
 void cgit_parse_config_file(const char *path)
 {
+	cgit_track_config_file(path);
 	parse_configfile(path, config_cb);
 }
 
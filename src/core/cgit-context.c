@@ -23,6 +23,7 @@ void cgit_prepare_context(void)
 	ctx.cfg.cache_root_ttl = 5;
 	ctx.cfg.cache_scanrc_ttl = 15;
 	ctx.cfg.cache_dynamic_ttl = 5;
+	ctx.cfg.cache_negative_ttl = 1;
 	ctx.cfg.cache_static_ttl = -1;
 	ctx.cfg.case_sensitive_sort = 1;
 	ctx.cfg.branch_sort = 0;
@@ -48,6 +49,7 @@ void cgit_prepare_context(void)
 	ctx.cfg.root_title = "Git repository browser";
 	ctx.cfg.root_desc = "a fast webinterface for the git dscm";
 	ctx.cfg.scan_hidden_path = 0;
+	ctx.cfg.scan_threads = 1;
 	ctx.cfg.script_name = CGIT_SCRIPT_NAME;
 	ctx.cfg.section = "";
 	ctx.cfg.repository_sort = "name";
@@ -57,6 +59,24 @@ void cgit_prepare_context(void)
 	ctx.cfg.summary_tags = 10;
 	ctx.cfg.max_atom_items = 10;
 	ctx.cfg.difftype = DIFF_UNIFIED;
+	ctx.cfg.scgi_workers = 4;
+	ctx.cfg.scgi_max_requests = 1000;
+	ctx.cfg.scgi_repo_cache = 8;
+	string_list_init_dup(&ctx.cfg.mimetypes);
+	cgit_prepare_request();
+}
+
+/* Reset the request-specific parts of the context (environment, query and
+ * page) from the current process environment. The parsed configuration and
+ * repolist are left untouched, so a resident worker can call this between
+ * requests.
+ */
+void cgit_prepare_request(void)
+{
+	memset(&ctx.env, 0, sizeof(ctx.env));
+	memset(&ctx.qry, 0, sizeof(ctx.qry));
+	memset(&ctx.page, 0, sizeof(ctx.page));
+	ctx.repo = NULL;
 	ctx.env.cgit_config = getenv("CGIT_CONFIG");
 	ctx.env.http_host = getenv("HTTP_HOST");
 	ctx.env.https = getenv("HTTPS");
@@ -69,6 +89,11 @@ void cgit_prepare_context(void)
 	ctx.env.server_port = getenv("SERVER_PORT");
 	ctx.env.http_cookie = getenv("HTTP_COOKIE");
 	ctx.env.http_referer = getenv("HTTP_REFERER");
+	ctx.env.http_accept_encoding = getenv("HTTP_ACCEPT_ENCODING");
+	ctx.env.http_if_none_match = getenv("HTTP_IF_NONE_MATCH");
+	ctx.env.http_if_modified_since = getenv("HTTP_IF_MODIFIED_SINCE");
+	ctx.env.http_if_range = getenv("HTTP_IF_RANGE");
+	ctx.env.http_range = getenv("HTTP_RANGE");
 	ctx.env.content_length = getenv("CONTENT_LENGTH") ?
 		strtoul(getenv("CONTENT_LENGTH"), NULL, 10) : 0;
 	ctx.env.authenticated = 0;
@@ -79,7 +104,6 @@ void cgit_prepare_context(void)
 	ctx.page.modified = time(NULL);
 	ctx.page.expires = ctx.page.modified;
 	ctx.page.etag = NULL;
-	string_list_init_dup(&ctx.cfg.mimetypes);
 	if (ctx.env.script_name)
 		ctx.cfg.script_name = xstrdup(ctx.env.script_name);
 	if (ctx.env.query_string)
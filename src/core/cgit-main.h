@@ -10,18 +10,30 @@
 #include "cgit.h"
 
 void cgit_prepare_context(void);
+void cgit_prepare_request(void);
 void cgit_parse_args(int argc, const char **argv);
 
+void cgit_load_config(void);
+void cgit_parse_request(void);
+int cgit_serve_request(void);
+
 void cgit_repo_config(struct cgit_repo *repo, const char *name,
 		      const char *value);
 void cgit_parse_config_file(const char *path);
 void cgit_parse_querystring(void);
+void cgit_query_cache_key(struct strbuf *key);
 void cgit_process_cached_repolist(const char *path);
+void cgit_track_config_file(const char *path);
+int cgit_config_changed(void);
 
 void cgit_repo_setup_env(int *nongit);
 int cgit_repo_prepare_cmd(int nongit);
+int cgit_repo_ref_state(struct strbuf *key, int all_refs);
+char *cgit_repo_default_head(void);
 
 void cgit_authenticate_cookie(void);
 void cgit_auth_print_body(void);
 
+int cgit_scgi_main(void);
+
 #endif
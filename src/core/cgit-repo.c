@@ -7,6 +7,7 @@
 #define USE_THE_REPOSITORY_VARIABLE
 
 #include "cgit.h"
+#include "cache.h"
 #include "html.h"
 #include "ui-blob.h"
 #include "ui-shared.h"
@@ -152,6 +153,19 @@ static void print_no_repo_clone_urls(const char *url)
 
 void cgit_repo_setup_env(int *nongit)
 {
+	static char *prepared_path;
+	static int prepared_nongit;
+
+	/* Git's repository state can only be set up once per process. An
+	 * SCGI repo process sets it up ahead of its requests, which then
+	 * reuse it. */
+	if (prepared_path) {
+		if (strcmp(prepared_path, ctx.repo->path))
+			die("Repository %s already set up", prepared_path);
+		*nongit = prepared_nongit;
+		return;
+	}
+
 	/* The path to the git repository. */
 	setenv("GIT_DIR", ctx.repo->path, 1);
 
@@ -160,6 +174,96 @@ void cgit_repo_setup_env(int *nongit)
 	 * the HOME variables are unset. */
 	setup_git_directory_gently(nongit);
 	load_display_notes(NULL);
+
+	prepared_path = xstrdup(ctx.repo->path);
+	prepared_nongit = *nongit;
+}
+
+static int add_ref_state(const struct reference *ref, void *cb_data)
+{
+	struct strbuf *refs = cb_data;
+
+	strbuf_addf(refs, "%s %s\n", oid_to_hex(ref->oid), ref->name);
+	return 0;
+}
+
+/* Append the state of the repository which the current page depends on
+ * to the cache key: the commit the requested (or default) head points
+ * to, and if 'all_refs' is set a fingerprint of all refs. Returns 0 on
+ * success, and -1 if the repository can't be opened.
+ */
+int cgit_repo_ref_state(struct strbuf *key, int all_refs)
+{
+	struct strbuf refs = STRBUF_INIT;
+	struct object_id oid;
+	const char *head;
+	int nongit = 0;
+
+	cgit_repo_setup_env(&nongit);
+	if (nongit)
+		return -1;
+
+	head = ctx.qry.head ? ctx.qry.head : ctx.repo->defbranch;
+	if (!head)
+		head = "HEAD";
+	if (repo_get_oid(the_repository, head, &oid))
+		all_refs = 1;
+	else
+		strbuf_addf(key, "\nhead=%s", oid_to_hex(&oid));
+
+	if (all_refs) {
+		head = refs_resolve_ref_unsafe(get_main_ref_store(the_repository),
+					       "HEAD", 0, NULL, NULL);
+		strbuf_addf(&refs, "HEAD %s\n", head ? head : "");
+		refs_for_each_ref(get_main_ref_store(the_repository),
+				  add_ref_state, &refs);
+		strbuf_addf(key, "\nrefs=%016"PRIx64, hash_str64(refs.buf));
+		strbuf_release(&refs);
+	}
+	return 0;
+}
+
+/* The head which pages of the current repository show without an "h"
+ * parameter, and link to e.g. for their atom feed (see
+ * cgit_repo_prepare_cmd()), or NULL if there is none.
+ */
+char *cgit_repo_default_head(void)
+{
+	int nongit = 0;
+
+	cgit_repo_setup_env(&nongit);
+	if (nongit)
+		return NULL;
+	if (!ctx.repo->defbranch)
+		ctx.repo->defbranch = guess_defbranch();
+	return find_default_branch(ctx.repo);
+}
+
+/* Print a section of the current page, generated by fn, through the
+ * cache. The section is cached by its name, the repository, the head,
+ * the ref state (see cgit_repo_ref_state()) and 'inputs', which must
+ * hold whatever else its content depends on.
+ */
+void cgit_print_fragment(const char *section, const char *inputs,
+			 int all_refs, void (*fn)(void))
+{
+	struct strbuf key = STRBUF_INIT;
+
+	if (!ctx.cfg.cache_fragment_ttl || ctx.cfg.cache_size <= 0 ||
+	    !ctx.repo) {
+		fn();
+		return;
+	}
+
+	strbuf_addf(&key, "fragment=%s\nrepo=%s\nh=%s%s\ninputs=%s",
+		    section, ctx.repo->url, ctx.qry.head ? ctx.qry.head : "",
+		    ctx.qry.nohead ? " (default)" : "", inputs ? inputs : "");
+	if (cgit_repo_ref_state(&key, all_refs))
+		fn();
+	else
+		cache_fragment(ctx.cfg.cache_size, ctx.cfg.cache_root, key.buf,
+			       ctx.cfg.cache_fragment_ttl, fn);
+	strbuf_release(&key);
 }
 
 int cgit_repo_prepare_cmd(int nongit)
@@ -8,6 +8,7 @@
 
 #include "cgit.h"
 #include "scan-tree.h"
+#include "repo-index.h"
 #include "cache.h"
 #include "ui-stats.h"
 #include "cgit-main.h"
@@ -127,15 +128,18 @@ static void print_repolist(FILE *f, struct cgit_repolist *list, int start)
 		print_repo(f, &list->repos[i]);
 }
 
-/* Scan 'path' for git repositories, save the resulting repolist in 'cached_rc'
- * and return 0 on success.
+/* Scan 'path' for git repositories, save the resulting repolist as an
+ * index in 'cached_rc' and return 0 on success.
  */
 static int generate_cached_repolist(const char *path, const char *cached_rc)
 {
 	struct strbuf locked_rc = STRBUF_INIT;
+	struct strbuf dirs = STRBUF_INIT;
+	struct strbuf locked_dirs = STRBUF_INIT;
+	struct strbuf stats = STRBUF_INIT;
 	int result = 0;
-	int idx;
-	FILE *f;
+	int idx, err;
+	FILE *f, *d;
 
 	strbuf_addf(&locked_rc, "%s.lock", cached_rc);
 	f = fopen(locked_rc.buf, "wx");
@@ -149,18 +153,46 @@ static int generate_cached_repolist(const char *path, const char *cached_rc)
 				locked_rc.buf, strerror(result), result);
 		goto out;
 	}
+
+	/* The directories of the scan are recorded next to the repolist, so
+	 * that the next scan only needs to read the ones which changed.
+	 */
+	strbuf_addf(&dirs, "%s.dirs", cached_rc);
+	strbuf_addf(&locked_dirs, "%s.lock", dirs.buf);
+	d = fopen(locked_dirs.buf, "w");
+	if (!d)
+		fprintf(stderr, "[cgit] Error opening %s: %s (%d)\n",
+			locked_dirs.buf, strerror(errno), errno);
+	scan_track_dirs(dirs.buf, d);
+
 	idx = cgit_repolist.count;
 	if (ctx.cfg.project_list)
 		scan_projects(path, ctx.cfg.project_list, cgit_repo_config);
 	else
 		scan_tree(path, cgit_repo_config);
-	print_repolist(f, &cgit_repolist, idx);
-	if (rename(locked_rc.buf, cached_rc))
+	scan_track_dirs(NULL, NULL);
+	if (d && fclose(d))
+		fprintf(stderr, "[cgit] Error writing %s: %s (%d)\n",
+			locked_dirs.buf, strerror(errno), errno);
+	else if (d && rename(locked_dirs.buf, dirs.buf))
+		fprintf(stderr, "[cgit] Error renaming %s to %s: %s (%d)\n",
+			locked_dirs.buf, dirs.buf, strerror(errno), errno);
+	scan_stats(&stats);
+	err = repo_index_write(f, idx, stats.buf);
+	if (fclose(f))
+		err = -1;
+	if (err) {
+		fprintf(stderr, "[cgit] Error writing %s: %s (%d)\n",
+			locked_rc.buf, strerror(errno), errno);
+		unlink(locked_rc.buf);
+	} else if (rename(locked_rc.buf, cached_rc))
 		fprintf(stderr, "[cgit] Error renaming %s to %s: %s (%d)\n",
 			locked_rc.buf, cached_rc, strerror(errno), errno);
-	fclose(f);
 out:
 	strbuf_release(&locked_rc);
+	strbuf_release(&dirs);
+	strbuf_release(&locked_dirs);
+	strbuf_release(&stats);
 	return result;
 }
 
@@ -176,10 +208,10 @@ void cgit_process_cached_repolist(const char *path)
 		hash += hash_str(ctx.cfg.project_list);
 	strbuf_addf(&cached_rc, "%s/rc-%8lx", ctx.cfg.cache_root, hash);
 
-	if (stat(cached_rc.buf, &st)) {
-		/* Nothing is cached, we need to scan without forking. And
-		 * if we fail to generate a cached repolist, we need to
-		 * invoke scan_tree manually.
+	if (stat(cached_rc.buf, &st) || repo_index_load(cached_rc.buf)) {
+		/* Nothing (valid) is cached, we need to scan without
+		 * forking. And if we fail to generate a cached repolist, we
+		 * need to invoke scan_tree manually.
 		 */
 		if (generate_cached_repolist(path, cached_rc.buf)) {
 			if (ctx.cfg.project_list)
@@ -188,12 +220,13 @@ void cgit_process_cached_repolist(const char *path)
 			else
 				scan_tree(path, cgit_repo_config);
 		}
+		cgit_track_config_file(cached_rc.buf);
 		goto out;
 	}
 
-	cgit_parse_config_file(cached_rc.buf);
+	cgit_track_config_file(cached_rc.buf);
 
-	/* If the cached configfile hasn't expired, lets exit now */
+	/* If the cached repolist hasn't expired, lets exit now */
 	age = time(NULL) - st.st_mtime;
 	if (age <= (ctx.cfg.cache_scanrc_ttl * 60))
 		goto out;
@@ -214,6 +247,7 @@ void cgit_parse_args(int argc, const char **argv)
 {
 	int i;
 	const char *arg;
+	struct strbuf stats = STRBUF_INIT;
 	int scan = 0;
 
 	for (i = 1; i < argc; i++) {
@@ -236,6 +270,14 @@ void cgit_parse_args(int argc, const char **argv)
 		}
 		if (skip_prefix(argv[i], "--cache=", &arg)) {
 			ctx.cfg.cache_root = xstrdup(arg);
+		} else if (!strcmp(argv[i], "--cache-gc")) {
+			ctx.cfg.cache_gc = 1;
+		} else if (!strcmp(argv[i], "--cache-stats")) {
+			ctx.cfg.cache_stats = 1;
+		} else if (skip_prefix(argv[i], "--invalidate-repo=", &arg)) {
+			ctx.cfg.cache_invalidate_repo = xstrdup(arg);
+		} else if (skip_prefix(argv[i], "--warm=", &arg)) {
+			ctx.cfg.cache_warm_repo = xstrdup(arg);
 		} else if (!strcmp(argv[i], "--nohttp")) {
 			ctx.env.no_http = "1";
 		} else if (skip_prefix(argv[i], "--query=", &arg)) {
@@ -252,6 +294,23 @@ void cgit_parse_args(int argc, const char **argv)
 			ctx.qry.has_oid = 1;
 		} else if (skip_prefix(argv[i], "--ofs=", &arg)) {
 			ctx.qry.ofs = atoi(arg);
+		} else if (skip_prefix(argv[i], "--scgi=", &arg)) {
+			ctx.cfg.scgi_listen = xstrdup(arg);
+		} else if (skip_prefix(argv[i], "--scgi-workers=", &arg)) {
+			ctx.cfg.scgi_workers = atoi(arg);
+		} else if (skip_prefix(argv[i], "--scgi-max-requests=", &arg)) {
+			ctx.cfg.scgi_max_requests = atoi(arg);
+		} else if (skip_prefix(argv[i], "--scgi-repo-cache=", &arg)) {
+			ctx.cfg.scgi_repo_cache = atoi(arg);
+		} else if (skip_prefix(argv[i], "--print-repo-index=", &arg)) {
+			if (repo_index_print(arg, print_repo)) {
+				fprintf(stderr, "[cgit] Unable to read repository index %s\n",
+					arg);
+				exit(1);
+			}
+			exit(0);
+		} else if (skip_prefix(argv[i], "--scan-threads=", &arg)) {
+			ctx.cfg.scan_threads = atoi(arg);
 		} else if (skip_prefix(argv[i], "--scan-tree=", &arg) ||
 			   skip_prefix(argv[i], "--scan-path=", &arg)) {
 			/*
@@ -273,6 +332,9 @@ void cgit_parse_args(int argc, const char **argv)
 	if (scan) {
 		qsort(cgit_repolist.repos, cgit_repolist.count,
 			sizeof(struct cgit_repo), cmp_repos);
+		scan_stats(&stats);
+		fputs(stats.buf, stdout);
+		strbuf_release(&stats);
 		print_repolist(stdout, &cgit_repolist, 0);
 		exit(0);
 	}
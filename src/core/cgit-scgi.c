@@ -0,0 +1,583 @@
+/* Copyright (C) Dominic R and contributors (see AUTHORS)
+ *
+ * Licensed under GNU General Public License v2
+ *   (see COPYING for full license text)
+ */
+
+/* In SCGI mode a master process listens on a socket and keeps a pool of
+ * long-lived workers running. Each worker parses cgitrc (including any
+ * scanned repolist) once, and for every connection it only resets the
+ * request part of the context, parses the request and forks a child to
+ * print the response. The child inherits the parsed configuration, so the
+ * per-request exec and config parsing of the CGI mode are avoided, while
+ * the child is still free to exit() or die() like a CGI process.
+ *
+ * A worker re-reads its configuration, by exiting and being respawned by
+ * the master, when one of the files it was loaded from changes.
+ *
+ * Git's repository state can only be set up once per process, so a worker
+ * additionally keeps a small LRU of "repo processes": children that have
+ * set up one repository and warmed its object store (pack indexes,
+ * multi-pack-index, commit-graph, ref store). Requests for that repository
+ * are handed over to the repo process together with the connection, and it
+ * forks the request process from its prepared state. A repo process is
+ * dropped as soon as the refs or packs of its repository change.
+ */
+
+#include "cgit.h"
+#include "cgit-main.h"
+#include "commit-graph.h"
+#include "packfile.h"
+
+/* Upper limit for the netstring holding the request headers. */
+#define SCGI_MAX_HEADER_SIZE (1024 * 64)
+
+static volatile sig_atomic_t scgi_stop;
+static int listen_fd = -1;
+static char *configured_virtual_root;
+
+struct repo_proc {
+	char *path;
+	pid_t pid;
+	int fd;
+	uint64_t signature;
+	unsigned long last_used;
+};
+
+static struct repo_proc *repo_procs;
+static int repo_procs_nr;
+static unsigned long repo_procs_clock;
+
+/* Files and directories whose mtime changes when a repository's refs,
+ * packs or config are updated.
+ */
+static const char *repo_state_paths[] = {
+	"HEAD",
+	"config",
+	"packed-refs",
+	"refs/heads",
+	"refs/tags",
+	"objects/pack",
+	"objects/info",
+};
+
+static void scgi_signal(int sig)
+{
+	scgi_stop = 1;
+}
+
+static void set_signal(int sig, void (*handler)(int))
+{
+	struct sigaction sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handler;
+	sigemptyset(&sa.sa_mask);
+	sigaction(sig, &sa, NULL);
+}
+
+static int listen_unix(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		die("SCGI socket path too long: %s", path);
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strlcpy(addr.sun_path, path, sizeof(addr.sun_path));
+	unlink(path);
+	fd = chk_non_negative(socket(AF_UNIX, SOCK_STREAM, 0),
+			      "Unable to create SCGI socket");
+	chk_zero(bind(fd, (struct sockaddr *)&addr, sizeof(addr)),
+		 "Unable to bind SCGI socket");
+	return fd;
+}
+
+static int listen_inet(const char *address)
+{
+	struct addrinfo hints, *ai, *p;
+	char *host, *node, *port;
+	int fd = -1, one = 1, err;
+
+	host = xstrdup(address);
+	port = strrchr(host, ':');
+	if (!port)
+		die("Invalid SCGI address: %s", address);
+	*port++ = '\0';
+	node = host;
+	if (*node == '[' && node[strlen(node) - 1] == ']') {
+		node[strlen(node) - 1] = '\0';
+		node++;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	err = getaddrinfo(*node ? node : NULL, port, &hints, &ai);
+	if (err)
+		die("Unable to resolve SCGI address %s: %s", address,
+		    gai_strerror(err));
+	for (p = ai; p; p = p->ai_next) {
+		fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+		if (fd < 0)
+			continue;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (!bind(fd, p->ai_addr, p->ai_addrlen))
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(ai);
+	if (fd < 0)
+		die_errno("Unable to bind SCGI socket %s", address);
+	free(host);
+	return fd;
+}
+
+/* Open the listening socket, "unix:<path>" or "[<host>]:<port>". */
+static int scgi_listen(const char *address)
+{
+	const char *path;
+	int fd;
+
+	if (skip_prefix(address, "unix:", &path))
+		fd = listen_unix(path);
+	else
+		fd = listen_inet(address);
+	chk_zero(listen(fd, SOMAXCONN), "Unable to listen on SCGI socket");
+	return fd;
+}
+
+/* Read the netstring holding the SCGI request headers into 'buf'. */
+static int read_headers(int fd, struct strbuf *buf)
+{
+	size_t len = 0;
+	char c;
+
+	do {
+		if (xread(fd, &c, 1) != 1)
+			return -1;
+		if (c == ':')
+			break;
+		if (!isdigit(c))
+			return -1;
+		len = len * 10 + c - '0';
+	} while (len <= SCGI_MAX_HEADER_SIZE);
+	if (!len || len > SCGI_MAX_HEADER_SIZE)
+		return -1;
+
+	strbuf_grow(buf, len + 1);
+	if (read_in_full(fd, buf->buf, len + 1) != len + 1 ||
+	    buf->buf[len] != ',')
+		return -1;
+	strbuf_setlen(buf, len);
+	return 0;
+}
+
+/* Export the SCGI request headers to the environment, just like a CGI
+ * server would. The names of the exported variables are remembered in
+ * 'vars', with any value they replaced in the util pointer, so that they
+ * can be restored after the request.
+ */
+static void export_headers(const char *buf, size_t len,
+			   struct string_list *vars)
+{
+	struct string_list_item *item;
+	const char *name, *value, *end = buf + len;
+	const char *old;
+
+	for (name = buf; name < end; name = value + strlen(value) + 1) {
+		value = memchr(name, '\0', end - name);
+		if (!value || !memchr(value + 1, '\0', end - value - 1))
+			break;
+		value++;
+		old = getenv(name);
+		item = string_list_append(vars, name);
+		item->util = old ? xstrdup(old) : NULL;
+		setenv(name, value, 1);
+	}
+}
+
+static void restore_env(struct string_list *vars)
+{
+	struct string_list_item *item;
+	int i;
+
+	for (i = vars->nr - 1; i >= 0; i--) {
+		item = &vars->items[i];
+		if (item->util)
+			setenv(item->string, item->util, 1);
+		else
+			unsetenv(item->string);
+	}
+	string_list_clear(vars, 1);
+}
+
+/* Runs in a freshly forked request process: serve the request whose
+ * headers have already been parsed on connection 'fd'.
+ */
+static NORETURN void serve_connection(int fd)
+{
+	set_signal(SIGTERM, SIG_DFL);
+	set_signal(SIGPIPE, SIG_DFL);
+	if (listen_fd >= 0)
+		close(listen_fd);
+	if (dup2(fd, STDIN_FILENO) < 0 || dup2(fd, STDOUT_FILENO) < 0)
+		die_errno("Unable to redirect SCGI connection");
+	close(fd);
+	exit(cgit_serve_request());
+}
+
+static void wait_request(pid_t pid)
+{
+	while (waitpid(pid, NULL, 0) < 0 && errno == EINTR)
+		; /* keep waiting, the request is allowed to finish */
+}
+
+static uint64_t repo_signature(const char *path)
+{
+	struct strbuf buf = STRBUF_INIT;
+	struct stat st;
+	uint64_t sig = 0;
+	size_t len;
+	int i;
+
+	strbuf_addf(&buf, "%s/", path);
+	len = buf.len;
+	for (i = 0; i < ARRAY_SIZE(repo_state_paths); i++) {
+		strbuf_setlen(&buf, len);
+		strbuf_addstr(&buf, repo_state_paths[i]);
+		sig *= 1000003;
+		if (stat(buf.buf, &st))
+			continue;
+		sig ^= (uint64_t)st.st_mtime * 1000000000 + ST_MTIME_NSEC(st);
+		sig = sig * 1000003 ^ st.st_size ^ st.st_ino;
+	}
+	strbuf_release(&buf);
+	return sig;
+}
+
+/* Hand a connection and its raw request headers to a repo process. */
+static int send_request(int sock, const struct strbuf *hdr, int fd)
+{
+	char control[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = { .iov_base = hdr->buf, .iov_len = hdr->len };
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(control, 0, sizeof(control));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	return sendmsg(sock, &msg, 0) == (ssize_t)hdr->len ? 0 : -1;
+}
+
+static ssize_t recv_request(int sock, char *buf, size_t size, int *fd)
+{
+	char control[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = { .iov_base = buf, .iov_len = size };
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	ssize_t len;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	do {
+		len = recvmsg(sock, &msg, 0);
+	} while (len < 0 && errno == EINTR);
+	if (len <= 0)
+		return len;
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+	    cmsg->cmsg_type != SCM_RIGHTS)
+		return -1;
+	memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+	return len;
+}
+
+/* Open the object store of the freshly set up repository: the pack
+ * indexes, the multi-pack-index, the commit-graph and the ref store.
+ */
+static void warm_repo(void)
+{
+	struct packfile_list_entry *pack;
+	struct object_id oid;
+
+	for (pack = packfile_store_get_packs(the_repository->objects->sources->packfiles);
+	     pack; pack = pack->next)
+		open_pack_index(pack->pack);
+	if (!repo_get_oid(the_repository, "HEAD", &oid))
+		lookup_commit_in_graph(the_repository, &oid);
+}
+
+/* Main loop of a repo process, set up for ctx.repo. */
+static int repo_proc_main(int sock)
+{
+	struct string_list vars = STRING_LIST_INIT_DUP;
+	char *buf = xmalloc(SCGI_MAX_HEADER_SIZE);
+	int nongit = 0, fd;
+	ssize_t len;
+	pid_t pid;
+
+	cgit_repo_setup_env(&nongit);
+	if (nongit)
+		return 1;
+	warm_repo();
+	if (write_in_full(sock, "", 1) != 1)
+		return 1;
+
+	while ((len = recv_request(sock, buf, SCGI_MAX_HEADER_SIZE, &fd)) > 0) {
+		pid = fork();
+		if (!pid) {
+			close(sock);
+			export_headers(buf, len, &vars);
+			cgit_prepare_request();
+			ctx.cfg.virtual_root = configured_virtual_root;
+			cgit_parse_request();
+			serve_connection(fd);
+		}
+		close(fd);
+		if (pid > 0)
+			wait_request(pid);
+		if (write_in_full(sock, "", 1) != 1)
+			break;
+	}
+	free(buf);
+	return 0;
+}
+
+static void drop_repo_proc(struct repo_proc *proc)
+{
+	close(proc->fd);
+	free(proc->path);
+	*proc = repo_procs[--repo_procs_nr];
+}
+
+static struct repo_proc *spawn_repo_proc(const char *path, uint64_t signature,
+					 struct string_list *vars)
+{
+	struct repo_proc *proc;
+	int sv[2], i;
+	pid_t pid;
+	char c;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv))
+		return NULL;
+	pid = fork();
+	if (!pid) {
+		close(sv[0]);
+		close(listen_fd);
+		listen_fd = -1;
+		for (i = 0; i < repo_procs_nr; i++)
+			close(repo_procs[i].fd);
+		set_signal(SIGTERM, SIG_DFL);
+		/* Don't keep the headers of the request we were spawned by. */
+		restore_env(vars);
+		exit(repo_proc_main(sv[1]));
+	}
+	close(sv[1]);
+	if (pid < 0 || xread(sv[0], &c, 1) != 1) {
+		/* Not a valid repository, let the request report it. */
+		close(sv[0]);
+		return NULL;
+	}
+
+	proc = &repo_procs[repo_procs_nr++];
+	proc->path = xstrdup(path);
+	proc->pid = pid;
+	proc->fd = sv[0];
+	proc->signature = signature;
+	return proc;
+}
+
+/* Find the repo process of 'path', (re)spawning it if needed. */
+static struct repo_proc *get_repo_proc(const char *path,
+				       struct string_list *vars)
+{
+	uint64_t signature = repo_signature(path);
+	struct repo_proc *proc = NULL, *lru = NULL;
+	int i;
+
+	if (!repo_procs)
+		CALLOC_ARRAY(repo_procs, ctx.cfg.scgi_repo_cache);
+
+	for (i = 0; i < repo_procs_nr; i++) {
+		if (!strcmp(repo_procs[i].path, path)) {
+			proc = &repo_procs[i];
+			break;
+		}
+		if (!lru || repo_procs[i].last_used < lru->last_used)
+			lru = &repo_procs[i];
+	}
+	if (proc && proc->signature != signature) {
+		drop_repo_proc(proc);
+		proc = NULL;
+	} else if (!proc && repo_procs_nr == ctx.cfg.scgi_repo_cache) {
+		drop_repo_proc(lru);
+	}
+	if (!proc)
+		proc = spawn_repo_proc(path, signature, vars);
+	if (proc)
+		proc->last_used = ++repo_procs_clock;
+	return proc;
+}
+
+static int serve_from_repo_proc(int fd, const struct strbuf *hdr,
+				struct string_list *vars)
+{
+	struct repo_proc *proc = get_repo_proc(ctx.repo->path, vars);
+	char c;
+
+	if (!proc)
+		return -1;
+	if (send_request(proc->fd, hdr, fd)) {
+		drop_repo_proc(proc);
+		return -1;
+	}
+	if (xread(proc->fd, &c, 1) != 1)
+		drop_repo_proc(proc);
+	return 0;
+}
+
+static void handle_connection(int fd)
+{
+	struct string_list vars = STRING_LIST_INIT_DUP;
+	struct strbuf hdr = STRBUF_INIT;
+	pid_t pid;
+
+	if (read_headers(fd, &hdr)) {
+		fprintf(stderr, "[cgit] Invalid SCGI request\n");
+		goto out;
+	}
+	export_headers(hdr.buf, hdr.len, &vars);
+
+	cgit_prepare_request();
+	ctx.cfg.virtual_root = configured_virtual_root;
+	cgit_parse_request();
+
+	if (ctx.repo && ctx.cfg.scgi_repo_cache > 0 &&
+	    !serve_from_repo_proc(fd, &hdr, &vars))
+		goto out;
+
+	pid = fork();
+	if (pid < 0) {
+		fprintf(stderr, "[cgit] Unable to fork SCGI request: %s (%d)\n",
+			strerror(errno), errno);
+		goto out;
+	}
+	if (!pid)
+		serve_connection(fd);
+	wait_request(pid);
+out:
+	close(fd);
+	strbuf_release(&hdr);
+	restore_env(&vars);
+}
+
+static int config_expired(time_t loaded)
+{
+	/* A scanned repolist is refreshed by re-reading the configuration
+	 * at least once every cache-scanrc-ttl.
+	 */
+	if (ctx.cfg.cache_scanrc_ttl >= 0 &&
+	    time(NULL) - loaded > ctx.cfg.cache_scanrc_ttl * 60)
+		return 1;
+	return cgit_config_changed();
+}
+
+static int scgi_worker(void)
+{
+	struct pollfd pfd = { .fd = listen_fd, .events = POLLIN };
+	int requests = 0;
+	time_t loaded;
+	int fd;
+
+	cgit_load_config();
+	configured_virtual_root = ctx.cfg.virtual_root;
+	loaded = time(NULL);
+
+	while (!scgi_stop) {
+		/* Reap the background repolist scans we might have forked. */
+		while (waitpid(-1, NULL, WNOHANG) > 0)
+			;
+		if (ctx.cfg.scgi_max_requests > 0 &&
+		    requests >= ctx.cfg.scgi_max_requests)
+			break;
+		if (config_expired(loaded))
+			break;
+		if (poll(&pfd, 1, 1000) <= 0)
+			continue;
+		fd = accept(listen_fd, NULL, NULL);
+		if (fd < 0)
+			continue;
+		handle_connection(fd);
+		requests++;
+	}
+	return 0;
+}
+
+/* Run the SCGI master: keep ctx.cfg.scgi_workers workers alive until we
+ * receive SIGTERM or SIGINT.
+ */
+int cgit_scgi_main(void)
+{
+	pid_t *workers, pid;
+	time_t *started;
+	int i, n;
+
+	listen_fd = scgi_listen(ctx.cfg.scgi_listen);
+	n = ctx.cfg.scgi_workers > 0 ? ctx.cfg.scgi_workers : 1;
+	CALLOC_ARRAY(workers, n);
+	CALLOC_ARRAY(started, n);
+
+	set_signal(SIGTERM, scgi_signal);
+	set_signal(SIGINT, scgi_signal);
+	set_signal(SIGPIPE, SIG_IGN);
+
+	while (!scgi_stop) {
+		for (i = 0; i < n && !scgi_stop; i++) {
+			if (workers[i] > 0)
+				continue;
+			/* Avoid a fork loop if workers die right away,
+			 * e.g. because of a broken cgitrc.
+			 */
+			if (time(NULL) - started[i] < 1)
+				sleep(1);
+			started[i] = time(NULL);
+			workers[i] = fork();
+			if (!workers[i])
+				exit(scgi_worker());
+			if (workers[i] < 0) {
+				fprintf(stderr, "[cgit] Unable to fork SCGI worker: %s (%d)\n",
+					strerror(errno), errno);
+				workers[i] = 0;
+			}
+		}
+		pid = wait(NULL);
+		for (i = 0; i < n; i++)
+			if (pid > 0 && workers[i] == pid)
+				workers[i] = 0;
+	}
+
+	for (i = 0; i < n; i++)
+		if (workers[i] > 0)
+			kill(workers[i], SIGTERM);
+	while (wait(NULL) > 0 || errno == EINTR)
+		;
+	close(listen_fd);
+	free(workers);
+	free(started);
+	return 0;
+}
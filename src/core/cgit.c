@@ -17,6 +17,7 @@
 #include "ui-blob.h"
 #include "ui-summary.h"
 #include "cgit-main.h"
+#include "repo-index.h"
 
 const char *cgit_version = CGIT_VERSION;
 
@@ -82,13 +83,20 @@ static void process_request(void)
 	cmd->fn();
 }
 
-static int calc_ttl(void)
+/* Pages whose cache key includes the state of the repository (see
+ * cache_key()) are as static as pages of a fixed commit.
+ */
+static int calc_ttl(int resolved)
 {
+	/* The counters of the cache are never cached */
+	if (ctx.qry.page && !strcmp(ctx.qry.page, "cache_stats"))
+		return 0;
+
 	if (!ctx.repo)
 		return ctx.cfg.cache_root_ttl;
 
 	if (!ctx.qry.page)
-		return ctx.cfg.cache_repo_ttl;
+		return resolved ? ctx.cfg.cache_static_ttl : ctx.cfg.cache_repo_ttl;
 
 	if (!strcmp(ctx.qry.page, "about"))
 		return ctx.cfg.cache_about_ttl;
@@ -96,7 +104,7 @@ static int calc_ttl(void)
 	if (!strcmp(ctx.qry.page, "snapshot"))
 		return ctx.cfg.cache_snapshot_ttl;
 
-	if (ctx.qry.has_oid)
+	if (ctx.qry.has_oid || resolved)
 		return ctx.cfg.cache_static_ttl;
 
 	if (ctx.qry.has_symref)
@@ -105,22 +113,77 @@ static int calc_ttl(void)
 	return ctx.cfg.cache_repo_ttl;
 }
 
-int cmd_main(int argc, const char **argv)
+/* Pages which show the refs of the repository, rather than (mostly) the
+ * history of a single head.
+ */
+static int page_lists_refs(void)
 {
-	const char *path;
-	int err, ttl;
+	static const char *pages[] = {
+		"summary", "refs", "log", "commit", "tag", "atom",
+	};
+	int i;
 
-	cgit_init_filters();
-	atexit(cgit_cleanup_filters);
+	if (!ctx.qry.page)
+		return 1;
+	for (i = 0; i < ARRAY_SIZE(pages); i++)
+		if (!strcmp(ctx.qry.page, pages[i]))
+			return 1;
+	return 0;
+}
 
-	cgit_prepare_context();
-	cgit_repolist.length = 0;
-	cgit_repolist.count = 0;
-	cgit_repolist.repos = NULL;
+/* Build the cache key for the current request, from the parsed query.
+ * With cache-resolve-refs, the commit of the head of a repository page,
+ * and for pages which show refs a fingerprint of all refs, are added to
+ * the key, and *resolved is set. Such a key changes as soon as the
+ * repository does.
+ */
+static char *cache_key(int *resolved)
+{
+	struct strbuf key = STRBUF_INIT;
 
-	cgit_parse_args(argc, argv);
+	*resolved = 0;
+	cgit_query_cache_key(&key);
+	if (ctx.cfg.cache_resolve_refs && ctx.repo && ctx.cfg.cache_size > 0)
+		*resolved = !cgit_repo_ref_state(&key, page_lists_refs());
+	return strbuf_detach(&key, NULL);
+}
+
+/* Is 's' a full hexadecimal object id (rather than e.g. a branch)? */
+static int is_object_id(const char *s)
+{
+	struct object_id oid;
+
+	return s && strlen(s) == the_hash_algo->hexsz && !get_oid_hex(s, &oid);
+}
+
+/* The ETag of a cached page, unless the page sets one itself: the hash
+ * of its key, which is all it takes for pages of fixed objects (or of a
+ * resolved head, see cache_key()), and otherwise also the time it was
+ * generated at, i.e. the version of its cache slot.
+ */
+static char *cache_etag(const char *key, int resolved)
+{
+	if (resolved || (is_object_id(ctx.qry.oid) &&
+			 (!ctx.qry.oid2 || is_object_id(ctx.qry.oid2))))
+		return fmtalloc("%016"PRIx64, hash_str64(key));
+	return fmtalloc("%016"PRIx64"-%"PRIx64, hash_str64(key),
+			(uint64_t)ctx.page.modified);
+}
+
+/* Parse the cgitrc file, including any scanned repolist. */
+void cgit_load_config(void)
+{
 	cgit_parse_config_file(expand_macros(ctx.env.cgit_config));
 	ctx.repo = NULL;
+}
+
+/* Parse the querystring and PATH_INFO of the current request, selecting
+ * the repository and page to display.
+ */
+void cgit_parse_request(void)
+{
+	const char *path;
+
 	cgit_parse_querystring();
 
 	/* If virtual-root isn't specified in cgitrc, lets pretend
@@ -148,24 +211,189 @@ int cmd_main(int argc, const char **argv)
 			ctx.qry.raw = xstrdup(ctx.qry.url);
 		cgit_parse_url(ctx.qry.url);
 	}
+}
+
+/* Authenticate and print the response for the parsed request, going
+ * through the cache when it is enabled.
+ */
+int cgit_serve_request(void)
+{
+	int err, ttl, resolved;
+	char *key;
 
 	/* Before we go any further, we set ctx.env.authenticated by checking to see
 	 * if the supplied cookie is valid. All cookies are valid if there is no
 	 * auth_filter. If there is an auth_filter, the filter decides. */
 	cgit_authenticate_cookie();
 
-	ttl = calc_ttl();
+	if (!ctx.env.authenticated || (ctx.env.request_method && !strcmp(ctx.env.request_method, "HEAD")))
+		ctx.cfg.cache_size = 0;
+	/* Clients can't tell when the repository changes, so they have
+	 * to go by the ttl of the page as it is requested. */
+	ttl = calc_ttl(0);
 	if (ttl < 0)
 		ctx.page.expires += 10 * 365 * 24 * 60 * 60; /* 10 years */
 	else
 		ctx.page.expires += ttl * 60;
-	if (!ctx.env.authenticated || (ctx.env.request_method && !strcmp(ctx.env.request_method, "HEAD")))
-		ctx.cfg.cache_size = 0;
+	key = cache_key(&resolved);
+	if (resolved)
+		ttl = calc_ttl(1);
+	ctx.page.cached = ctx.cfg.cache_size > 0 && ttl && ctx.cfg.cache_root;
+	if (ctx.page.cached)
+		ctx.page.etag = cache_etag(key, resolved);
 	err = cache_process(ctx.cfg.cache_size, ctx.cfg.cache_root,
-			    ctx.qry.raw, ttl, process_request);
+			    key, ttl, ctx.cfg.cache_max_stale,
+			    process_request);
+	free(key);
 	cgit_cleanup_filters();
 	if (err)
 		cgit_print_error("Error processing page: %s (%d)",
 				 strerror(err), err);
 	return err;
 }
+
+static void flush_output(void)
+{
+	uintmax_t writes, bytes;
+
+	html_flush();
+	if (!ctx.cfg.log_output_stats)
+		return;
+	html_output_stats(&writes, &bytes);
+	if (writes)
+		fprintf(stderr, "[cgit] %s: %"PRIuMAX" writes, %"PRIuMAX" bytes\n",
+			ctx.qry.raw ? ctx.qry.raw : "", writes, bytes);
+}
+
+/* Set up the environment of a request to 'base', the url of cgit as seen
+ * by its visitors (see cache-warm-url), e.g. "https://example.com/cgit",
+ * so that warmed pages carry the same absolute links as requested ones.
+ */
+static void set_warm_env(const char *base)
+{
+	const char *host, *path;
+	char *name, *port;
+	int https;
+	size_t len;
+
+	https = skip_prefix(base, "https://", &host);
+	if (!https && !skip_prefix(base, "http://", &host))
+		host = base;
+	path = strchrnul(host, '/');
+	name = xmemdupz(host, path - host);
+	setenv("HTTP_HOST", name, 1);
+	port = strrchr(name, ':');
+	if (port && !strchr(port, ']')) {
+		*port++ = '\0';
+		setenv("SERVER_PORT", port, 1);
+	} else
+		setenv("SERVER_PORT", https ? "443" : "80", 1);
+	setenv("SERVER_NAME", name, 1);
+	if (https)
+		setenv("HTTPS", "on", 1);
+	else
+		unsetenv("HTTPS");
+	len = strlen(path);
+	while (len && path[len - 1] == '/')
+		len--;
+	if (len) {
+		free(name);
+		name = xmemdupz(path, len);
+		setenv("SCRIPT_NAME", name, 1);
+	}
+	free(name);
+}
+
+/* Request the pages of the repository 'url' which are visited most after
+ * a push, i.e. the summary, log, refs and atom pages, so that they are in
+ * the cache. Each page is served by a child process, like an SCGI
+ * request, with the output discarded. The atom feed is requested for the
+ * default head, like the pages link to it. With an auth-filter, pages depend
+ * on who is asking, so nothing is warmed.
+ */
+static int warm_repo(const char *url)
+{
+	static const char *pages[] = { "", "log/", "refs/", "atom/" };
+	int i, fd, status, err = 0;
+	pid_t pid;
+
+	if (ctx.cfg.auth_filter) {
+		cache_log("[cgit] Not warming %s with an auth-filter\n", url);
+		return 0;
+	}
+	if (!cgit_get_repoinfo(url)) {
+		cache_log("[cgit] Unknown repository: %s\n", url);
+		return EINVAL;
+	}
+	for (i = 0; i < ARRAY_SIZE(pages); i++) {
+		fflush(stdout);
+		pid = fork();
+		if (pid < 0)
+			return errno;
+		if (!pid) {
+			if (ctx.cfg.cache_warm_url)
+				set_warm_env(ctx.cfg.cache_warm_url);
+			cgit_prepare_request();
+			ctx.env.path_info = fmtalloc("/%s/%s", url, pages[i]);
+			fd = open("/dev/null", O_WRONLY);
+			if (fd < 0 || dup2(fd, STDOUT_FILENO) < 0)
+				exit(1);
+			close(fd);
+			cgit_parse_request();
+			if (!strcmp(pages[i], "atom/") && ctx.repo &&
+			    !ctx.qry.head) {
+				ctx.qry.head = cgit_repo_default_head();
+				ctx.qry.has_symref = !!ctx.qry.head;
+			}
+			exit(cgit_serve_request());
+		}
+		while (waitpid(pid, &status, 0) < 0)
+			if (errno != EINTR)
+				return errno;
+		if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+			cache_log("[cgit] Unable to warm %s/%s\n", url, pages[i]);
+			err = EIO;
+		}
+	}
+	return err;
+}
+
+int cmd_main(int argc, const char **argv)
+{
+	int err;
+
+	cgit_init_filters();
+	atexit(cgit_cleanup_filters);
+	atexit(flush_output);
+
+	cgit_prepare_context();
+	cgit_repolist.length = 0;
+	cgit_repolist.count = 0;
+	cgit_repolist.repos = NULL;
+
+	cgit_parse_args(argc, argv);
+	if (ctx.cfg.scgi_listen)
+		return cgit_scgi_main();
+
+	cgit_load_config();
+	if (ctx.cfg.cache_gc)
+		return cache_gc(ctx.cfg.cache_root, ctx.cfg.cache_max_bytes, 1);
+	if (ctx.cfg.cache_stats)
+		return cache_print_stats(ctx.cfg.cache_root) ? 1 : 0;
+	if (ctx.cfg.cache_invalidate_repo) {
+		/* The idle time of the repository is updated even if its
+		 * pages can't be removed from the cache, and vice versa.
+		 */
+		err = repo_index_update_modtime(ctx.cfg.cache_invalidate_repo);
+		if (cache_invalidate_repo(ctx.cfg.cache_root,
+					  ctx.cfg.cache_invalidate_repo, 1) ||
+		    err)
+			return 1;
+	}
+	if (ctx.cfg.cache_warm_repo)
+		return warm_repo(ctx.cfg.cache_warm_repo) ? 1 : 0;
+	if (ctx.cfg.cache_invalidate_repo)
+		return 0;
+	cgit_parse_request();
+	return cgit_serve_request();
+}
@@ -120,6 +120,19 @@ static void ls_cache_fn(void)
 	cache_ls(ctx.cfg.cache_root);
 }
 
+static void cache_stats_fn(void)
+{
+	if (!ctx.cfg.enable_cache_stats) {
+		cgit_print_error_page(403, "Forbidden",
+				      "Cache statistics are disabled");
+		return;
+	}
+	ctx.page.mimetype = "text/plain";
+	ctx.page.filename = "cache-stats.txt";
+	cgit_print_http_headers();
+	cache_print_stats(ctx.cfg.cache_root);
+}
+
 static void objects_fn(void)
 {
 	cgit_clone_objects();
@@ -187,6 +200,7 @@ struct cgit_cmd *cgit_get_cmd(void)
 		def_cmd(about, 0, 0, 0),
 		def_cmd(blame, 1, 1, 0),
 		def_cmd(blob, 1, 0, 0),
+		def_cmd(cache_stats, 0, 0, 0),
 		def_cmd(commit, 1, 1, 0),
 		def_cmd(compare, 1, 1, 0),
 		def_cmd(diff, 1, 1, 0),
@@ -90,6 +90,7 @@ static inline int hook_lua_filter(lua_State *lua_state, void (*fn)(const char *t
 	save_filter = current_write_filter;
 	unhook_write();
 	fn(str);
+	html_flush();
 	hook_write(save_filter, save_filter_write);
 
 	return 0;
@@ -9,6 +9,7 @@
 #include "cgit.h"
 #include "html.h"
 #include "filter-internal.h"
+#include "repo-index.h"
 
 static inline void reap_filter(struct cgit_filter *filter)
 {
@@ -26,6 +27,8 @@ void cgit_cleanup_filters(void)
 	reap_filter(ctx.cfg.owner_filter);
 	reap_filter(ctx.cfg.auth_filter);
 	for (i = 0; i < cgit_repolist.count; ++i) {
+		if (repo_index_is_pending(i))
+			continue;
 		reap_filter(cgit_repolist.repos[i].about_filter);
 		reap_filter(cgit_repolist.repos[i].commit_filter);
 		reap_filter(cgit_repolist.repos[i].source_filter);
@@ -47,6 +50,7 @@ int cgit_open_filter(struct cgit_filter *filter, ...)
 	va_list ap;
 	if (!filter)
 		return 0;
+	html_flush();
 	va_start(ap, filter);
 	result = filter->open(filter, ap);
 	va_end(ap);
@@ -57,6 +61,7 @@ int cgit_close_filter(struct cgit_filter *filter)
 {
 	if (!filter)
 		return 0;
+	html_flush();
 	return filter->close(filter);
 }
 
@@ -9,6 +9,10 @@
 #include "cgit.h"
 #include "html.h"
 #include "url.h"
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <emmintrin.h>
+#define HAVE_SSE2_ESCAPE
+#endif
 
 /* Percent-encoding of each character, except: a-zA-Z0-9!$()*,./:;@- */
 static const char* url_escape_table[256] = {
@@ -46,6 +50,113 @@ static const char* url_escape_table[256] = {
 	"%f8", "%f9", "%fa", "%fb", "%fc", "%fd", "%fe", "%ff"
 };
 
+/* An escaping scheme: the replacement of each character which needs to be
+ * escaped, and, if these are few, the list of those characters so that
+ * runs of plain text can be skipped 16 bytes at a time.
+ */
+struct escape_set {
+	const char *table[256];
+	const char *special;
+};
+
+static const struct escape_set html_text_escape = {
+	.table = {
+		['<'] = "&lt;", ['>'] = "&gt;", ['&'] = "&amp;",
+	},
+	.special = "<>&",
+};
+
+static const struct escape_set html_attr_escape = {
+	.table = {
+		['<'] = "&lt;", ['>'] = "&gt;", ['&'] = "&amp;",
+		['\''] = "&#x27;", ['"'] = "&quot;",
+	},
+	.special = "<>&'\"",
+};
+
+static const struct escape_set header_arg_escape = {
+	.table = {
+		['\\'] = "\\\\", ['\r'] = "\\r", ['\n'] = "\\n", ['"'] = "\\\"",
+	},
+	.special = "\\\r\n\"",
+};
+
+/* Derived from url_escape_table by init_url_escapes(). */
+static struct escape_set url_path_escape, url_arg_escape;
+
+static void init_url_escapes(void)
+{
+	static int initialized;
+
+	if (initialized)
+		return;
+	memcpy(url_path_escape.table, url_escape_table, sizeof(url_escape_table));
+	url_path_escape.table['+'] = NULL;
+	url_path_escape.table['&'] = NULL;
+	memcpy(url_arg_escape.table, url_escape_table, sizeof(url_escape_table));
+	url_arg_escape.table[' '] = "+";
+	initialized = 1;
+}
+
+/* Return the length of the initial part of txt (at most len bytes) which
+ * needs no escaping, stopping at the first NUL. The vector loop reads
+ * whole blocks of 16 bytes, so len must not reach past the end of txt.
+ */
+static size_t escape_span(const char *txt, size_t len,
+			  const struct escape_set *esc)
+{
+	size_t i = 0;
+
+#ifdef HAVE_SSE2_ESCAPE
+	if (esc->special) {
+		const __m128i zero = _mm_setzero_si128();
+		const char *s;
+
+		for (; i + 16 <= len; i += 16) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(txt + i));
+			__m128i m = _mm_cmpeq_epi8(v, zero);
+			int mask;
+
+			for (s = esc->special; *s; s++)
+				m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(*s)));
+			mask = _mm_movemask_epi8(m);
+			if (mask)
+				return i + __builtin_ctz(mask);
+		}
+	}
+#endif
+	for (; i < len; i++)
+		if (!txt[i] || esc->table[(unsigned char)txt[i]])
+			break;
+	return i;
+}
+
+/* Print at most len bytes of txt (up to the first NUL), escaped according
+ * to esc. Returns the number of bytes consumed.
+ */
+static size_t html_escape(const char *txt, size_t len,
+			  const struct escape_set *esc)
+{
+	const char *start = txt;
+	size_t n;
+
+	/* Callers may pass a cap rather than the length of txt */
+	len = strnlen(txt, len);
+	while (len) {
+		n = escape_span(txt, len, esc);
+		if (n)
+			html_raw(txt, n);
+		txt += n;
+		len -= n;
+		if (!len || !*txt)
+			break;
+		html(esc->table[(unsigned char)*txt]);
+		txt++;
+		len--;
+	}
+	return txt - start;
+}
+
 char *fmt(const char *format, ...)
 {
 	static char buf[8][1024];
@@ -78,10 +189,68 @@ char *fmtalloc(const char *format, ...)
 	return strbuf_detach(&sb, NULL);
 }
 
+/* Output is collected in a buffer and written to stdout in large chunks.
+ * The buffer must be flushed (html_flush) whenever stdout is about to be
+ * redirected, or before anything writes to it without going through
+ * html_raw().
+ */
+#define HTML_BUFFER_SIZE (64 * 1024)
+
+static char html_buffer[HTML_BUFFER_SIZE];
+static size_t html_buffer_len;
+static int html_flushing;
+static uintmax_t html_writes, html_bytes;
+
+static void html_write(const char *data, size_t size)
+{
+	ssize_t ret;
+
+	while (size) {
+		ret = write(STDOUT_FILENO, data, size);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			die_errno("write error on html output");
+		html_writes++;
+		html_bytes += ret;
+		data += ret;
+		size -= ret;
+	}
+}
+
+void html_flush(void)
+{
+	/* A lua filter prints its output while we are flushing to it; that
+	 * output is written directly by html_raw(). */
+	if (html_flushing || !html_buffer_len)
+		return;
+	html_flushing = 1;
+	html_write(html_buffer, html_buffer_len);
+	html_buffer_len = 0;
+	html_flushing = 0;
+}
+
+void html_output_stats(uintmax_t *writes, uintmax_t *bytes)
+{
+	*writes = html_writes;
+	*bytes = html_bytes;
+}
+
 void html_raw(const char *data, size_t size)
 {
-	if (write(STDOUT_FILENO, data, size) != size)
-		die_errno("write error on html output");
+	if (html_flushing) {
+		html_write(data, size);
+		return;
+	}
+	if (html_buffer_len + size > HTML_BUFFER_SIZE) {
+		html_flush();
+		if (size >= HTML_BUFFER_SIZE) {
+			html_write(data, size);
+			return;
+		}
+	}
+	memcpy(html_buffer + html_buffer_len, data, size);
+	html_buffer_len += size;
 }
 
 void html(const char *txt)
@@ -130,30 +299,17 @@ void html_txt(const char *txt)
 
 ssize_t html_ntxt(const char *txt, size_t len)
 {
-	const char *t = txt;
-	ssize_t slen;
+	size_t n;
 
 	if (len > SSIZE_MAX)
 		return -1;
+	if (!txt)
+		return len;
 
-	slen = (ssize_t) len;
-	while (t && *t && slen--) {
-		int c = *t;
-		if (c == '<' || c == '>' || c == '&') {
-			html_raw(txt, t - txt);
-			if (c == '>')
-				html("&gt;");
-			else if (c == '<')
-				html("&lt;");
-			else if (c == '&')
-				html("&amp;");
-			txt = t + 1;
-		}
-		t++;
-	}
-	if (t != txt)
-		html_raw(txt, t - txt);
-	return slen;
+	n = html_escape(txt, len, &html_text_escape);
+	if (n < len)
+		return len - n;
+	return txt[len] ? -1 : 0;
 }
 
 void html_attrf(const char *fmt, ...)
@@ -171,89 +327,28 @@ void html_attrf(const char *fmt, ...)
 
 void html_attr(const char *txt)
 {
-	const char *t = txt;
-	while (t && *t) {
-		int c = *t;
-		if (c == '<' || c == '>' || c == '\'' || c == '\"' || c == '&') {
-			html_raw(txt, t - txt);
-			if (c == '>')
-				html("&gt;");
-			else if (c == '<')
-				html("&lt;");
-			else if (c == '\'')
-				html("&#x27;");
-			else if (c == '"')
-				html("&quot;");
-			else if (c == '&')
-				html("&amp;");
-			txt = t + 1;
-		}
-		t++;
-	}
-	if (t != txt)
-		html(txt);
+	if (txt)
+		html_escape(txt, strlen(txt), &html_attr_escape);
 }
 
 void html_url_path(const char *txt)
 {
-	const char *t = txt;
-	while (t && *t) {
-		unsigned char c = *t;
-		const char *e = url_escape_table[c];
-		if (e && c != '+' && c != '&') {
-			html_raw(txt, t - txt);
-			html(e);
-			txt = t + 1;
-		}
-		t++;
-	}
-	if (t != txt)
-		html(txt);
+	init_url_escapes();
+	if (txt)
+		html_escape(txt, strlen(txt), &url_path_escape);
 }
 
 void html_url_arg(const char *txt)
 {
-	const char *t = txt;
-	while (t && *t) {
-		unsigned char c = *t;
-		const char *e = url_escape_table[c];
-		if (c == ' ')
-			e = "+";
-		if (e) {
-			html_raw(txt, t - txt);
-			html(e);
-			txt = t + 1;
-		}
-		t++;
-	}
-	if (t != txt)
-		html(txt);
+	init_url_escapes();
+	if (txt)
+		html_escape(txt, strlen(txt), &url_arg_escape);
 }
 
 void html_header_arg_in_quotes(const char *txt)
 {
-	const char *t = txt;
-	while (t && *t) {
-		unsigned char c = *t;
-		const char *e = NULL;
-		if (c == '\\')
-			e = "\\\\";
-		else if (c == '\r')
-			e = "\\r";
-		else if (c == '\n')
-			e = "\\n";
-		else if (c == '"')
-			e = "\\\"";
-		if (e) {
-			html_raw(txt, t - txt);
-			html(e);
-			txt = t + 1;
-		}
-		t++;
-	}
-	if (t != txt)
-		html(txt);
-
+	if (txt)
+		html_escape(txt, strlen(txt), &header_arg_escape);
 }
 
 void html_hidden(const char *name, const char *value)
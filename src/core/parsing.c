@@ -10,6 +10,15 @@
 
 #include "cgit.h"
 
+/* Find the last slash in 'url' before 'end', if any */
+static char *last_slash(const char *url, const char *end)
+{
+	while (end > url)
+		if (*--end == '/')
+			return (char *)end;
+	return NULL;
+}
+
 /*
  * url syntax: [repo ['/' cmd [ '/' path]]]
  *   repo: any valid repo url, may contain '/'
@@ -32,17 +41,19 @@ void cgit_parse_url(const char *url)
 		return;
 	}
 
+	/* The longest prefix of the url naming a repository wins, so try
+	 * them from the longest one down.
+	 */
 	cmd = NULL;
-	c = strchr(url, '/');
-	while (c) {
+	for (c = last_slash(url, url + strlen(url)); c; c = last_slash(url, c)) {
 		c[0] = '\0';
 		repo = cgit_get_repoinfo(url);
+		c[0] = '/';
 		if (repo) {
 			ctx.repo = repo;
 			cmd = c;
+			break;
 		}
-		c[0] = '/';
-		c = strchr(c + 1, '/');
 	}
 
 	if (ctx.repo) {
@@ -0,0 +1,624 @@
+/* repo-index.c: the cached result of scan-path, as a binary index
+ *
+ * Copyright (C) Dominic R and contributors (see AUTHORS)
+ *
+ * Licensed under GNU General Public License v2
+ *   (see COPYING for full license text)
+ */
+
+/* The index holds one fixed-size record per repository, whose strings
+ * are offsets into a string table, and a hash table from the url of a
+ * repository to its record. It is mapped (copy-on-write) rather than
+ * parsed: loading it only reserves entries in cgit_repolist, and a
+ * record is decoded into its entry the first time the repository is
+ * looked up, with its strings pointing into the mapping. The pages
+ * listing all repositories decode all records at once, which still
+ * doesn't allocate anything for most repositories.
+ *
+ * A record holds what print_repo() would write for the repository, and
+ * is decoded on top of the defaults cgit_add_repo() would have used when
+ * the index was loaded, so the result is the same as that of parsing
+ * the repolist as cgitrc.
+ *
+ * A record also holds the time of the last change to the repository, as
+ * found when the index was written, so that the index page can show and
+ * sort by it without looking at every repository. It's updated in place
+ * by repo_index_update_modtime(), e.g. after a push.
+ */
+
+#include "cgit.h"
+#include "cache.h"
+#include "cgit-main.h"
+#include "repo-index.h"
+
+#define INDEX_MAGIC "cgitidx"
+#define INDEX_VERSION 2
+
+#define RECORD_BLAME		(1 << 0)
+#define RECORD_COMMIT_GRAPH	(1 << 1)
+#define RECORD_LOG_FILECOUNT	(1 << 2)
+#define RECORD_LOG_LINECOUNT	(1 << 3)
+#define RECORD_REMOTE_BRANCHES	(1 << 4)
+#define RECORD_SUBJECT_LINKS	(1 << 5)
+#define RECORD_HTML_SERVING	(1 << 6)
+#define RECORD_BRANCH_SORT_AGE	(1 << 7)
+#define RECORD_HIDE		(1 << 8)
+#define RECORD_IGNORE		(1 << 9)
+#define RECORD_SNAPSHOTS	(1 << 10)	/* snapshots is set */
+#define RECORD_MAX_STATS	(1 << 11)	/* max_stats is set */
+
+enum record_filter {
+	RECORD_ABOUT_FILTER,
+	RECORD_COMMIT_FILTER,
+	RECORD_SOURCE_FILTER,
+	RECORD_EMAIL_FILTER,
+	RECORD_OWNER_FILTER,
+	RECORD_FILTERS
+};
+
+static const char *filter_names[RECORD_FILTERS] = {
+	"about-filter", "commit-filter", "source-filter", "email-filter",
+	"owner-filter",
+};
+
+struct index_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t count;		/* of records */
+	uint32_t buckets;	/* of the hash table, a power of 2 */
+	uint32_t stats;		/* the stats line of the scan */
+	uint32_t reserved;
+	uint64_t strings_size;
+};
+
+/* Strings are offsets into the string table, of which the first byte is
+ * a NUL: 0 stands for no string (i.e. the default).
+ */
+struct index_record {
+	uint32_t url;
+	uint32_t name;
+	uint32_t path;
+	uint32_t owner;
+	uint32_t desc;
+	uint32_t section;
+	uint32_t homepage;
+	uint32_t clone_url;
+	uint32_t defbranch;
+	uint32_t extra_head_content;
+	uint32_t module_link;
+	uint32_t snapshot_prefix;
+	uint32_t logo;
+	uint32_t logo_link;
+	uint32_t readme;	/* entries separated by newlines */
+	uint32_t filters[RECORD_FILTERS];
+	uint32_t flags;
+	int32_t snapshots;
+	int32_t max_stats;
+	int32_t commit_sort;
+	int64_t mtime;		/* of the last change, 0 if unknown */
+};
+
+/* The file is laid out as the header, the records, the hash table (the
+ * index of a record plus one, or 0 for an empty bucket) and the strings.
+ */
+struct repo_index {
+	char *file;
+	dev_t dev;		/* the file which is mapped */
+	ino_t ino;
+	char *map;
+	size_t size;
+	const struct index_header *hdr;
+	struct index_record *records;
+	const uint32_t *buckets;
+	const char *strings;
+	int start;		/* the first entry in cgit_repolist */
+	int pending;		/* records not decoded yet */
+	unsigned char *decoded;	/* bitmap */
+	struct cgit_repo defaults;
+};
+
+static struct repo_index **indexes;
+static size_t indexes_nr, indexes_alloc;
+
+/* Writing */
+
+#define MAX_FIELDS 32
+
+struct index_writer {
+	struct strbuf strings;
+	uint32_t last[MAX_FIELDS];	/* the strings of the previous record */
+	int field;
+};
+
+/* Add 's' to the string table and return its offset. Repositories next
+ * to each other often share their owner, section and such, so a string
+ * equal to that of the previous record in the same field is reused.
+ */
+static uint32_t add_string(struct index_writer *w, const char *s)
+{
+	int field = w->field++;
+	uint32_t ofs;
+
+	if (!s)
+		return 0;
+	if (w->last[field] && !strcmp(w->strings.buf + w->last[field], s))
+		return w->last[field];
+	ofs = w->strings.len;
+	strbuf_add(&w->strings, s, strlen(s) + 1);
+	w->last[field] = ofs;
+	return ofs;
+}
+
+static char *filter_spec(struct cgit_filter *filter)
+{
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *f = open_memstream(&buf, &len);
+
+	if (!f)
+		return NULL;
+	cgit_fprintf_filter(filter, f, "");
+	fclose(f);
+	if (len && buf[len - 1] == '\n')
+		buf[len - 1] = '\0';
+	return buf;
+}
+
+static void write_record(struct index_writer *w, struct index_record *rec,
+			 struct cgit_repo *repo, struct strbuf *tmp)
+{
+	struct cgit_filter *filters[RECORD_FILTERS] = {
+		repo->about_filter, repo->commit_filter, repo->source_filter,
+		repo->email_filter, repo->owner_filter,
+	};
+	struct cgit_filter *defaults[RECORD_FILTERS] = {
+		ctx.cfg.about_filter, ctx.cfg.commit_filter,
+		ctx.cfg.source_filter, ctx.cfg.email_filter,
+		ctx.cfg.owner_filter,
+	};
+	struct string_list_item *item;
+	time_t mtime;
+	char *spec;
+	int i;
+
+	memset(rec, 0, sizeof(*rec));
+	w->field = 0;
+	rec->url = add_string(w, repo->url);
+	rec->name = add_string(w, repo->name);
+	rec->path = add_string(w, repo->path);
+	rec->owner = add_string(w, repo->owner);
+	strbuf_reset(tmp);
+	if (repo->desc && repo->desc != cgit_default_repo_desc)
+		strbuf_add(tmp, repo->desc, strchrnul(repo->desc, '\n') - repo->desc);
+	rec->desc = add_string(w, tmp->len ? tmp->buf : NULL);
+	rec->section = add_string(w, repo->section);
+	rec->homepage = add_string(w, repo->homepage);
+	rec->clone_url = add_string(w, repo->clone_url);
+	rec->defbranch = add_string(w, repo->defbranch);
+	rec->extra_head_content = add_string(w, repo->extra_head_content);
+	rec->module_link = add_string(w, repo->module_link);
+	rec->snapshot_prefix = add_string(w, repo->snapshot_prefix);
+	rec->logo = add_string(w, repo->logo);
+	rec->logo_link = add_string(w, repo->logo_link);
+
+	strbuf_reset(tmp);
+	if (repo->readme.items != ctx.cfg.readme.items) {
+		for_each_string_list_item(item, &repo->readme) {
+			if (item->util)
+				strbuf_addf(tmp, "%s:", (char *)item->util);
+			strbuf_addf(tmp, "%s\n", item->string);
+		}
+	}
+	rec->readme = add_string(w, tmp->len ? tmp->buf : NULL);
+
+	for (i = 0; i < RECORD_FILTERS; i++) {
+		spec = NULL;
+		if (filters[i] && filters[i] != defaults[i])
+			spec = filter_spec(filters[i]);
+		rec->filters[i] = add_string(w, spec);
+		free(spec);
+	}
+
+	if (repo->enable_blame)
+		rec->flags |= RECORD_BLAME;
+	if (repo->enable_commit_graph)
+		rec->flags |= RECORD_COMMIT_GRAPH;
+	if (repo->enable_log_filecount)
+		rec->flags |= RECORD_LOG_FILECOUNT;
+	if (repo->enable_log_linecount)
+		rec->flags |= RECORD_LOG_LINECOUNT;
+	if (repo->enable_remote_branches)
+		rec->flags |= RECORD_REMOTE_BRANCHES;
+	if (repo->enable_subject_links)
+		rec->flags |= RECORD_SUBJECT_LINKS;
+	if (repo->enable_html_serving)
+		rec->flags |= RECORD_HTML_SERVING;
+	if (repo->branch_sort == 1)
+		rec->flags |= RECORD_BRANCH_SORT_AGE;
+	if (repo->hide)
+		rec->flags |= RECORD_HIDE;
+	if (repo->ignore)
+		rec->flags |= RECORD_IGNORE;
+	if (repo->snapshots != ctx.cfg.snapshots) {
+		rec->flags |= RECORD_SNAPSHOTS;
+		rec->snapshots = repo->snapshots;
+	}
+	if (repo->max_stats != ctx.cfg.max_stats) {
+		rec->flags |= RECORD_MAX_STATS;
+		rec->max_stats = repo->max_stats;
+	}
+	rec->commit_sort = repo->commit_sort;
+	if (!repo->ignore && cgit_get_repo_modtime(repo, &mtime))
+		rec->mtime = mtime;
+}
+
+/* Write the repositories from 'start' on in cgit_repolist as an index to
+ * 'f', with the line 'stats' describing the scan. Returns 0 on success
+ * and -1 on write errors.
+ */
+int repo_index_write(FILE *f, int start, const char *stats)
+{
+	struct index_writer w = { STRBUF_INIT };
+	struct index_header hdr;
+	struct index_record *records;
+	struct strbuf tmp = STRBUF_INIT;
+	uint32_t *buckets, nbuckets = 16, b;
+	int i, count = cgit_repolist.count - start, ret = 0;
+
+	while (nbuckets < 2 * count)
+		nbuckets *= 2;
+	CALLOC_ARRAY(records, count);
+	CALLOC_ARRAY(buckets, nbuckets);
+
+	strbuf_addch(&w.strings, '\0');
+	for (i = 0; i < count; i++) {
+		write_record(&w, &records[i], &cgit_repolist.repos[start + i],
+			     &tmp);
+		/* Linear probing keeps records with the same url in order */
+		b = hash_str64(cgit_repolist.repos[start + i].url) &
+		    (nbuckets - 1);
+		while (buckets[b])
+			b = (b + 1) & (nbuckets - 1);
+		buckets[b] = i + 1;
+	}
+	w.field = 0;
+	w.last[0] = 0;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, INDEX_MAGIC, sizeof(hdr.magic));
+	hdr.version = INDEX_VERSION;
+	hdr.record_size = sizeof(struct index_record);
+	hdr.count = count;
+	hdr.buckets = nbuckets;
+	hdr.stats = add_string(&w, stats);
+	hdr.strings_size = w.strings.len;
+
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    (count && fwrite(records, sizeof(*records), count, f) != count) ||
+	    fwrite(buckets, sizeof(*buckets), nbuckets, f) != nbuckets ||
+	    fwrite(w.strings.buf, 1, w.strings.len, f) != w.strings.len)
+		ret = -1;
+
+	free(records);
+	free(buckets);
+	strbuf_release(&w.strings);
+	strbuf_release(&tmp);
+	return ret;
+}
+
+/* Loading */
+
+static const char *get_string(struct repo_index *index, uint32_t ofs)
+{
+	if (!ofs || ofs >= index->hdr->strings_size)
+		return NULL;
+	return index->strings + ofs;
+}
+
+/* Decode the 'n'-th record of the index into its entry of cgit_repolist */
+static struct cgit_repo *decode(struct repo_index *index, uint32_t n)
+{
+	struct cgit_repo *repo = &cgit_repolist.repos[index->start + n];
+	struct index_record *rec = &index->records[n];
+	const char *s;
+	char *p, *eol;
+	int i;
+
+	if (!index->decoded || (index->decoded[n / 8] & (1 << (n % 8))))
+		return repo;
+	index->decoded[n / 8] |= 1 << (n % 8);
+	index->pending--;
+
+	*repo = index->defaults;
+	/* The mapping is private, so the strings may be modified */
+#define STR(field) \
+	do { \
+		if ((s = get_string(index, rec->field))) \
+			repo->field = (char *)s; \
+	} while (0)
+	STR(url);
+	STR(name);
+	STR(path);
+	STR(owner);
+	STR(desc);
+	STR(section);
+	STR(homepage);
+	STR(clone_url);
+	STR(defbranch);
+	STR(extra_head_content);
+	STR(module_link);
+	STR(snapshot_prefix);
+	STR(logo);
+	STR(logo_link);
+#undef STR
+
+	if ((s = get_string(index, rec->readme))) {
+		for (p = (char *)s; (eol = strchr(p, '\n')); p = eol + 1) {
+			*eol = '\0';
+			cgit_repo_config(repo, "readme", p);
+			*eol = '\n';
+		}
+	}
+	for (i = 0; i < RECORD_FILTERS; i++)
+		if ((s = get_string(index, rec->filters[i])))
+			cgit_repo_config(repo, filter_names[i], s);
+
+	repo->enable_blame = !!(rec->flags & RECORD_BLAME);
+	repo->enable_commit_graph = !!(rec->flags & RECORD_COMMIT_GRAPH);
+	repo->enable_log_filecount = !!(rec->flags & RECORD_LOG_FILECOUNT);
+	repo->enable_log_linecount = !!(rec->flags & RECORD_LOG_LINECOUNT);
+	repo->enable_remote_branches = !!(rec->flags & RECORD_REMOTE_BRANCHES);
+	repo->enable_subject_links = !!(rec->flags & RECORD_SUBJECT_LINKS);
+	repo->enable_html_serving = !!(rec->flags & RECORD_HTML_SERVING);
+	if (rec->flags & RECORD_BRANCH_SORT_AGE)
+		repo->branch_sort = 1;
+	if (rec->commit_sort == 1 || rec->commit_sort == 2)
+		repo->commit_sort = rec->commit_sort;
+	repo->hide = !!(rec->flags & RECORD_HIDE);
+	repo->ignore = !!(rec->flags & RECORD_IGNORE);
+	if (rec->flags & RECORD_SNAPSHOTS)
+		repo->snapshots = ctx.cfg.snapshots & rec->snapshots;
+	if ((rec->flags & RECORD_MAX_STATS) && rec->max_stats)
+		repo->max_stats = rec->max_stats;
+	repo->mtime = rec->mtime;
+	cgit_hash_repo(index->start + n);
+	return repo;
+}
+
+static int check_index(struct repo_index *index)
+{
+	const struct index_header *hdr = index->hdr;
+	uint64_t size;
+
+	if (index->size < sizeof(*hdr) ||
+	    memcmp(hdr->magic, INDEX_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != INDEX_VERSION ||
+	    hdr->record_size != sizeof(struct index_record) ||
+	    !hdr->buckets || (hdr->buckets & (hdr->buckets - 1)) ||
+	    hdr->count >= hdr->buckets || !hdr->strings_size)
+		return -1;
+	size = sizeof(*hdr) + (uint64_t)hdr->count * hdr->record_size +
+	       (uint64_t)hdr->buckets * sizeof(uint32_t) + hdr->strings_size;
+	if (size != index->size)
+		return -1;
+	index->records = (struct index_record *)(index->map + sizeof(*hdr));
+	index->buckets = (const uint32_t *)(index->records + hdr->count);
+	index->strings = (const char *)(index->buckets + hdr->buckets);
+	/* Strings must not run off the end of the mapping */
+	if (index->strings[0] || index->strings[hdr->strings_size - 1])
+		return -1;
+	return 0;
+}
+
+/* Map the index in 'file' and add its repositories to cgit_repolist,
+ * without decoding them yet. Returns 0 on success, and -1 if the index
+ * is missing or invalid.
+ */
+int repo_index_load(const char *file)
+{
+	struct repo_index *index;
+	struct stat st;
+	void *map;
+	size_t size;
+	int fd, n;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) || !st.st_size) {
+		close(fd);
+		return -1;
+	}
+	size = st.st_size;
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+
+	CALLOC_ARRAY(index, 1);
+	index->file = xstrdup(file);
+	index->dev = st.st_dev;
+	index->ino = st.st_ino;
+	index->map = map;
+	index->size = size;
+	index->hdr = map;
+	if (check_index(index)) {
+		fprintf(stderr, "[cgit] Invalid repository index %s\n", file);
+		munmap(map, size);
+		free(index->file);
+		free(index);
+		return -1;
+	}
+
+	n = index->hdr->count;
+	index->start = cgit_reserve_repos(n);
+	index->pending = n;
+	index->decoded = xcalloc((n + 7) / 8, 1);
+	cgit_init_repo(&index->defaults);
+	ALLOC_GROW(indexes, indexes_nr + 1, indexes_alloc);
+	indexes[indexes_nr++] = index;
+
+	/* Like after parsing the repolist, repo.* settings which follow
+	 * apply to the last repository.
+	 */
+	if (n)
+		ctx.repo = decode(index, n - 1);
+	return 0;
+}
+
+/* Decode the repositories with the url 'url' in all indexes, so that
+ * they can be found in the table of urls of cgit_repolist.
+ */
+void repo_index_decode_url(const char *url)
+{
+	struct repo_index *index;
+	const char *s;
+	uint32_t mask, b, n;
+	size_t k;
+
+	for (k = 0; k < indexes_nr; k++) {
+		index = indexes[k];
+		if (!index->pending)
+			continue;
+		mask = index->hdr->buckets - 1;
+		for (b = hash_str64(url) & mask; (n = index->buckets[b]);
+		     b = (b + 1) & mask) {
+			if (n > index->hdr->count)
+				break;
+			s = get_string(index, index->records[n - 1].url);
+			if (s && !strcmp(s, url))
+				decode(index, n - 1);
+		}
+	}
+}
+
+/* Open the file of 'index' for writing, unless it has been replaced by
+ * another index since it was loaded. Returns the file descriptor, -1 on
+ * errors and -2 if the file has been replaced.
+ */
+static int open_index(struct repo_index *index)
+{
+	struct stat st;
+	int fd;
+
+	fd = open(index->file, O_WRONLY);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st)) {
+		close(fd);
+		return -1;
+	}
+	if (st.st_dev != index->dev || st.st_ino != index->ino) {
+		close(fd);
+		return -2;
+	}
+	return fd;
+}
+
+/* Find the last change to the repositories with the url 'url' again and
+ * write it to the indexes they came from, so that the next requests see
+ * it. Indexes which have been replaced since they were loaded are left
+ * alone; they were generated after the change. Returns 0 on success and
+ * errno otherwise.
+ */
+int repo_index_update_modtime(const char *url)
+{
+	struct repo_index *index;
+	struct cgit_repo *repo;
+	const char *s;
+	uint32_t mask, b, n;
+	int64_t mtime;
+	time_t t;
+	off_t ofs;
+	size_t k;
+	int fd, err = 0;
+
+	for (k = 0; k < indexes_nr; k++) {
+		index = indexes[k];
+		fd = -1;
+		mask = index->hdr->buckets - 1;
+		for (b = hash_str64(url) & mask; (n = index->buckets[b]);
+		     b = (b + 1) & mask) {
+			if (n > index->hdr->count)
+				break;
+			s = get_string(index, index->records[n - 1].url);
+			if (!s || strcmp(s, url))
+				continue;
+			repo = decode(index, n - 1);
+			repo->mtime = -1;
+			mtime = cgit_get_repo_modtime(repo, &t) ? t : 0;
+			ofs = sizeof(*index->hdr) +
+			      (off_t)(n - 1) * index->hdr->record_size +
+			      offsetof(struct index_record, mtime);
+			if (fd < 0 && (fd = open_index(index)) == -2)
+				break;
+			if (fd < 0 ||
+			    pwrite(fd, &mtime, sizeof(mtime), ofs) != sizeof(mtime)) {
+				err = errno ? errno : EIO;
+				fprintf(stderr, "[cgit] Unable to update %s: %s (%d)\n",
+					index->file, strerror(err), err);
+				break;
+			}
+		}
+		if (fd >= 0)
+			close(fd);
+	}
+	return err;
+}
+
+/* Is entry 'i' of cgit_repolist a repository which hasn't been decoded? */
+int repo_index_is_pending(int i)
+{
+	struct repo_index *index;
+	size_t k;
+	int n;
+
+	for (k = 0; k < indexes_nr; k++) {
+		index = indexes[k];
+		n = i - index->start;
+		if (index->pending && n >= 0 && (uint32_t)n < index->hdr->count)
+			return !(index->decoded[n / 8] & (1 << (n % 8)));
+	}
+	return 0;
+}
+
+/* Decode all repositories, e.g. before cgit_repolist gets sorted, after
+ * which the entries no longer match the records.
+ */
+void repo_index_decode_all(void)
+{
+	struct repo_index *index;
+	size_t k;
+	uint32_t n;
+
+	for (k = 0; k < indexes_nr; k++) {
+		index = indexes[k];
+		for (n = 0; index->pending && n < index->hdr->count; n++)
+			decode(index, n);
+		FREE_AND_NULL(index->decoded);
+	}
+}
+
+/* Print the repositories of the index in 'file' with 'print', preceded by
+ * the stats of the scan. Returns 0 on success and -1 if the index can't be
+ * loaded.
+ */
+int repo_index_print(const char *file,
+		     void (*print)(FILE *f, struct cgit_repo *repo))
+{
+	struct repo_index *index;
+	const char *stats;
+	int i, start = cgit_repolist.count;
+
+	if (repo_index_load(file))
+		return -1;
+	index = indexes[indexes_nr - 1];
+	stats = get_string(index, index->hdr->stats);
+	if (stats)
+		fputs(stats, stdout);
+	repo_index_decode_all();
+	for (i = start; i < cgit_repolist.count; i++)
+		print(stdout, &cgit_repolist.repos[i]);
+	return 0;
+}
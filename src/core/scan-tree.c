@@ -11,16 +11,115 @@
 #include "configfile.h"
 #include "html.h"
 #include <config.h>
+#include <thread-utils.h>
 
-/* return 1 if path contains a objects/ directory and a HEAD file */
-static int is_git_dir(const char *path)
+/* Repositories are discovered in two phases. First the directories below
+ * the scanned path are read into a tree, by one or more threads taking
+ * directories off a shared stack and pushing the subdirectories they
+ * find. Each directory is opened once, and its entries are checked with
+ * fstatat() relative to it, which is skipped entirely when readdir()
+ * already tells us the type of an entry. Everything add_repo() needs to
+ * know about the file system is gathered in this phase as well.
+ *
+ * Then the tree is walked in the order readdir() returned its entries,
+ * and the repositories are added one after the other, exactly in the
+ * order of a recursive scan.
+ *
+ * The tree can be recorded in a file (see scan_track_dirs()), together
+ * with the ctime of every directory, which changes whenever an entry is
+ * added to, removed from or renamed in the directory. The next scan only
+ * stats a directory whose ctime is unchanged, and takes its repository
+ * or its subdirectories from the record instead of reading it again.
+ */
+
+#define SCAN_DESCRIPTION	(1 << 0)
+#define SCAN_CGITRC		(1 << 1)
+#define SCAN_SKIPPED		(1 << 2)	/* a repository not to add */
+#define SCAN_NOREUSE		(1 << 3)	/* to be read on the next scan */
+#define SCAN_BARE		(1 << 4)	/* gitdir is path (recorded) */
+#define SCAN_WORKTREE		(1 << 5)	/* gitdir is path/.git (recorded) */
+
+#define SCAN_DIRS_HEADER "# cgit scan directories 1 hidden=%d strict-export=%s\n"
+
+struct scan_time {
+	intmax_t sec;
+	unsigned nsec;
+};
+
+struct scan_dir {
+	char *path;
+	char *gitdir;		/* the repository, if this is one */
+	struct stat st;		/* of gitdir */
+	unsigned flags;
+	struct scan_time ctime;		/* of path */
+	struct scan_time git_ctime;	/* of gitdir */
+	struct scan_dir *prev;	/* this directory in the recorded scan */
+	struct scan_dir **sub;
+	size_t sub_nr, sub_alloc;
+};
+
+struct scan_counts {
+	uintmax_t dirs;
+	uintmax_t unchanged;
+	uintmax_t stats;
+	uintmax_t entries;
+	uintmax_t repos;
+};
+
+struct scan_worker {
+	pthread_t thread;
+	struct scan_counts counts;
+};
+
+static struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct scan_dir **stack;
+	size_t nr, alloc;
+	size_t pending;		/* directories on the stack or being read */
+} queue;
+
+/* Totals of all scans of this process, see scan_stats() */
+static struct scan_counts totals;
+static uint64_t total_ns;
+static int total_threads;
+
+/* The recorded scan, and where to record the current one */
+static struct scan_dir **prev_roots;
+static size_t prev_nr, prev_alloc;
+static FILE *dirs_out;
+
+static void get_ctime(struct scan_time *t, const struct stat *st)
+{
+	t->sec = st->st_ctime;
+	t->nsec = ST_CTIME_NSEC(*st);
+}
+
+static int same_ctime(const struct scan_time *t, const struct stat *st)
+{
+	return t->sec == st->st_ctime && t->nsec == ST_CTIME_NSEC(*st);
+}
+
+static int scan_stat(struct scan_worker *w, int fd, const char *name,
+		     struct stat *st)
+{
+	w->counts.stats++;
+	return fstatat(fd, name, st, 0);
+}
+
+/* return 1 if the directory 'fd' has a objects/ directory and a HEAD file
+ * below 'prefix' (which is empty or ends with a slash). 'path' is the
+ * name of the candidate, for error messages.
+ */
+static int is_git_dir(struct scan_worker *w, int fd, const char *prefix,
+		      const char *path)
 {
 	struct stat st;
-	struct strbuf pathbuf = STRBUF_INIT;
+	struct strbuf name = STRBUF_INIT;
 	int result = 0;
 
-	strbuf_addf(&pathbuf, "%s/objects", path);
-	if (stat(pathbuf.buf, &st)) {
+	strbuf_addf(&name, "%sobjects", prefix);
+	if (scan_stat(w, fd, name.buf, &st)) {
 		if (errno != ENOENT)
 			fprintf(stderr, "Error checking path %s: %s (%d)\n",
 				path, strerror(errno), errno);
@@ -29,9 +128,9 @@ static int is_git_dir(const char *path)
 	if (!S_ISDIR(st.st_mode))
 		goto out;
 
-	strbuf_reset(&pathbuf);
-	strbuf_addf(&pathbuf, "%s/HEAD", path);
-	if (stat(pathbuf.buf, &st)) {
+	strbuf_reset(&name);
+	strbuf_addf(&name, "%sHEAD", prefix);
+	if (scan_stat(w, fd, name.buf, &st)) {
 		if (errno != ENOENT)
 			fprintf(stderr, "Error checking path %s: %s (%d)\n",
 				path, strerror(errno), errno);
@@ -42,10 +141,306 @@ static int is_git_dir(const char *path)
 
 	result = 1;
 out:
-	strbuf_release(&pathbuf);
+	strbuf_release(&name);
 	return result;
 }
 
+/* Check whether the repository found in 'dir' is to be added at all, and
+ * which of its optional files exist. 'fd' is the directory, and the
+ * repository is below 'prefix' in it.
+ */
+static void read_repo(struct scan_worker *w, struct scan_dir *dir, int fd,
+		      const char *prefix)
+{
+	struct strbuf name = STRBUF_INIT;
+	struct stat st;
+	size_t len;
+
+	strbuf_addstr(&name, prefix);
+	len = name.len;
+	if (*prefix ? scan_stat(w, fd, prefix, &dir->st) : fstat(fd, &dir->st)) {
+		fprintf(stderr, "Error accessing %s: %s (%d)\n",
+			dir->gitdir, strerror(errno), errno);
+		FREE_AND_NULL(dir->gitdir);
+		dir->flags |= SCAN_NOREUSE;
+		goto out;
+	}
+	get_ctime(&dir->git_ctime, &dir->st);
+
+	if (ctx.cfg.strict_export) {
+		strbuf_addstr(&name, ctx.cfg.strict_export);
+		if (scan_stat(w, fd, name.buf, &st))
+			goto skip;
+		strbuf_setlen(&name, len);
+	}
+
+	strbuf_addstr(&name, "noweb");
+	if (!scan_stat(w, fd, name.buf, &st))
+		goto skip;
+	strbuf_setlen(&name, len);
+
+	strbuf_addstr(&name, "description");
+	if (!scan_stat(w, fd, name.buf, &st))
+		dir->flags |= SCAN_DESCRIPTION;
+	strbuf_setlen(&name, len);
+
+	strbuf_addstr(&name, "cgitrc");
+	if (!scan_stat(w, fd, name.buf, &st))
+		dir->flags |= SCAN_CGITRC;
+
+	w->counts.repos++;
+	goto out;
+skip:
+	dir->flags |= SCAN_SKIPPED;
+out:
+	strbuf_release(&name);
+}
+
+/* Take the directory 'dir' from the recorded scan if its ctime (and that
+ * of its repository) hasn't changed. Returns 1 if it has been taken, and
+ * 0 if it has to be read.
+ */
+static int reuse_dir(struct scan_worker *w, struct scan_dir *dir)
+{
+	struct scan_dir *prev = dir->prev, *sub;
+	struct stat st;
+	size_t i;
+
+	if ((prev->flags & SCAN_NOREUSE) ||
+	    scan_stat(w, AT_FDCWD, dir->path, &st) || !S_ISDIR(st.st_mode) ||
+	    !same_ctime(&prev->ctime, &st))
+		return 0;
+	get_ctime(&dir->ctime, &st);
+
+	if (prev->gitdir) {
+		if (strcmp(prev->gitdir, prev->path) &&
+		    scan_stat(w, AT_FDCWD, prev->gitdir, &st))
+			return 0;
+		if (!same_ctime(&prev->git_ctime, &st))
+			return 0;
+		dir->st = st;
+		dir->git_ctime = prev->git_ctime;
+		dir->gitdir = xstrdup(prev->gitdir);
+		dir->flags = prev->flags;
+		if (!(dir->flags & SCAN_SKIPPED))
+			w->counts.repos++;
+		w->counts.unchanged++;
+		return 1;
+	}
+
+	for (i = 0; i < prev->sub_nr; i++) {
+		CALLOC_ARRAY(sub, 1);
+		sub->path = xstrdup(prev->sub[i]->path);
+		sub->prev = prev->sub[i];
+		ALLOC_GROW(dir->sub, dir->sub_nr + 1, dir->sub_alloc);
+		dir->sub[dir->sub_nr++] = sub;
+	}
+	w->counts.unchanged++;
+	return 1;
+}
+
+/* Find the subdirectory 'name' of the recorded directory 'prev'. They are
+ * looked for in the order they were recorded, starting at *next.
+ */
+static struct scan_dir *find_prev(struct scan_dir *prev, const char *name,
+				  size_t *next)
+{
+	size_t i, len;
+
+	if (!prev)
+		return NULL;
+	len = strlen(prev->path) + 1;
+	for (i = *next; i < prev->sub_nr; i++)
+		if (!strcmp(prev->sub[i]->path + len, name))
+			goto found;
+	for (i = 0; i < *next && i < prev->sub_nr; i++)
+		if (!strcmp(prev->sub[i]->path + len, name))
+			goto found;
+	return NULL;
+found:
+	*next = i + 1;
+	return prev->sub[i];
+}
+
+/* Read the directory 'dir': either it's a repository (or has one in
+ * .git), or its subdirectories are added to dir->sub.
+ */
+static void read_dir(struct scan_worker *w, struct scan_dir *dir)
+{
+	struct strbuf gitdir = STRBUF_INIT;
+	struct scan_dir *sub;
+	struct dirent *ent;
+	struct stat st;
+	size_t next = 0;
+	DIR *d;
+	int fd, is_dir;
+
+	w->counts.dirs++;
+	if (dir->prev && reuse_dir(w, dir))
+		return;
+	fd = open(dir->path, O_RDONLY | O_DIRECTORY);
+	if (fd < 0) {
+		fprintf(stderr, "Error opening directory %s: %s (%d)\n",
+			dir->path, strerror(errno), errno);
+		return;
+	}
+	if (dirs_out) {
+		w->counts.stats++;
+		if (!fstat(fd, &st))
+			get_ctime(&dir->ctime, &st);
+	}
+
+	if (is_git_dir(w, fd, "", dir->path)) {
+		dir->gitdir = xstrdup(dir->path);
+		read_repo(w, dir, fd, "");
+		close(fd);
+		return;
+	}
+	strbuf_addf(&gitdir, "%s/.git", dir->path);
+	if (is_git_dir(w, fd, ".git/", gitdir.buf)) {
+		dir->gitdir = strbuf_detach(&gitdir, NULL);
+		read_repo(w, dir, fd, ".git/");
+		close(fd);
+		return;
+	}
+	strbuf_release(&gitdir);
+
+	d = fdopendir(fd);
+	if (!d) {
+		fprintf(stderr, "Error opening directory %s: %s (%d)\n",
+			dir->path, strerror(errno), errno);
+		close(fd);
+		return;
+	}
+	while ((ent = readdir(d)) != NULL) {
+		w->counts.entries++;
+		/* A .git which isn't a repository (yet) can become one
+		 * without changing the ctime of this directory, and names
+		 * with a newline can't be recorded.
+		 */
+		if (!strcmp(ent->d_name, ".git") || strchr(ent->d_name, '\n'))
+			dir->flags |= SCAN_NOREUSE;
+		if (ent->d_name[0] == '.') {
+			if (ent->d_name[1] == '\0')
+				continue;
+			if (ent->d_name[1] == '.' && ent->d_name[2] == '\0')
+				continue;
+			if (!ctx.cfg.scan_hidden_path)
+				continue;
+		}
+		switch (DTYPE(ent)) {
+		case DT_DIR:
+			is_dir = 1;
+			break;
+		case DT_UNKNOWN:
+		case DT_LNK:
+			/* Symbolic links are followed, like stat() does */
+			if (scan_stat(w, fd, ent->d_name, &st)) {
+				fprintf(stderr, "Error checking path %s/%s: %s (%d)\n",
+					dir->path, ent->d_name,
+					strerror(errno), errno);
+				dir->flags |= SCAN_NOREUSE;
+				continue;
+			}
+			is_dir = S_ISDIR(st.st_mode);
+			break;
+		default:
+			is_dir = 0;
+		}
+		if (!is_dir)
+			continue;
+		CALLOC_ARRAY(sub, 1);
+		sub->path = xstrfmt("%s/%s", dir->path, ent->d_name);
+		sub->prev = find_prev(dir->prev, ent->d_name, &next);
+		ALLOC_GROW(dir->sub, dir->sub_nr + 1, dir->sub_alloc);
+		dir->sub[dir->sub_nr++] = sub;
+	}
+	closedir(d);
+}
+
+/* Push the directories in 'dirs' onto the stack, in reverse so that they
+ * come off it in order. The caller holds the mutex.
+ */
+static void push_dirs(struct scan_dir **dirs, size_t nr)
+{
+	ALLOC_GROW(queue.stack, queue.nr + nr, queue.alloc);
+	while (nr)
+		queue.stack[queue.nr++] = dirs[--nr];
+}
+
+static void *scan_worker(void *data)
+{
+	struct scan_worker *w = data;
+	struct scan_dir *dir;
+
+	pthread_mutex_lock(&queue.mutex);
+	for (;;) {
+		while (!queue.nr && queue.pending)
+			pthread_cond_wait(&queue.cond, &queue.mutex);
+		if (!queue.nr)
+			break;
+		dir = queue.stack[--queue.nr];
+		pthread_mutex_unlock(&queue.mutex);
+
+		read_dir(w, dir);
+
+		pthread_mutex_lock(&queue.mutex);
+		push_dirs(dir->sub, dir->sub_nr);
+		queue.pending += dir->sub_nr;
+		queue.pending--;
+		if (dir->sub_nr || !queue.pending)
+			pthread_cond_broadcast(&queue.cond);
+	}
+	pthread_mutex_unlock(&queue.mutex);
+	return NULL;
+}
+
+static void read_dirs(struct scan_dir **roots, size_t nr)
+{
+	struct scan_worker *workers;
+	int i, threads = ctx.cfg.scan_threads, started, err;
+
+	if (threads <= 0)
+		threads = online_cpus();
+	if (!HAVE_THREADS || threads < 1)
+		threads = 1;
+
+	pthread_mutex_init(&queue.mutex, NULL);
+	pthread_cond_init(&queue.cond, NULL);
+	push_dirs(roots, nr);
+	queue.pending = nr;
+
+	CALLOC_ARRAY(workers, threads);
+	for (started = 1; started < threads; started++) {
+		err = pthread_create(&workers[started].thread, NULL,
+				     scan_worker, &workers[started]);
+		if (err) {
+			fprintf(stderr, "Error starting scan thread: %s (%d)\n",
+				strerror(err), err);
+			break;
+		}
+	}
+	scan_worker(&workers[0]);
+	for (i = 1; i < started; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	for (i = 0; i < started; i++) {
+		totals.dirs += workers[i].counts.dirs;
+		totals.unchanged += workers[i].counts.unchanged;
+		totals.stats += workers[i].counts.stats;
+		totals.entries += workers[i].counts.entries;
+		totals.repos += workers[i].counts.repos;
+	}
+	if (started > total_threads)
+		total_threads = started;
+
+	free(workers);
+	FREE_AND_NULL(queue.stack);
+	queue.nr = queue.alloc = 0;
+	pthread_cond_destroy(&queue.cond);
+	pthread_mutex_destroy(&queue.mutex);
+}
+
 static struct cgit_repo *repo;
 static repo_config_fn config_fn;
 
@@ -79,9 +474,9 @@ static char *xstrrchr(char *s, char *from, int c)
 	return from < s ? NULL : from;
 }
 
-static void add_repo(const char *base, struct strbuf *path, repo_config_fn fn)
+static void add_repo(const char *base, struct scan_dir *dir, repo_config_fn fn)
 {
-	struct stat st;
+	struct strbuf pathbuf = STRBUF_INIT, *path = &pathbuf;
 	struct passwd *pwd;
 	size_t pathlen;
 	struct strbuf rel = STRBUF_INIT;
@@ -89,27 +484,9 @@ static void add_repo(const char *base, struct strbuf *path, repo_config_fn fn)
 	int n;
 	size_t size;
 
-	if (stat(path->buf, &st)) {
-		fprintf(stderr, "Error accessing %s: %s (%d)\n",
-			path->buf, strerror(errno), errno);
-		return;
-	}
-
-	strbuf_addch(path, '/');
+	strbuf_addf(path, "%s/", dir->gitdir);
 	pathlen = path->len;
 
-	if (ctx.cfg.strict_export) {
-		strbuf_addstr(path, ctx.cfg.strict_export);
-		if(stat(path->buf, &st))
-			return;
-		strbuf_setlen(path, pathlen);
-	}
-
-	strbuf_addstr(path, "noweb");
-	if (!stat(path->buf, &st))
-		return;
-	strbuf_setlen(path, pathlen);
-
 	if (!starts_with(path->buf, base))
 		strbuf_addbuf(&rel, path);
 	else
@@ -120,6 +497,11 @@ static void add_repo(const char *base, struct strbuf *path, repo_config_fn fn)
 	else if (rel.len && rel.buf[rel.len - 1] == '/')
 		strbuf_setlen(&rel, rel.len - 1);
 
+	/* The url is hashed by cgit_add_repo(), so it's final from here */
+	if (ctx.cfg.remove_suffix) {
+		strbuf_strip_suffix(&rel, ".git");
+		strbuf_strip_suffix(&rel, "/");
+	}
 	repo = cgit_add_repo(rel.buf);
 	config_fn = fn;
 	if (ctx.cfg.enable_git_config) {
@@ -128,15 +510,9 @@ static void add_repo(const char *base, struct strbuf *path, repo_config_fn fn)
 		strbuf_setlen(path, pathlen);
 	}
 
-	if (ctx.cfg.remove_suffix) {
-		size_t urllen;
-		strip_suffix(repo->url, ".git", &urllen);
-		strip_suffix_mem(repo->url, &urllen, "/");
-		repo->url[urllen] = '\0';
-	}
 	repo->path = xstrdup(path->buf);
 	while (!repo->owner) {
-		if ((pwd = getpwuid(st.st_uid)) == NULL) {
+		if ((pwd = getpwuid(dir->st.st_uid)) == NULL) {
 			fprintf(stderr, "Error reading owner-info for %s: %s (%d)\n",
 				path->buf, strerror(errno), errno);
 			break;
@@ -149,7 +525,7 @@ static void add_repo(const char *base, struct strbuf *path, repo_config_fn fn)
 
 	if (repo->desc == cgit_default_repo_desc || !repo->desc) {
 		strbuf_addstr(path, "description");
-		if (!stat(path->buf, &st))
+		if (dir->flags & SCAN_DESCRIPTION)
 			readfile(path->buf, &repo->desc, &size);
 		strbuf_setlen(path, pathlen);
 	}
@@ -178,68 +554,161 @@ static void add_repo(const char *base, struct strbuf *path, repo_config_fn fn)
 	}
 
 	strbuf_addstr(path, "cgitrc");
-	if (!stat(path->buf, &st))
+	if (dir->flags & SCAN_CGITRC)
 		parse_configfile(path->buf, &scan_tree_repo_config);
 
 	strbuf_release(&rel);
+	strbuf_release(path);
 }
 
-static void scan_path(const char *base, const char *path, repo_config_fn fn)
+/* Add the repositories found below 'dir', in the order they were read */
+static void add_repos(const char *base, struct scan_dir *dir,
+		      repo_config_fn fn)
 {
-	DIR *dir = opendir(path);
-	struct dirent *ent;
-	struct strbuf pathbuf = STRBUF_INIT;
-	size_t pathlen = strlen(path);
-	struct stat st;
+	size_t i;
 
-	if (!dir) {
-		fprintf(stderr, "Error opening directory %s: %s (%d)\n",
-			path, strerror(errno), errno);
-		return;
-	}
+	if (dir->gitdir && !(dir->flags & SCAN_SKIPPED))
+		add_repo(base, dir, fn);
+	for (i = 0; i < dir->sub_nr; i++)
+		add_repos(base, dir->sub[i], fn);
+}
 
-	strbuf_add(&pathbuf, path, strlen(path));
-	if (is_git_dir(pathbuf.buf)) {
-		add_repo(base, &pathbuf, fn);
-		goto end;
-	}
-	strbuf_addstr(&pathbuf, "/.git");
-	if (is_git_dir(pathbuf.buf)) {
-		add_repo(base, &pathbuf, fn);
-		goto end;
-	}
-	/*
-	 * Add one because we don't want to lose the trailing '/' when we
-	 * reset the length of pathbuf in the loop below.
-	 */
-	pathlen++;
-	while ((ent = readdir(dir)) != NULL) {
-		if (ent->d_name[0] == '.') {
-			if (ent->d_name[1] == '\0')
-				continue;
-			if (ent->d_name[1] == '.' && ent->d_name[2] == '\0')
-				continue;
-			if (!ctx.cfg.scan_hidden_path)
-				continue;
+static void free_dir(struct scan_dir *dir)
+{
+	size_t i;
+
+	for (i = 0; i < dir->sub_nr; i++)
+		free_dir(dir->sub[i]);
+	free(dir->sub);
+	free(dir->gitdir);
+	free(dir->path);
+	free(dir);
+}
+
+/* Record 'dir' and the directories below it, one line each: the depth,
+ * the flags, the ctimes of the directory and its repository, the owner
+ * of the repository and the name of the directory (its full path at the
+ * top).
+ */
+static void write_dir(FILE *f, struct scan_dir *dir, int depth,
+		      const char *name)
+{
+	unsigned flags = dir->flags;
+	size_t i, len = strlen(dir->path) + 1;
+
+	if (dir->gitdir)
+		flags |= strcmp(dir->gitdir, dir->path) ? SCAN_WORKTREE : SCAN_BARE;
+	fprintf(f, "%d %x %"PRIdMAX".%09u %"PRIdMAX".%09u %"PRIuMAX" %s\n",
+		depth, flags, dir->ctime.sec, dir->ctime.nsec,
+		dir->git_ctime.sec, dir->git_ctime.nsec,
+		(uintmax_t)(dir->gitdir ? dir->st.st_uid : 0), name);
+	for (i = 0; i < dir->sub_nr; i++)
+		if (!strchr(dir->sub[i]->path + len, '\n'))
+			write_dir(f, dir->sub[i], depth + 1,
+				  dir->sub[i]->path + len);
+}
+
+/* Load the scan recorded in 'file', unless it was made with other
+ * settings or can't be parsed.
+ */
+static void load_dirs(const char *file)
+{
+	struct strbuf buf = STRBUF_INIT, header = STRBUF_INIT;
+	struct scan_dir **stack = NULL, *dir, *parent;
+	size_t stack_nr = 0, stack_alloc = 0, nr = prev_nr;
+	char *p, *eol;
+	int depth, n;
+	uintmax_t uid;
+
+	if (strbuf_read_file(&buf, file, 0) < 0)
+		goto out;
+	strbuf_addf(&header, SCAN_DIRS_HEADER, ctx.cfg.scan_hidden_path,
+		    ctx.cfg.strict_export ? ctx.cfg.strict_export : "");
+	if (!starts_with(buf.buf, header.buf))
+		goto out;
+
+	for (p = buf.buf + header.len; (eol = strchr(p, '\n')); p = eol + 1) {
+		*eol = '\0';
+		CALLOC_ARRAY(dir, 1);
+		n = -1;
+		sscanf(p, "%d %x %"SCNdMAX".%u %"SCNdMAX".%u %"SCNuMAX" %n",
+		       &depth, &dir->flags, &dir->ctime.sec, &dir->ctime.nsec,
+		       &dir->git_ctime.sec, &dir->git_ctime.nsec, &uid, &n);
+		if (n < 0 || depth < 0 || (size_t)depth > stack_nr) {
+			free(dir);
+			goto fail;
 		}
-		strbuf_setlen(&pathbuf, pathlen);
-		strbuf_addstr(&pathbuf, ent->d_name);
-		if (stat(pathbuf.buf, &st)) {
-			fprintf(stderr, "Error checking path %s: %s (%d)\n",
-				pathbuf.buf, strerror(errno), errno);
-			continue;
+		dir->st.st_uid = uid;
+		if (depth) {
+			parent = stack[depth - 1];
+			dir->path = xstrfmt("%s/%s", parent->path, p + n);
+			ALLOC_GROW(parent->sub, parent->sub_nr + 1,
+				   parent->sub_alloc);
+			parent->sub[parent->sub_nr++] = dir;
+		} else {
+			dir->path = xstrdup(p + n);
+			ALLOC_GROW(prev_roots, prev_nr + 1, prev_alloc);
+			prev_roots[prev_nr++] = dir;
 		}
-		if (S_ISDIR(st.st_mode))
-			scan_path(base, pathbuf.buf, fn);
+		if (dir->flags & SCAN_BARE)
+			dir->gitdir = xstrdup(dir->path);
+		else if (dir->flags & SCAN_WORKTREE)
+			dir->gitdir = xstrfmt("%s/.git", dir->path);
+		dir->flags &= ~(SCAN_BARE | SCAN_WORKTREE);
+		stack_nr = depth + 1;
+		ALLOC_GROW(stack, stack_nr, stack_alloc);
+		stack[depth] = dir;
+	}
+	goto out;
+fail:
+	while (prev_nr > nr)
+		free_dir(prev_roots[--prev_nr]);
+out:
+	free(stack);
+	strbuf_release(&header);
+	strbuf_release(&buf);
+}
+
+/* Find the recorded scan of 'path', which is usually the i-th one */
+static struct scan_dir *find_prev_root(const char *path, size_t i)
+{
+	if (i < prev_nr && !strcmp(prev_roots[i]->path, path))
+		return prev_roots[i];
+	for (i = 0; i < prev_nr; i++)
+		if (!strcmp(prev_roots[i]->path, path))
+			return prev_roots[i];
+	return NULL;
+}
+
+/* Scan the directories 'paths' for repositories below 'base' */
+static void scan_paths(const char *base, struct string_list *paths,
+		       repo_config_fn fn)
+{
+	struct scan_dir **roots;
+	uint64_t start = getnanotime();
+	size_t i;
+
+	CALLOC_ARRAY(roots, paths->nr);
+	for (i = 0; i < paths->nr; i++) {
+		CALLOC_ARRAY(roots[i], 1);
+		roots[i]->path = xstrdup(paths->items[i].string);
+		roots[i]->prev = find_prev_root(roots[i]->path, i);
+	}
+	read_dirs(roots, paths->nr);
+	for (i = 0; i < paths->nr; i++) {
+		if (dirs_out && !strchr(roots[i]->path, '\n'))
+			write_dir(dirs_out, roots[i], 0, roots[i]->path);
+		add_repos(base, roots[i], fn);
+		free_dir(roots[i]);
 	}
-end:
-	strbuf_release(&pathbuf);
-	closedir(dir);
+	free(roots);
+	total_ns += getnanotime() - start;
 }
 
 void scan_projects(const char *path, const char *projectsfile, repo_config_fn fn)
 {
 	struct strbuf line = STRBUF_INIT;
+	struct string_list paths = STRING_LIST_INIT_DUP;
 	FILE *projects;
 	int err;
 
@@ -254,17 +723,52 @@ void scan_projects(const char *path, const char *projectsfile, repo_config_fn fn
 			continue;
 		strbuf_insert(&line, 0, "/", 1);
 		strbuf_insert(&line, 0, path, strlen(path));
-		scan_path(path, line.buf, fn);
+		string_list_append(&paths, line.buf);
 	}
 	if ((err = ferror(projects))) {
 		fprintf(stderr, "Error reading from projectsfile %s: %s (%d)\n",
 			projectsfile, strerror(err), err);
 	}
 	fclose(projects);
+	scan_paths(path, &paths, fn);
+	string_list_clear(&paths, 0);
 	strbuf_release(&line);
 }
 
 void scan_tree(const char *path, repo_config_fn fn)
 {
-	scan_path(path, path, fn);
+	struct string_list paths = STRING_LIST_INIT_DUP;
+
+	string_list_append(&paths, path);
+	scan_paths(path, &paths, fn);
+	string_list_clear(&paths, 0);
+}
+
+/* Reuse the directories recorded in the file 'prev' by an earlier scan,
+ * and record the directories of the following scans in 'next', until
+ * this is called with both set to NULL.
+ */
+void scan_track_dirs(const char *prev, FILE *next)
+{
+	while (prev_nr)
+		free_dir(prev_roots[--prev_nr]);
+	FREE_AND_NULL(prev_roots);
+	prev_alloc = 0;
+
+	dirs_out = next;
+	if (next)
+		fprintf(next, SCAN_DIRS_HEADER, ctx.cfg.scan_hidden_path,
+			ctx.cfg.strict_export ? ctx.cfg.strict_export : "");
+	if (prev)
+		load_dirs(prev);
+}
+
+/* Describe the totals of the scans so far as a comment line for cgitrc */
+void scan_stats(struct strbuf *out)
+{
+	strbuf_addf(out, "# scan: %"PRIuMAX" repositories, %"PRIuMAX" directories, "
+		    "%"PRIuMAX" unchanged, %"PRIuMAX" entries, %"PRIuMAX" stat "
+		    "calls, %d threads, %.3f s\n", totals.repos, totals.dirs,
+		    totals.unchanged, totals.entries, totals.stats, total_threads,
+		    total_ns / 1e9);
 }
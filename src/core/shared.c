@@ -9,10 +9,22 @@
 #define USE_THE_REPOSITORY_VARIABLE
 
 #include "cgit.h"
+#include "repo-index.h"
+#include "strmap.h"
 
 struct cgit_repolist cgit_repolist;
 struct cgit_context ctx;
 
+/* The entries of cgit_repolist by url: the table holds the first entry
+ * with a url, and next_same_url[] leads from there to the others, in the
+ * order of cgit_repolist. The urls aren't copied; they live as long as
+ * their repositories.
+ */
+static struct strintmap repo_urls;
+static int repo_urls_initialized;
+static int *next_same_url;
+static int next_same_url_alloc;
+
 int chk_zero(int result, char *msg)
 {
 	if (result != 0)
@@ -35,24 +47,31 @@ int chk_non_negative(int result, char *msg)
 }
 
 char *cgit_default_repo_desc = "[no description]";
-struct cgit_repo *cgit_add_repo(const char *url)
+
+/* Add 'n' uninitialized entries to cgit_repolist, and return the index of
+ * the first one.
+ */
+int cgit_reserve_repos(int n)
 {
-	struct cgit_repo *ret;
+	int start = cgit_repolist.count;
 
-	if (++cgit_repolist.count > cgit_repolist.length) {
+	cgit_repolist.count += n;
+	if (cgit_repolist.count > cgit_repolist.length) {
 		if (cgit_repolist.length == 0)
 			cgit_repolist.length = 8;
-		else
+		while (cgit_repolist.length < cgit_repolist.count)
 			cgit_repolist.length *= 2;
 		cgit_repolist.repos = xrealloc(cgit_repolist.repos,
 					       cgit_repolist.length *
 					       sizeof(struct cgit_repo));
 	}
+	return start;
+}
 
-	ret = &cgit_repolist.repos[cgit_repolist.count-1];
+/* Set up 'repo' with the defaults of the current configuration */
+void cgit_init_repo(struct cgit_repo *ret)
+{
 	memset(ret, 0, sizeof(struct cgit_repo));
-	ret->url = trim_end(url, '/');
-	ret->name = ret->url;
 	ret->path = NULL;
 	ret->desc = cgit_default_repo_desc;
 	ret->extra_head_content = NULL;
@@ -81,12 +100,83 @@ struct cgit_repo *cgit_add_repo(const char *url)
 	ret->clone_url = ctx.cfg.clone_url;
 	ret->submodules.strdup_strings = 1;
 	ret->hide = ret->ignore = 0;
+}
+
+struct cgit_repo *cgit_add_repo(const char *url)
+{
+	struct cgit_repo *ret;
+
+	ret = &cgit_repolist.repos[cgit_reserve_repos(1)];
+	cgit_init_repo(ret);
+	ret->url = trim_end(url, '/');
+	ret->name = ret->url;
+	cgit_hash_repo(ret - cgit_repolist.repos);
 	return ret;
 }
 
-struct cgit_repo *cgit_get_repoinfo(const char *url)
+/* Add entry 'i' of cgit_repolist to the table of urls. Entries are
+ * usually added in order, but those of a repository index are added
+ * when they're decoded.
+ */
+void cgit_hash_repo(int i)
+{
+	const char *url = cgit_repolist.repos[i].url;
+	int j;
+
+	if (!url)
+		return;
+	if (!repo_urls_initialized) {
+		strintmap_init_with_options(&repo_urls, -1, NULL, 0);
+		repo_urls_initialized = 1;
+	}
+	ALLOC_GROW(next_same_url, cgit_repolist.count, next_same_url_alloc);
+
+	j = strintmap_get(&repo_urls, url);
+	if (j < 0 || j > i) {
+		next_same_url[i] = j;
+		strintmap_set(&repo_urls, url, i);
+		return;
+	}
+	while (next_same_url[j] >= 0 && next_same_url[j] < i)
+		j = next_same_url[j];
+	next_same_url[i] = next_same_url[j];
+	next_same_url[j] = i;
+}
+
+/* Sort cgit_repolist with 'cmp' and rebuild the table of urls, after
+ * decoding whatever hasn't been decoded yet.
+ */
+void cgit_sort_repolist(int (*cmp)(const void *a, const void *b))
+{
+	int i;
+
+	repo_index_decode_all();
+	qsort(cgit_repolist.repos, cgit_repolist.count,
+	      sizeof(struct cgit_repo), cmp);
+	if (repo_urls_initialized) {
+		strintmap_clear(&repo_urls);
+		repo_urls_initialized = 0;
+	}
+	for (i = 0; i < cgit_repolist.count; i++)
+		cgit_hash_repo(i);
+}
+
+/* Find the first repository with the url 'url' which isn't ignored */
+static struct cgit_repo *find_repo(const char *url)
 {
 	int i;
+
+	repo_index_decode_url(url);
+	if (!repo_urls_initialized)
+		return NULL;
+	for (i = strintmap_get(&repo_urls, url); i >= 0; i = next_same_url[i])
+		if (!cgit_repolist.repos[i].ignore)
+			return &cgit_repolist.repos[i];
+	return NULL;
+}
+
+struct cgit_repo *cgit_get_repoinfo(const char *url)
+{
 	size_t len;
 	struct cgit_repo *repo;
 	char *alt_url = NULL;
@@ -94,13 +184,9 @@ struct cgit_repo *cgit_get_repoinfo(const char *url)
 	len = strlen(url);
 
 	/* Try exact match first */
-	for (i = 0; i < cgit_repolist.count; i++) {
-		repo = &cgit_repolist.repos[i];
-		if (repo->ignore)
-			continue;
-		if (!strcmp(repo->url, url))
-			return repo;
-	}
+	repo = find_repo(url);
+	if (repo)
+		return repo;
 
 	/* Try alternate form: with or without .git suffix */
 	if (len > 4 && !strcmp(url + len - 4, ".git")) {
@@ -112,18 +198,77 @@ struct cgit_repo *cgit_get_repoinfo(const char *url)
 		alt_url = xstrfmt("%s.git", url);
 	}
 
-	for (i = 0; i < cgit_repolist.count; i++) {
-		repo = &cgit_repolist.repos[i];
-		if (repo->ignore)
-			continue;
-		if (!strcmp(repo->url, alt_url)) {
-			free(alt_url);
-			return repo;
+	repo = find_repo(alt_url);
+	free(alt_url);
+	return repo;
+}
+
+static time_t read_agefile(const char *path)
+{
+	time_t result;
+	size_t size;
+	char *buf = NULL;
+	struct strbuf date_buf = STRBUF_INIT;
+
+	if (readfile(path, &buf, &size)) {
+		free(buf);
+		return 0;
+	}
+
+	if (parse_date(buf, &date_buf) == 0)
+		result = strtoul(date_buf.buf, NULL, 10);
+	else
+		result = 0;
+	free(buf);
+	strbuf_release(&date_buf);
+	return result;
+}
+
+/* Find the time of the last change to 'repo', from its agefile or, failing
+ * that, its default branch or packed-refs, unless it's already known. Returns
+ * 0 if there's none.
+ */
+int cgit_get_repo_modtime(const struct cgit_repo *repo, time_t *mtime)
+{
+	struct strbuf path = STRBUF_INIT;
+	struct stat s;
+	struct cgit_repo *r = (struct cgit_repo *)repo;
+
+	if (repo->mtime != -1) {
+		*mtime = repo->mtime;
+		return (repo->mtime != 0);
+	}
+	strbuf_addf(&path, "%s/%s", repo->path, ctx.cfg.agefile);
+	if (stat(path.buf, &s) == 0) {
+		*mtime = read_agefile(path.buf);
+		if (*mtime) {
+			r->mtime = *mtime;
+			goto end;
 		}
 	}
 
-	free(alt_url);
-	return NULL;
+	strbuf_reset(&path);
+	strbuf_addf(&path, "%s/refs/heads/%s", repo->path,
+		    repo->defbranch ? repo->defbranch : "master");
+	if (stat(path.buf, &s) == 0) {
+		*mtime = s.st_mtime;
+		r->mtime = *mtime;
+		goto end;
+	}
+
+	strbuf_reset(&path);
+	strbuf_addf(&path, "%s/%s", repo->path, "packed-refs");
+	if (stat(path.buf, &s) == 0) {
+		*mtime = s.st_mtime;
+		r->mtime = *mtime;
+		goto end;
+	}
+
+	*mtime = 0;
+	r->mtime = *mtime;
+end:
+	strbuf_release(&path);
+	return (r->mtime != 0);
 }
 
 void cgit_free_commitinfo(struct commitinfo *info)
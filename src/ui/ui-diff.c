@@ -133,6 +133,7 @@ void cgit_print_diff(const char *new_rev, const char *old_rev,
 
 		ctx.page.mimetype = "text/plain";
 		cgit_print_http_headers();
+		html_flush();
 		if (old_tree_oid) {
 			diff_tree_oid(old_tree_oid, new_tree_oid, "",
 				       &diffopt);
@@ -73,6 +73,7 @@ void cgit_print_patch(const char *new_rev, const char *old_rev,
 	ctx.page.mimetype = "text/plain";
 	ctx.page.filename = patchname;
 	cgit_print_http_headers();
+	html_flush();
 
 	if (ctx.cfg.noplainemail) {
 		rev_argv[2] = "--format=format:From %H Mon Sep 17 00:00:00 "
@@ -10,75 +10,12 @@
 #include "ui-repolist.h"
 #include "html.h"
 #include "ui-shared.h"
-
-static time_t read_agefile(const char *path)
-{
-	time_t result;
-	size_t size;
-	char *buf = NULL;
-	struct strbuf date_buf = STRBUF_INIT;
-
-	if (readfile(path, &buf, &size)) {
-		free(buf);
-		return 0;
-	}
-
-	if (parse_date(buf, &date_buf) == 0)
-		result = strtoul(date_buf.buf, NULL, 10);
-	else
-		result = 0;
-	free(buf);
-	strbuf_release(&date_buf);
-	return result;
-}
-
-static int get_repo_modtime(const struct cgit_repo *repo, time_t *mtime)
-{
-	struct strbuf path = STRBUF_INIT;
-	struct stat s;
-	struct cgit_repo *r = (struct cgit_repo *)repo;
-
-	if (repo->mtime != -1) {
-		*mtime = repo->mtime;
-		return 1;
-	}
-	strbuf_addf(&path, "%s/%s", repo->path, ctx.cfg.agefile);
-	if (stat(path.buf, &s) == 0) {
-		*mtime = read_agefile(path.buf);
-		if (*mtime) {
-			r->mtime = *mtime;
-			goto end;
-		}
-	}
-
-	strbuf_reset(&path);
-	strbuf_addf(&path, "%s/refs/heads/%s", repo->path,
-		    repo->defbranch ? repo->defbranch : "master");
-	if (stat(path.buf, &s) == 0) {
-		*mtime = s.st_mtime;
-		r->mtime = *mtime;
-		goto end;
-	}
-
-	strbuf_reset(&path);
-	strbuf_addf(&path, "%s/%s", repo->path, "packed-refs");
-	if (stat(path.buf, &s) == 0) {
-		*mtime = s.st_mtime;
-		r->mtime = *mtime;
-		goto end;
-	}
-
-	*mtime = 0;
-	r->mtime = *mtime;
-end:
-	strbuf_release(&path);
-	return (r->mtime != 0);
-}
+#include "repo-index.h"
 
 static void print_modtime(struct cgit_repo *repo)
 {
 	time_t t;
-	if (get_repo_modtime(repo, &t))
+	if (cgit_get_repo_modtime(repo, &t))
 		cgit_print_age(t, 0, -1);
 }
 
@@ -215,8 +152,8 @@ static int sort_idle(const void *a, const void *b)
 	time_t t1, t2;
 
 	t1 = t2 = 0;
-	get_repo_modtime(r1, &t1);
-	get_repo_modtime(r2, &t2);
+	cgit_get_repo_modtime(r1, &t1);
+	cgit_get_repo_modtime(r2, &t2);
 	return t2 - t1;
 }
 
@@ -257,8 +194,7 @@ static int sort_repolist(char *field)
 	for (column = &sortcolumn[0]; column->name; column++) {
 		if (strcmp(field, column->name))
 			continue;
-		qsort(cgit_repolist.repos, cgit_repolist.count,
-			sizeof(struct cgit_repo), column->fn);
+		cgit_sort_repolist(column->fn);
 		return 1;
 	}
 	return 0;
@@ -273,6 +209,7 @@ void cgit_print_repolist(void)
 	char *repourl;
 	int sorted = 0;
 
+	repo_index_decode_all();
 	if (!any_repos_visible()) {
 		cgit_print_error_page(404, "Not found", "No repositories found");
 		return;
@@ -187,6 +187,7 @@ void cgit_print_error_page(int code, const char *msg, const char *fmt, ...)
 {
 	va_list ap;
 	ctx.page.expires = ctx.cfg.cache_dynamic_ttl;
+	ctx.page.etag = NULL;
 	ctx.page.status = code;
 	ctx.page.statusmsg = msg;
 	cgit_print_layout_start();
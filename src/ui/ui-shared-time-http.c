@@ -83,11 +83,93 @@ void cgit_print_age(time_t t, int tz, time_t max_relative)
 	print_rel_date(t, tz, secs * 1.0 / TM_YEAR, "age-years", "years");
 }
 
+/* Parse an HTTP date in the preferred format of RFC 7231, as printed by
+ * http_date(). Returns 0 if the date can't be parsed.
+ */
+time_t cgit_parse_http_date(const char *date)
+{
+	static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+	struct tm tm = { 0 };
+	char month[4];
+	const char *m;
+	time_t t;
+
+	if (sscanf(date, "%*3s, %2d %3s %4d %2d:%2d:%2d GMT", &tm.tm_mday,
+		   month, &tm.tm_year, &tm.tm_hour, &tm.tm_min,
+		   &tm.tm_sec) != 6)
+		return 0;
+	m = strstr(months, month);
+	if (strlen(month) != 3 || !m || (m - months) % 3)
+		return 0;
+	tm.tm_mon = (m - months) / 3;
+	tm.tm_year -= 1900;
+	t = tm_to_time_t(&tm);
+	return t < 0 ? 0 : t;
+}
+
+/* Check whether the client already has this version of the page, going
+ * by If-None-Match if the request has it, and by If-Modified-Since
+ * otherwise.
+ */
+int cgit_is_not_modified(const char *etag, time_t modified)
+{
+	const char *p = ctx.env.http_if_none_match;
+	time_t since;
+	size_t len;
+
+	if (p) {
+		if (!etag)
+			return 0;
+		len = strlen(etag);
+		while (*p) {
+			p += strspn(p, " \t,");
+			if (*p == '*')
+				return 1;
+			/* If-None-Match uses the weak comparison */
+			skip_prefix(p, "W/", &p);
+			if (*p == '"' && !strncmp(p + 1, etag, len) &&
+			    p[len + 1] == '"')
+				return 1;
+			p += strcspn(p, ",");
+		}
+		return 0;
+	}
+	if (!ctx.env.http_if_modified_since || !modified)
+		return 0;
+	since = cgit_parse_http_date(ctx.env.http_if_modified_since);
+	/* A date in the future is invalid, and ignored (RFC 9110, 13.1.3) */
+	return since && since <= time(NULL) && modified <= since;
+}
+
+void cgit_print_not_modified(const char *etag, time_t modified,
+			     time_t expires)
+{
+	html("Status: 304 Not Modified\n");
+	if (modified)
+		htmlf("Last-Modified: %s\n", http_date(modified));
+	if (expires)
+		htmlf("Expires: %s\n", http_date(expires));
+	if (etag)
+		htmlf("ETag: \"%s\"\n", etag);
+	html("\n");
+}
+
 void cgit_print_http_headers(void)
 {
 	if (ctx.env.no_http && !strcmp(ctx.env.no_http, "1"))
 		return;
 
+	/* A page which goes into the cache is meant for every client, so
+	 * the cache answers conditional requests instead (see
+	 * cache_print_not_modified()).
+	 */
+	if (!ctx.page.status && !ctx.page.cached && ctx.env.authenticated &&
+	    cgit_is_not_modified(ctx.page.etag, ctx.page.modified)) {
+		cgit_print_not_modified(ctx.page.etag, ctx.page.modified,
+					ctx.page.expires);
+		exit(0);
+	}
+
 	if (ctx.page.status)
 		htmlf("Status: %d %s\n", ctx.page.status, ctx.page.statusmsg);
 	if (ctx.page.mimetype && ctx.page.charset)
@@ -172,6 +172,7 @@ static int make_snapshot(const struct cgit_snapshot_format *format,
 	ctx.page.mimetype = xstrdup(format->mimetype);
 	ctx.page.filename = xstrdup(filename);
 	cgit_print_http_headers();
+	html_flush();
 	init_archivers();
 	format->write_func(hex, prefix);
 	return 0;
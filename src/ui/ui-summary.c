@@ -18,6 +18,8 @@
 #include "ui-shared.h"
 
 static int urls;
+static char *readme_filename;
+static const char *readme_ref;
 
 static const char *disambiguate_ref(const char *ref, int *must_free_result)
 {
@@ -70,7 +72,7 @@ done:
 	return ret;
 }
 
-static void print_url(const char *url)
+static int summary_columns(void)
 {
 	int columns = 3;
 
@@ -78,6 +80,12 @@ static void print_url(const char *url)
 		columns++;
 	if (ctx.repo->enable_log_linecount)
 		columns++;
+	return columns;
+}
+
+static void print_url(const char *url)
+{
+	int columns = summary_columns();
 
 	if (urls++ == 0) {
 		htmlf("<tr class='nohover'><td colspan='%d'>&nbsp;</td></tr>", columns);
@@ -93,29 +101,57 @@ static void print_url(const char *url)
 	html("</a></td></tr>\n");
 }
 
-void cgit_print_summary(void)
+/* The sections of the summary page, which may be cached by themselves
+ * (see cgit_print_fragment()).
+ */
+static void print_commit_count(void)
 {
-	int columns = 3;
 	unsigned long commit_count = 0;
 
-	if (ctx.repo->enable_log_filecount)
-		columns++;
-	if (ctx.repo->enable_log_linecount)
-		columns++;
+	if (get_commit_count(ctx.qry.head, &commit_count))
+		htmlf("<tr class='nohover'><th class='left'>Commits</th><td colspan='%d'>%lu</td></tr>\n",
+		      summary_columns() - 1, commit_count);
+}
+
+static void print_branches(void)
+{
+	cgit_print_branches(ctx.cfg.summary_branches);
+}
+
+static void print_tags(void)
+{
+	cgit_print_tags(ctx.cfg.summary_tags);
+}
+
+static void print_log(void)
+{
+	cgit_print_log(ctx.qry.head, 0, ctx.cfg.summary_log, NULL,
+		       NULL, NULL, 0, 0, 0);
+}
+
+void cgit_print_summary(void)
+{
+	int columns = summary_columns();
+	char *inputs;
 
 	cgit_print_layout_start();
 	html("<table summary='repository info' class='list nowrap'>");
-	if (get_commit_count(ctx.qry.head, &commit_count))
-		htmlf("<tr class='nohover'><th class='left'>Commits</th><td colspan='%d'>%lu</td></tr>\n",
-		      columns - 1, commit_count);
+	inputs = fmtalloc("columns=%d", columns);
+	cgit_print_fragment("commit-count", inputs, 0, print_commit_count);
+	free(inputs);
 	htmlf("<tr class='nohover'><td colspan='%d'>&nbsp;</td></tr>", columns);
-	cgit_print_branches(ctx.cfg.summary_branches);
+	inputs = fmtalloc("count=%d", ctx.cfg.summary_branches);
+	cgit_print_fragment("branches", inputs, 1, print_branches);
+	free(inputs);
 	htmlf("<tr class='nohover'><td colspan='%d'>&nbsp;</td></tr>", columns);
-	cgit_print_tags(ctx.cfg.summary_tags);
+	inputs = fmtalloc("count=%d", ctx.cfg.summary_tags);
+	cgit_print_fragment("tags", inputs, 1, print_tags);
+	free(inputs);
 	if (ctx.cfg.summary_log > 0) {
 		htmlf("<tr class='nohover'><td colspan='%d'>&nbsp;</td></tr>", columns);
-		cgit_print_log(ctx.qry.head, 0, ctx.cfg.summary_log, NULL,
-			       NULL, NULL, 0, 0, 0);
+		inputs = fmtalloc("count=%d", ctx.cfg.summary_log);
+		cgit_print_fragment("log", inputs, 1, print_log);
+		free(inputs);
 	}
 	urls = 0;
 	cgit_add_clone_urls(print_url);
@@ -157,9 +193,46 @@ static char* append_readme_path(const char *filename, const char *ref, const cha
 	return full_path;
 }
 
+/* Print the readme, either from the git repo or from the filesystem,
+ * while applying the about-filter.
+ */
+static void print_readme(void)
+{
+	cgit_open_filter(ctx.repo->about_filter, readme_filename);
+	if (readme_ref)
+		cgit_print_file(readme_filename, readme_ref, 1);
+	else
+		html_include(readme_filename);
+	cgit_close_filter(ctx.repo->about_filter);
+}
+
+/* The readme is cached by the blob it's read from, or by the mtime and
+ * size of the file. Returns NULL if it can't be found.
+ */
+static char *readme_inputs(const char *filename, const char *ref)
+{
+	struct object_id oid;
+	struct stat st;
+	char *rev;
+	int err;
+
+	if (ref) {
+		rev = fmtalloc("%s:%s", ref, filename);
+		err = repo_get_oid(the_repository, rev, &oid);
+		free(rev);
+		if (err)
+			return NULL;
+		return fmtalloc("%s\nblob=%s", filename, oid_to_hex(&oid));
+	}
+	if (stat(filename, &st))
+		return NULL;
+	return fmtalloc("%s\nmtime=%"PRIuMAX"\nsize=%"PRIuMAX, filename,
+			(uintmax_t)st.st_mtime, (uintmax_t)st.st_size);
+}
+
 void cgit_print_repo_readme(const char *path)
 {
-	char *filename, *ref, *mimetype;
+	char *filename, *ref, *mimetype, *inputs;
 	int free_filename = 0;
 
 	mimetype = get_mimetype_for_filename(path);
@@ -186,17 +259,15 @@ void cgit_print_repo_readme(const char *path)
 			goto done;
 	}
 
-	/* Print the calculated readme, either from the git repo or from the
-	 * filesystem, while applying the about-filter.
-	 */
 	html("<div id='summary'>");
-	cgit_open_filter(ctx.repo->about_filter, filename);
-	if (ref)
-		cgit_print_file(filename, ref, 1);
+	readme_filename = filename;
+	readme_ref = ref;
+	inputs = readme_inputs(filename, ref);
+	if (inputs)
+		cgit_print_fragment("readme", inputs, 0, print_readme);
 	else
-		html_include(filename);
-	cgit_close_filter(ctx.repo->about_filter);
-
+		print_readme();
+	free(inputs);
 	html("</div>");
 	if (free_filename)
 		free(filename);
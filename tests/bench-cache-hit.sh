@@ -0,0 +1,47 @@
+#!/bin/sh
+#
+# Measure the latency of cache hits for slots of 4 KiB, 200 KiB and
+# 50 MiB. This isn't part of the test suite; run it from the tests
+# directory with "./bench-cache-hit.sh -v", optionally with BENCH_RUNS
+# set to the number of hits per size (default: 200, 10 for 50 MiB).
+
+test_description='Benchmark cache hits'
+. ./setup.sh
+
+runs=${BENCH_RUNS:-200}
+
+now_us() {
+	echo $(($(date +%s%N) / 1000))
+}
+
+bench() {
+	name=$1 n=$2
+	cgit_query "url=foo/plain/$name&h=bench" >/dev/null
+	start=$(now_us)
+	i=0
+	while test $i -lt $n
+	do
+		cgit_query "url=foo/plain/$name&h=bench" >/dev/null
+		i=$((i + 1))
+	done
+	end=$(now_us)
+	say "$name: $n hits, $(((end - start) / n)) us per hit"
+}
+
+test_expect_success 'setup' '
+	rm -rf cache/* &&
+	git -C repos/foo checkout -q -b bench &&
+	test-tool genrandom 4k 4096 >repos/foo/4k &&
+	test-tool genrandom 200k 204800 >repos/foo/200k &&
+	test-tool genrandom 50m 52428800 >repos/foo/50m &&
+	git -C repos/foo add 4k 200k 50m &&
+	git -C repos/foo commit -q -m bench
+'
+
+test_expect_success 'cache hits' '
+	bench 4k $runs &&
+	bench 200k $runs &&
+	bench 50m ${BENCH_RUNS:-10}
+'
+
+test_done
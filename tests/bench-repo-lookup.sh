@@ -0,0 +1,49 @@
+#!/bin/sh
+#
+# Measure the latency of requests with 100k repositories configured, for
+# the first and the last of them, with a path below the repository url.
+# This isn't part of the test suite; run it from the tests directory with
+# "./bench-repo-lookup.sh -v", optionally with BENCH_RUNS set to the
+# number of requests per repository (default: 20) and BENCH_REPOS to the
+# number of repositories.
+
+test_description='Benchmark repository lookups'
+. ./setup.sh
+
+runs=${BENCH_RUNS:-20}
+repos=${BENCH_REPOS:-100000}
+
+now_us() {
+	echo $(($(date +%s%N) / 1000))
+}
+
+bench() {
+	url=$1 n=$2
+	CGIT_CONFIG="$PWD/cgitrc.bench" QUERY_STRING="url=$url" cgit >/dev/null
+	start=$(now_us)
+	i=0
+	while test $i -lt $n
+	do
+		CGIT_CONFIG="$PWD/cgitrc.bench" QUERY_STRING="url=$url" \
+			cgit >/dev/null
+		i=$((i + 1))
+	done
+	end=$(now_us)
+	say "$url: $n requests, $(((end - start) / n)) us per request"
+}
+
+test_expect_success 'setup' '
+	echo "virtual-root=/" >cgitrc.bench &&
+	awk -v n=$repos -v path="$PWD/repos/foo/.git" "BEGIN {
+		for (i = 1; i <= n; i++)
+			printf \"repo.url=group%d/repo%d\nrepo.path=%s\n\",
+				i % 100, i, path
+	}" >>cgitrc.bench
+'
+
+test_expect_success 'repository lookups' '
+	bench "group1/repo1/tree/a/b/c/file-1" $runs &&
+	bench "group0/repo$repos/tree/a/b/c/file-1" $runs
+'
+
+test_done
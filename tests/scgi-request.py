@@ -0,0 +1,50 @@
+#!/usr/bin/env python3
+#
+# Send a request to a cgit SCGI socket and print the response.
+#
+# usage: scgi-request.py <socket> <query-string> [<count>]
+#
+# The request is sent <count> times (default: 1); the response to the last
+# one is written to stdout and the mean latency in milliseconds to stderr.
+
+import socket
+import sys
+import time
+
+
+def request(path, query):
+    headers = [
+        ("CONTENT_LENGTH", "0"),
+        ("SCGI", "1"),
+        ("REQUEST_METHOD", "GET"),
+        ("QUERY_STRING", query),
+        ("SERVER_NAME", "localhost"),
+        ("SERVER_PORT", "80"),
+    ]
+    body = b"".join(k.encode() + b"\0" + v.encode() + b"\0" for k, v in headers)
+    s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    s.connect(path)
+    s.sendall(str(len(body)).encode() + b":" + body + b",")
+    response = b""
+    while True:
+        data = s.recv(65536)
+        if not data:
+            break
+        response += data
+    s.close()
+    return response
+
+
+def main():
+    path, query = sys.argv[1], sys.argv[2]
+    count = int(sys.argv[3]) if len(sys.argv) > 3 else 1
+    start = time.monotonic()
+    for _ in range(count):
+        response = request(path, query)
+    elapsed = (time.monotonic() - start) * 1000 / count
+    sys.stdout.buffer.write(response)
+    sys.stderr.write("%.2f\n" % elapsed)
+
+
+if __name__ == "__main__":
+    main()
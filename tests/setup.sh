@@ -7,6 +7,7 @@
 # Helper functions
 #   cgit_query(querystring) - call cgit with the specified querystring
 #   cgit_url(url) - call cgit with the specified virtual url
+#   cache_slots - list the files of the cache slots
 #
 # Example script:
 #
@@ -177,4 +178,18 @@ strip_headers() {
 	cat
 }
 
+cache_slots() {
+	find cache -type f -path "cache/??/??/????????????????"
+}
+
+# The cached result of scan-path in the cache root "$1"
+rc_file() {
+	ls "$1"/rc-* | grep -v "\.dirs$"
+}
+
+# The value of the header "$1" in the response in file "$2"
+header() {
+	sed -n "s/^$1: //p" "$2"
+}
+
 test -z "$CGIT_TEST_NO_CREATE_REPOS" && setup_repos
@@ -5,7 +5,7 @@ test_description='Validate cache'
 
 test_expect_success 'verify cache-size=0' '
 
-	rm -f cache/* &&
+	rm -rf cache/* &&
 	sed -e "s/cache-size=1021$/cache-size=0/" cgitrc >cgitrc.tmp &&
 	mv -f cgitrc.tmp cgitrc &&
 	cgit_url "" &&
@@ -27,7 +27,7 @@ test_expect_success 'verify cache-size=0' '
 
 test_expect_success 'verify cache-size=1' '
 
-	rm -f cache/* &&
+	rm -rf cache/* &&
 	sed -e "s/cache-size=0$/cache-size=1/" cgitrc >cgitrc.tmp &&
 	mv -f cgitrc.tmp cgitrc &&
 	cgit_url "" &&
@@ -43,13 +43,13 @@ test_expect_success 'verify cache-size=1' '
 	cgit_url "bar/log" &&
 	cgit_url "bar/diff" &&
 	cgit_url "bar/patch" &&
-	ls cache >output &&
+	cache_slots >output &&
 	test_line_count = 1 output
 '
 
 test_expect_success 'verify cache-size=1021' '
 
-	rm -f cache/* &&
+	rm -rf cache/* &&
 	sed -e "s/cache-size=1$/cache-size=1021/" cgitrc >cgitrc.tmp &&
 	mv -f cgitrc.tmp cgitrc &&
 	cgit_url "" &&
@@ -65,7 +65,7 @@ test_expect_success 'verify cache-size=1021' '
 	cgit_url "bar/log" &&
 	cgit_url "bar/diff" &&
 	cgit_url "bar/patch" &&
-	ls cache >output &&
+	cache_slots >output &&
 	test_line_count = 13 output &&
 	cgit_url "foo/ls_cache" >output.full &&
 	strip_headers <output.full >output &&
@@ -75,4 +75,20 @@ test_expect_success 'verify cache-size=1021' '
 	test_cmp output.full output.second
 '
 
+test_expect_success 'slots of the flat layout are removed' '
+
+	rm -rf cache/* &&
+	printf "p=log&r=foo&url=foo/log\0Content-Type: text/plain\n\nlegacy\n" \
+		>cache/01234567 &&
+	printf "url=gone\0" >cache/89abcdef.lock &&
+	cgit_url "foo/log" >output &&
+	! grep legacy output &&
+	grep "commit 5" output &&
+	test_path_is_file cache/.layout &&
+	! test -e cache/01234567 &&
+	! test -e cache/89abcdef.lock &&
+	cache_slots >output &&
+	test_line_count = 1 output
+'
+
 test_done
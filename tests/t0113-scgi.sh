@@ -0,0 +1,97 @@
+#!/bin/sh
+
+test_description='Check SCGI worker mode'
+. ./setup.sh
+
+SCGI_REQUEST=$(cd .. && pwd)/scgi-request.py
+
+test_lazy_prereq PYTHON3 'python3 -c "import socket"'
+
+scgi_query()
+{
+	python3 "$SCGI_REQUEST" "$PWD/scgi.sock" "$@"
+}
+
+mean_cgi_latency()
+{
+	start=$(date +%s%N) &&
+	n=0 &&
+	while test $n -lt $2
+	do
+		cgit_query "$1" >/dev/null &&
+		n=$(expr $n + 1)
+	done &&
+	end=$(date +%s%N) &&
+	expr \( $end - $start \) / $2 / 1000000
+}
+
+test_expect_success PYTHON3 'start SCGI workers' '
+	(CGIT_CONFIG="$PWD/cgitrc" cgit --scgi="unix:$PWD/scgi.sock" \
+		--scgi-workers=2 & echo $! >scgi.pid) &&
+	n=0 &&
+	while ! test -S scgi.sock && test $n -lt 50
+	do
+		sleep 0.1 &&
+		n=$(expr $n + 1)
+	done &&
+	test -S scgi.sock
+'
+
+test_expect_success PYTHON3 'index matches CGI output' '
+	cgit_query "" | strip_headers >cgi &&
+	scgi_query "" | strip_headers >scgi &&
+	test_cmp cgi scgi
+'
+
+test_expect_success PYTHON3 'log matches CGI output' '
+	cgit_url "foo/log" | strip_headers >cgi &&
+	scgi_query "url=foo/log" | strip_headers >scgi &&
+	test_cmp cgi scgi
+'
+
+test_expect_success PYTHON3 'query string is not leaked between requests' '
+	scgi_query "url=bar/commit&id=HEAD~1" >/dev/null &&
+	cgit_url "foo/commit" | strip_headers >cgi &&
+	scgi_query "url=foo/commit" | strip_headers >scgi &&
+	test_cmp cgi scgi
+'
+
+test_expect_success PYTHON3 'prepared repository sees new commits and packs' '
+	scgi_query "url=foo/commit" >/dev/null &&
+	(
+		cd repos/foo &&
+		echo 6 >file-6 &&
+		git add file-6 &&
+		git commit -m "commit 6" &&
+		git gc --quiet
+	) &&
+	head=$(git --git-dir=repos/foo/.git rev-parse HEAD) &&
+	scgi_query "url=foo/commit&id=$head" | strip_headers >scgi &&
+	grep "commit 6" scgi &&
+	scgi_query "url=foo/commit&id=$head~5" | strip_headers >scgi &&
+	grep "commit 1" scgi
+'
+
+test_expect_success PYTHON3 'unknown repo returns 404' '
+	scgi_query "url=does-not-exist" >tmp &&
+	head -n 1 tmp | grep "^Status: 404"
+'
+
+test_expect_success PYTHON3 'compare request latency' '
+	cgi=$(mean_cgi_latency "url=bar/log" 20) &&
+	scgi_query "url=bar/log" 20 2>scgi_ms >/dev/null &&
+	say "mean latency: CGI ${cgi}ms, SCGI $(cat scgi_ms)ms"
+'
+
+test_expect_success PYTHON3 'stop SCGI workers' '
+	kill $(cat scgi.pid) &&
+	n=0 &&
+	while kill -0 $(cat scgi.pid) 2>/dev/null && test $n -lt 50
+	do
+		sleep 0.1 &&
+		n=$(expr $n + 1)
+	done &&
+	! kill -0 $(cat scgi.pid) 2>/dev/null
+'
+
+test_done
@@ -0,0 +1,28 @@
+#!/bin/sh
+
+test_description='Check buffered page output'
+. ./setup.sh
+
+test_expect_success 'enable output stats' '
+	sed -e "s/cache-size=1021$/cache-size=0/" cgitrc >cgitrc.tmp &&
+	echo "log-output-stats=1" >>cgitrc.tmp &&
+	mv -f cgitrc.tmp cgitrc
+'
+
+test_expect_success 'log page is written in a single write' '
+	cgit_url "bar/log" >tmp 2>stats &&
+	grep "^\[cgit\] url=bar/log: 1 writes, [0-9]* bytes$" stats
+'
+
+test_expect_success 'logged byte count matches the output' '
+	bytes=$(sed -e "s/.*writes, \([0-9]*\) bytes$/\1/" stats) &&
+	test "$bytes" = "$(wc -c <tmp | tr -d " ")"
+'
+
+test_expect_success 'headers precede plain text output' '
+	cgit_url "foo/patch" >tmp 2>/dev/null &&
+	head -n 1 tmp | grep "^Content-Type: text/plain" &&
+	strip_headers <tmp | head -n 1 | grep "^From "
+'
+
+test_done
@@ -0,0 +1,50 @@
+#!/bin/sh
+
+test_description='Check escaping of page content'
+. ./setup.sh
+
+test_expect_success 'setup large source file' '
+	sed -e "s/cache-size=1021$/cache-size=0/" cgitrc >cgitrc.tmp &&
+	mv -f cgitrc.tmp cgitrc &&
+	html_c="$(cd ../.. && pwd)/src/core/html.c" &&
+	(
+		cd repos/foo &&
+		printf "%s\n" "if (a < b && b > c)" "x = \"<tag attr=v>\";" \
+			"abcdefghijklmnopqrstuvwxyz0123456789<&>" >escape.c &&
+		for i in $(test_seq 64)
+		do
+			cat "$html_c" || return 1
+		done >large.c &&
+		git add escape.c large.c &&
+		git commit -m "add sources"
+	)
+'
+
+test_expect_success 'blob content is escaped' '
+	cgit_url "foo/tree/escape.c" >tmp &&
+	grep "if (a &lt; b &amp;&amp; b &gt; c)" tmp &&
+	grep "x = \"&lt;tag attr=v&gt;\";" tmp &&
+	grep "abcdefghijklmnopqrstuvwxyz0123456789&lt;&amp;&gt;" tmp
+'
+
+test_expect_success 'strings shorter than their length cap are escaped' '
+	git -C repos/foo commit -q --allow-empty -m "x<y" &&
+	cgit_url "foo/log" >tmp &&
+	grep ">x&lt;y<" tmp &&
+	cgit_url "" >tmp &&
+	grep ">the bar repo<" tmp
+'
+
+test_expect_success 'escaping throughput of a large source file' '
+	size=$(wc -c <repos/foo/large.c | tr -d " ") &&
+	start=$(date +%s%N) &&
+	for i in $(test_seq 5)
+	do
+		cgit_url "foo/tree/large.c" >tmp || return 1
+	done &&
+	end=$(date +%s%N) &&
+	grep "^static const struct escape_set html_text_escape" tmp &&
+	say "tree view of $size bytes: $(expr 5000 \* $size / \( \( $end - $start \) / 1000 \)) kB/s"
+'
+
+test_done
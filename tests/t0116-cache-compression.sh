@@ -0,0 +1,71 @@
+#!/bin/sh
+
+test_description='Check compressed cache slots'
+. ./setup.sh
+
+test_expect_success 'enable cache compression' '
+	echo "cache-compression=gzip" >>cgitrc
+'
+
+test_expect_success 'fill slot for a gzip client' '
+	HTTP_ACCEPT_ENCODING="gzip, deflate" cgit_url "foo/log" >gzip &&
+	grep "^Content-Encoding: gzip$" gzip &&
+	grep "^Vary: Accept-Encoding$" gzip &&
+	strip_headers <gzip | gzip -dc >gzip.body &&
+	grep "commit 5" gzip.body
+'
+
+test_expect_success 'slot is inflated for other clients' '
+	cgit_url "foo/log" >plain &&
+	! grep "^Content-Encoding:" plain &&
+	grep "^Vary: Accept-Encoding$" plain &&
+	strip_headers <plain >plain.body &&
+	test_cmp gzip.body plain.body
+'
+
+test_expect_success 'gzip and identity variants have different ETags' '
+	gzip_etag=$(sed -n "s/^ETag: //p" gzip) &&
+	plain_etag=$(sed -n "s/^ETag: //p" plain) &&
+	test -n "$plain_etag" &&
+	test "$gzip_etag" = "${plain_etag%\"}-gzip\"" &&
+	HTTP_IF_NONE_MATCH="$plain_etag" cgit_url "foo/log" >tmp &&
+	grep "^Status: 304" tmp &&
+	HTTP_IF_NONE_MATCH="$plain_etag" HTTP_ACCEPT_ENCODING="gzip" \
+		cgit_url "foo/log" >tmp &&
+	! grep "^Status: 304" tmp
+'
+
+test_expect_success 'gzip;q=0 is not gzip' '
+	HTTP_ACCEPT_ENCODING="gzip;q=0, identity" cgit_url "foo/log" >tmp &&
+	! grep "^Content-Encoding:" tmp &&
+	strip_headers <tmp >tmp.body &&
+	test_cmp plain.body tmp.body
+'
+
+test_expect_success 'slot filled for a plain client serves gzip clients' '
+	cgit_url "bar/log" >plain &&
+	! grep "^Content-Encoding:" plain &&
+	HTTP_ACCEPT_ENCODING="gzip" cgit_url "bar/log" >gzip &&
+	grep "^Content-Encoding: gzip$" gzip &&
+	strip_headers <plain >plain.body &&
+	strip_headers <gzip | gzip -dc >gzip.body &&
+	test_cmp plain.body gzip.body
+'
+
+test_expect_success 'slots with keys longer than 4 KiB are inflated' '
+	long=$(printf "%05000d" 0) &&
+	HTTP_ACCEPT_ENCODING="gzip" cgit_query "url=foo/log&q=$long" >gzip &&
+	grep "^Content-Encoding: gzip$" gzip &&
+	cgit_query "url=foo/log&q=$long" >plain &&
+	! grep "^Content-Encoding:" plain &&
+	strip_headers <plain >plain.body &&
+	strip_headers <gzip | gzip -dc >gzip.body &&
+	test_cmp gzip.body plain.body
+'
+
+test_expect_success 'snapshots are not compressed again' '
+	HTTP_ACCEPT_ENCODING="gzip" cgit_url "foo/snapshot/master.tar.gz" >tmp &&
+	! grep -a "^Content-Encoding:" tmp
+'
+
+test_done
@@ -0,0 +1,48 @@
+#!/bin/sh
+
+test_description='Serve stale cache slots while they are regenerated'
+. ./setup.sh
+
+slot_mtime() {
+	test-tool chmtime --get $(cache_slots) | sort -n | tail -n 1
+}
+
+test_expect_success 'setup' '
+	rm -rf cache/* &&
+	cat >>cgitrc <<-EOF &&
+	cache-repo-ttl=1
+	cache-max-stale=60
+	EOF
+	cgit_url "foo/log" >first &&
+	grep "commit 5" first &&
+	! grep "commit 6" first &&
+	git -C repos/foo commit --allow-empty -m "commit 6"
+'
+
+test_expect_success 'fresh slots are served from the cache' '
+	cgit_url "foo/log" >second &&
+	test_cmp first second
+'
+
+test_expect_success 'stale slots are served and refreshed' '
+	test-tool chmtime =-300 $(cache_slots) &&
+	old=$(slot_mtime) &&
+	cgit_url "foo/log" >stale &&
+	test_cmp first stale &&
+	for i in 1 2 3 4 5 6 7 8 9 10
+	do
+		test "$(slot_mtime)" != "$old" && break
+		sleep 1
+	done &&
+	cgit_url "foo/log" >refreshed &&
+	grep "commit 6" refreshed
+'
+
+test_expect_success 'slots older than cache-max-stale are regenerated' '
+	git -C repos/foo commit --allow-empty -m "commit 7" &&
+	test-tool chmtime =-7200 $(cache_slots) &&
+	cgit_url "foo/log" >expired &&
+	grep "commit 7" expired
+'
+
+test_done
@@ -0,0 +1,57 @@
+#!/bin/sh
+
+test_description='Wait for cache slots which are being generated'
+. ./setup.sh
+
+test_lazy_prereq PYTHON3 'python3 -c "import fcntl"'
+
+# Hold the lock of slot $1 like a cgit process generating it, and after
+# a while store the saved slot, marked with a trailing line, in its place.
+hold_lock()
+{
+	rm -f locked &&
+	python3 -c "
+import fcntl, os, sys, time
+slot = sys.argv[1]
+with open(slot + \".lock\", \"w\") as lock:
+    fcntl.lockf(lock, fcntl.LOCK_EX)
+    open(\"locked\", \"w\").close()
+    time.sleep(1)
+    with open(\"saved\", \"rb\") as f:
+        data = f.read()
+    with open(slot + \".lock\", \"wb\") as f:
+        f.write(data + b\"coalesced\\n\")
+    os.rename(slot + \".lock\", slot)
+" "$1" &
+	n=0 &&
+	while ! test -f locked && test $n -lt 50
+	do
+		sleep 0.1 && n=$((n + 1))
+	done &&
+	test -f locked
+}
+
+test_expect_success PYTHON3 'setup' '
+	rm -rf cache/* &&
+	cgit_url "foo/log" >first &&
+	slot=$(cache_slots) &&
+	mv "$slot" saved
+'
+
+test_expect_success PYTHON3 'wait for a slot being generated' '
+	hold_lock "$slot" &&
+	cgit_url "foo/log" >second &&
+	wait &&
+	test "$(tail -n 1 second)" = coalesced
+'
+
+test_expect_success PYTHON3 'generate the page with max-lock-attempts=0' '
+	rm -f "$slot" &&
+	echo "max-lock-attempts=0" >>cgitrc &&
+	hold_lock "$slot" &&
+	cgit_url "foo/log" >third &&
+	wait &&
+	test_cmp first third
+'
+
+test_done
@@ -0,0 +1,52 @@
+#!/bin/sh
+
+test_description='Stream cache misses to the client while filling the slot'
+. ./setup.sh
+
+test_expect_success 'generate pages without the cache' '
+	sed -e "s/cache-size=1021$/cache-size=0/" cgitrc >cgitrc.tmp &&
+	mv -f cgitrc.tmp cgitrc &&
+	cgit_url "foo/log" >log.uncached &&
+	cgit_url "bar/diff" >diff.uncached &&
+	sed -e "s/cache-size=0$/cache-size=1021/" cgitrc >cgitrc.tmp &&
+	mv -f cgitrc.tmp cgitrc &&
+	echo "cache-tee=1" >>cgitrc &&
+	rm -rf cache/*
+'
+
+body_cmp() {
+	strip_headers <"$1" >"$1.body" &&
+	strip_headers <"$2" >"$2.body" &&
+	test_cmp "$1.body" "$2.body"
+}
+
+test_expect_success 'cache misses are sent once' '
+	cgit_url "foo/log" >log.miss &&
+	body_cmp log.uncached log.miss &&
+	cgit_url "bar/diff" >diff.miss &&
+	body_cmp diff.uncached diff.miss &&
+	cache_slots >slots &&
+	test_line_count = 2 slots
+'
+
+test_expect_success 'cache hits match the streamed pages' '
+	cgit_url "foo/log" >log.hit &&
+	body_cmp log.uncached log.hit &&
+	test "$(sed -n "s/^Content-Length: //p" log.hit)" = $(wc -c <log.hit.body) &&
+	cgit_url "bar/diff" >diff.hit &&
+	body_cmp diff.uncached diff.hit
+'
+
+test_expect_success 'slots are compressed after streaming' '
+	rm -rf cache/* &&
+	echo "cache-compression=gzip" >>cgitrc &&
+	HTTP_ACCEPT_ENCODING=gzip cgit_url "foo/log" >log.miss &&
+	! grep "^Content-Encoding:" log.miss &&
+	strip_headers <log.miss >log.body &&
+	HTTP_ACCEPT_ENCODING=gzip cgit_url "foo/log" >log.hit &&
+	grep "^Content-Encoding: gzip$" log.hit &&
+	strip_headers <log.hit | gzip -dc >log.hit.body &&
+	test_cmp log.body log.hit.body
+'
+
+test_done
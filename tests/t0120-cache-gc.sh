@@ -0,0 +1,78 @@
+#!/bin/sh
+
+test_description='Check cache garbage collection'
+. ./setup.sh
+
+cache_gc()
+{
+	CGIT_CONFIG="$PWD/cgitrc" cgit --cache-gc
+}
+
+cache_bytes()
+{
+	cat $(cache_slots) | wc -c
+}
+
+test_expect_success 'fill the cache' '
+	rm -rf cache/* &&
+	cgit_url "foo" &&
+	cgit_url "foo/log" &&
+	cgit_url "foo/tree" &&
+	cgit_url "bar" &&
+	cgit_url "bar/log" &&
+	cgit_url "bar/tree" &&
+	cache_slots >slots &&
+	test_line_count = 6 slots
+'
+
+test_expect_success 'gc keeps slots in use' '
+	cache_gc >output &&
+	grep "^removed 0 files" output &&
+	cache_slots >slots &&
+	test_line_count = 6 slots
+'
+
+test_expect_success 'gc keeps cold slots if some pages never expire' '
+	for slot in $(head -n 2 slots)
+	do
+		touch -a -m -d "2 hours ago" "$slot" || return 1
+	done &&
+	cache_gc >output &&
+	grep "^removed 0 files" output &&
+	cache_slots >slots &&
+	test_line_count = 6 slots
+'
+
+test_expect_success 'gc removes cold slots' '
+	echo "cache-static-ttl=30" >>cgitrc &&
+	cache_gc >output &&
+	grep "^removed 2 files" output &&
+	cache_slots >slots &&
+	test_line_count = 4 slots
+'
+
+test_expect_success 'gc removes least recently used slots over budget' '
+	n=1 &&
+	for slot in $(cat slots)
+	do
+		touch -a -m -d "$n minutes ago" "$slot" &&
+		n=$((n + 1)) || return 1
+	done &&
+	newest=$(head -n 1 slots) &&
+	budget=$(($(cache_bytes) - 1)) &&
+	echo "cache-max-bytes=$budget" >>cgitrc &&
+	cache_gc &&
+	test_path_is_file "$newest" &&
+	test $(cache_bytes) -le $budget &&
+	test "$(cat cache/.usage)" = $(cache_bytes)
+'
+
+test_expect_success 'cache hits update the atime of slots' '
+	cgit_url "foo/log" &&
+	slot=$(ls -t $(cache_slots) | head -n 1) &&
+	touch -a -d "1 hour ago" "$slot" &&
+	cgit_url "foo/log" &&
+	test $(stat -c %X "$slot") -gt $(($(date +%s) - 600))
+'
+
+test_done
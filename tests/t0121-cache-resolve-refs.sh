@@ -0,0 +1,44 @@
+#!/bin/sh
+
+test_description='Check cache keys with resolved refs'
+. ./setup.sh
+
+test_expect_success 'setup' '
+	rm -rf cache/* &&
+	echo "cache-resolve-refs=1" >>cgitrc
+'
+
+test_expect_success 'pages are cached' '
+	cgit_url "foo/log" >first &&
+	cgit_url "foo/log" >second &&
+	test_cmp first second &&
+	cache_slots >slots &&
+	test_line_count = 1 slots
+'
+
+test_expect_success 'keys include the head commit' '
+	head=$(git -C repos/foo rev-parse HEAD) &&
+	cgit_url "foo/ls_cache" >ls &&
+	grep "head=$head" ls
+'
+
+test_expect_success 'new commits are shown right away' '
+	git -C repos/foo commit --allow-empty -m "commit 6" &&
+	cgit_url "foo/log" >third &&
+	grep "commit 6" third
+'
+
+test_expect_success 'new refs only change pages which show refs' '
+	cgit_url "foo/tree" >tree &&
+	cgit_url "foo/refs" >refs &&
+	cache_slots >before &&
+	git -C repos/foo tag resolve-test &&
+	cgit_url "foo/tree" >tree.tagged &&
+	test_cmp tree tree.tagged &&
+	cgit_url "foo/refs" >refs.tagged &&
+	grep "resolve-test" refs.tagged &&
+	cache_slots >after &&
+	test_line_count = $(($(wc -l <before) + 1)) after
+'
+
+test_done
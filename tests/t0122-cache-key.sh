@@ -0,0 +1,61 @@
+#!/bin/sh
+
+test_description='Check that equivalent requests share their cache slot'
+. ./setup.sh
+
+test_expect_success 'setup' '
+	rm -rf cache/*
+'
+
+test_expect_success 'default parameters are ignored' '
+	cgit_url "foo/log" >first &&
+	cgit_query "url=foo/log&ofs=0" >second &&
+	cgit_query "showmsg=0&url=foo/log&context=3" >third &&
+	test_cmp first second &&
+	test_cmp first third &&
+	cache_slots >slots &&
+	test_line_count = 1 slots
+'
+
+test_expect_success 'PATH_INFO and url= share slots' '
+	CGIT_CONFIG="$PWD/cgitrc" PATH_INFO="/foo/log" QUERY_STRING="" \
+		cgit >pathinfo &&
+	test_cmp first pathinfo &&
+	cache_slots >slots &&
+	test_line_count = 1 slots
+'
+
+test_expect_success 'the order of parameters is ignored' '
+	id=$(git -C repos/foo rev-parse HEAD~1) &&
+	cgit_query "url=foo/commit&h=master&id=$id" >commit1 &&
+	cgit_query "id=$id&url=foo/commit&h=master" >commit2 &&
+	test_cmp commit1 commit2 &&
+	cache_slots >slots &&
+	test_line_count = 2 slots
+'
+
+test_expect_success 'different parameters still get their own slot' '
+	cgit_query "url=foo/log&ofs=1" >ofs &&
+	! test_cmp first ofs &&
+	cache_slots >slots &&
+	test_line_count = 3 slots
+'
+
+test_expect_success 'keys are sorted by parameter' '
+	cgit_url "foo/ls_cache" >ls &&
+	grep " h=master&id=$id&p=commit&r=foo&url=foo/commit" ls
+'
+
+test_expect_success 'empty parameters are kept' '
+	cgit_query "url=foo/log&q=" >/dev/null &&
+	cgit_url "foo/ls_cache" >ls &&
+	grep " p=log&q=&r=foo&url=foo/log" ls
+'
+
+test_expect_success 'control characters are escaped in keys' '
+	cgit_query "url=foo/log&q=a%0Ab" >/dev/null &&
+	cgit_url "foo/ls_cache" >ls &&
+	grep " p=log&q=a%0Ab&r=foo&url=foo/log" ls
+'
+
+test_done
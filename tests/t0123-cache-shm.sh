@@ -0,0 +1,50 @@
+#!/bin/sh
+
+test_description='Check the shared memory cache tier'
+. ./setup.sh
+
+test_lazy_prereq SHM 'test -d /dev/shm && test -w /dev/shm'
+
+test_expect_success SHM 'setup' '
+	ls /dev/shm >shm.before &&
+	rm -rf cache/* &&
+	echo "cache-shm-size=1m" >>cgitrc
+'
+
+test_expect_success SHM 'pages are kept in shared memory' '
+	cgit_url "foo/log" >first &&
+	cgit_url "foo/log" >second &&
+	test_cmp first second &&
+	rm -rf cache/?? &&
+	cgit_url "foo/log" >third &&
+	test_cmp first third &&
+	cache_slots >slots &&
+	test_line_count = 0 slots
+'
+
+test_expect_success SHM 'other pages are not served from memory' '
+	cgit_url "bar/log" >bar &&
+	! test_cmp first bar &&
+	cache_slots >slots &&
+	test_line_count = 1 slots
+'
+
+test_expect_success SHM 'hits from memory touch the slot file' '
+	slot=$(cache_slots) &&
+	touch -a -d "1 hour ago" "$slot" &&
+	cgit_url "bar/log" >second &&
+	test_cmp bar second &&
+	test $(stat -c %X "$slot") -gt $(($(date +%s) - 600))
+'
+
+test_expect_success SHM 'cleanup' '
+	ls /dev/shm >shm.after &&
+	for f in $(comm -13 shm.before shm.after)
+	do
+		case "$f" in
+		cgit-*) rm -f "/dev/shm/$f" ;;
+		esac
+	done
+'
+
+test_done
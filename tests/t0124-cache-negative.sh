@@ -0,0 +1,56 @@
+#!/bin/sh
+
+test_description='Cache error pages for cache-negative-ttl'
+. ./setup.sh
+
+bad=1234567890123456789012345678901234567890
+
+slot_mtime() {
+	test-tool chmtime --get $(cache_slots)
+}
+
+test_expect_success 'setup' '
+	rm -rf cache/* &&
+	cgit_query "url=foo/commit&id=$bad" >first &&
+	grep "^Status: 404" first &&
+	cache_slots >slots &&
+	test_line_count = 1 slots
+'
+
+test_expect_success 'error pages are served from the cache' '
+	test-tool chmtime =-30 $(cache_slots) &&
+	old=$(slot_mtime) &&
+	cgit_query "url=foo/commit&id=$bad" >second &&
+	test_cmp first second &&
+	test "$(slot_mtime)" = "$old"
+'
+
+test_expect_success 'error pages expire after cache-negative-ttl' '
+	test-tool chmtime =-120 $(cache_slots) &&
+	old=$(slot_mtime) &&
+	cgit_query "url=foo/commit&id=$bad" >third &&
+	grep "^Status: 404" third &&
+	test "$(slot_mtime)" != "$old"
+'
+
+test_expect_success 'other pages keep their own ttl' '
+	rm -rf cache/* &&
+	id=$(git -C repos/foo rev-parse HEAD) &&
+	cgit_query "url=foo/commit&id=$id" >good &&
+	! grep "^Status:" good &&
+	test-tool chmtime =-120 $(cache_slots) &&
+	old=$(slot_mtime) &&
+	cgit_query "url=foo/commit&id=$id" >good.again &&
+	test "$(slot_mtime)" = "$old"
+'
+
+test_expect_success 'error pages are not cached with cache-negative-ttl=0' '
+	rm -rf cache/* &&
+	echo "cache-negative-ttl=0" >>cgitrc &&
+	cgit_query "url=foo/commit&id=$bad" >uncached &&
+	grep "^Status: 404" uncached &&
+	cache_slots >slots &&
+	test_line_count = 0 slots
+'
+
+test_done
@@ -0,0 +1,92 @@
+#!/bin/sh
+
+test_description='Answer conditional requests with 304 Not Modified'
+. ./setup.sh
+
+test_expect_success 'setup' '
+	rm -rf cache/* &&
+	cgit_url "foo/log" >full &&
+	etag=$(header ETag full) &&
+	test -n "$etag" &&
+	modified=$(header Last-Modified full) &&
+	test -n "$modified"
+'
+
+test_expect_success 'matching If-None-Match gets 304 from the cache' '
+	HTTP_IF_NONE_MATCH="$etag" cgit_url "foo/log" >tmp &&
+	head -n 1 tmp | grep "^Status: 304 Not Modified" &&
+	test "$(header ETag tmp)" = "$etag" &&
+	! grep "commit 5" tmp
+'
+
+test_expect_success 'If-None-Match lists and weak tags are understood' '
+	HTTP_IF_NONE_MATCH="\"nope\", W/$etag" cgit_url "foo/log" >tmp &&
+	grep "^Status: 304" tmp &&
+	HTTP_IF_NONE_MATCH="*" cgit_url "foo/log" >tmp &&
+	grep "^Status: 304" tmp
+'
+
+test_expect_success 'other ETags get the full page' '
+	HTTP_IF_NONE_MATCH="\"nope\"" cgit_url "foo/log" >tmp &&
+	! grep "^Status:" tmp &&
+	test_cmp full tmp
+'
+
+test_expect_success 'If-Modified-Since is checked against Last-Modified' '
+	HTTP_IF_MODIFIED_SINCE="$modified" cgit_url "foo/log" >tmp &&
+	grep "^Status: 304" tmp &&
+	HTTP_IF_MODIFIED_SINCE="Thu, 01 Jan 1970 00:00:00 GMT" \
+		cgit_url "foo/log" >tmp &&
+	test_cmp full tmp
+'
+
+test_expect_success 'If-Modified-Since in the future is ignored' '
+	HTTP_IF_MODIFIED_SINCE="Fri, 01 Jan 2100 00:00:00 GMT" \
+		cgit_url "foo/log" >tmp &&
+	test_cmp full tmp &&
+	HTTP_IF_MODIFIED_SINCE="Fri, 01 Jan 2100 00:00:00 GMT" \
+		cgit_url "foo/plain/file-1" >tmp &&
+	! grep "^Status: 304" tmp
+'
+
+test_expect_success 'If-None-Match takes precedence' '
+	HTTP_IF_NONE_MATCH="\"nope\"" HTTP_IF_MODIFIED_SINCE="$modified" \
+		cgit_url "foo/log" >tmp &&
+	test_cmp full tmp
+'
+
+test_expect_success 'regenerated pages get a new ETag' '
+	test-tool chmtime =-600 $(cache_slots) &&
+	sleep 1 &&
+	git -C repos/foo commit --allow-empty -m "commit 6" &&
+	HTTP_IF_NONE_MATCH="$etag" cgit_url "foo/log" >tmp &&
+	! grep "^Status:" tmp &&
+	grep "commit 6" tmp &&
+	test "$(header ETag tmp)" != "$etag"
+'
+
+test_expect_success 'only pages of object ids have ETags without a time' '
+	head=$(git -C repos/foo rev-parse HEAD) &&
+	cgit_query "url=foo/commit&id=$head" >tmp &&
+	header ETag tmp | grep "^\"[0-9a-f]*\"$" &&
+	cgit_query "url=foo/commit&id=master" >tmp &&
+	header ETag tmp | grep "^\"[0-9a-f]*-[0-9a-f]*\"$"
+'
+
+test_expect_success 'error pages are never 304' '
+	HTTP_IF_NONE_MATCH="*" cgit_query "url=foo/commit&id=nope" >tmp &&
+	! grep "^Status: 304" tmp &&
+	! grep "^ETag:" tmp
+'
+
+test_expect_success 'uncached pages are answered before rendering' '
+	echo "cache-size=0" >>cgitrc &&
+	blob=$(git -C repos/foo rev-parse HEAD:file-1) &&
+	cgit_url "foo/plain/file-1" >tmp &&
+	test "$(header ETag tmp)" = "\"$blob\"" &&
+	HTTP_IF_NONE_MATCH="\"$blob\"" cgit_url "foo/plain/file-1" >tmp &&
+	head -n 1 tmp | grep "^Status: 304" &&
+	! grep "^Content-Type:" tmp
+'
+
+test_done
@@ -0,0 +1,76 @@
+#!/bin/sh
+
+test_description='Serve exact lengths and byte ranges from the cache'
+. ./setup.sh
+
+test_expect_success 'setup' '
+	rm -rf cache/* &&
+	cgit_url "foo/log" >miss &&
+	strip_headers <miss >body &&
+	length=$(wc -c <body)
+'
+
+test_expect_success 'cache hits have a Content-Length' '
+	cgit_url "foo/log" >hit &&
+	test_cmp miss hit &&
+	test "$(header Content-Length hit)" = $length &&
+	grep "^Accept-Ranges: bytes" hit
+'
+
+test_expect_success 'a byte range is served' '
+	HTTP_RANGE="bytes=0-9" cgit_url "foo/log" >tmp &&
+	head -n 1 tmp | grep "^Status: 206 Partial Content" &&
+	test "$(header Content-Range tmp)" = "bytes 0-9/$length" &&
+	test "$(header Content-Length tmp)" = 10 &&
+	head -c 10 body >expect &&
+	strip_headers <tmp >actual &&
+	test_cmp expect actual
+'
+
+test_expect_success 'a suffix range is served' '
+	HTTP_RANGE="bytes=-5" cgit_url "foo/log" >tmp &&
+	grep "^Status: 206" tmp &&
+	tail -c 5 body >expect &&
+	strip_headers <tmp >actual &&
+	test_cmp expect actual
+'
+
+test_expect_success 'an open range is served' '
+	HTTP_RANGE="bytes=10-" cgit_url "foo/log" >tmp &&
+	grep "^Status: 206" tmp &&
+	tail -c +11 body >expect &&
+	strip_headers <tmp >actual &&
+	test_cmp expect actual
+'
+
+test_expect_success 'unsatisfiable ranges get 416' '
+	HTTP_RANGE="bytes=$length-" cgit_url "foo/log" >tmp &&
+	grep "^Status: 416" tmp &&
+	test "$(header Content-Range tmp)" = "bytes */$length" &&
+	test -z "$(strip_headers <tmp)"
+'
+
+test_expect_success 'multiple ranges get the whole page' '
+	HTTP_RANGE="bytes=0-1,5-6" cgit_url "foo/log" >tmp &&
+	test_cmp hit tmp
+'
+
+test_expect_success 'If-Range must match the ETag' '
+	etag=$(header ETag hit) &&
+	HTTP_RANGE="bytes=0-9" HTTP_IF_RANGE="$etag" \
+		cgit_url "foo/log" >tmp &&
+	grep "^Status: 206" tmp &&
+	HTTP_RANGE="bytes=0-9" HTTP_IF_RANGE="\"nope\"" \
+		cgit_url "foo/log" >tmp &&
+	test_cmp hit tmp
+'
+
+test_expect_success 'slots without a slot header are regenerated' '
+	printf "p=log&r=foo&url=foo/log\0Content-Type: text/plain\n\nold\n" \
+		>$(cache_slots) &&
+	cgit_url "foo/log" >tmp &&
+	! grep "^old" tmp &&
+	grep "commit 5" tmp
+'
+
+test_done
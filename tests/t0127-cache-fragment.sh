@@ -0,0 +1,55 @@
+#!/bin/sh
+
+test_description='Cache sections of the summary page as fragments'
+. ./setup.sh
+
+test_expect_success 'setup' '
+	rm -rf cache/* &&
+	cgit_url "foo" | strip_headers >plain &&
+	cat >>cgitrc <<-\EOF &&
+	cache-repo-ttl=0
+	cache-fragment-ttl=5
+	EOF
+	rm -rf cache/*
+'
+
+test_expect_success 'sections are cached as fragments' '
+	cgit_url "foo" | strip_headers >first &&
+	test_cmp plain first &&
+	cache_slots >slots &&
+	test_line_count = 4 slots &&
+	! grep -l "^Content-Type:" $(cache_slots)
+'
+
+test_expect_success 'the page is put together from fragments' '
+	test-tool chmtime =-30 $(cache_slots) &&
+	cgit_url "foo" | strip_headers >second &&
+	test_cmp plain second &&
+	cache_slots >slots &&
+	test_line_count = 4 slots
+'
+
+test_expect_success 'fragments follow new commits' '
+	git -C repos/foo commit --allow-empty -m "sixth commit" &&
+	cgit_url "foo" | strip_headers >third &&
+	grep "Commits</th><td colspan=.4.>6</td>" third &&
+	grep "sixth commit" third &&
+	cache_slots >slots &&
+	test_line_count = 8 slots
+'
+
+test_expect_success 'the log follows new tags' '
+	git -C repos/foo tag fragment-tag &&
+	cgit_url "foo" | strip_headers >fifth &&
+	grep "class=.tag-deco.[^>]*>fragment-tag<" fifth
+'
+
+test_expect_success 'fragments are not cached with cache-fragment-ttl=0' '
+	rm -rf cache/* &&
+	echo "cache-fragment-ttl=0" >>cgitrc &&
+	cgit_url "foo" | strip_headers >fourth &&
+	cache_slots >slots &&
+	test_line_count = 0 slots
+'
+
+test_done
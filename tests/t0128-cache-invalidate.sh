@@ -0,0 +1,83 @@
+#!/bin/sh
+
+test_description='Invalidate and warm the cache of a repository'
+. ./setup.sh
+
+test_expect_success 'setup' '
+	rm -rf cache/* &&
+	cgit_url "foo/" >/dev/null &&
+	cgit_url "foo/log/" >/dev/null &&
+	cgit_url "bar/" >/dev/null &&
+	cache_slots >slots &&
+	test_line_count = 3 slots
+'
+
+test_expect_success '--invalidate-repo removes the slots of the repository' '
+	CGIT_CONFIG="$PWD/cgitrc" cgit --invalidate-repo=foo >out &&
+	grep "removed 2 cache slots of foo" out &&
+	cache_slots >slots &&
+	test_line_count = 1 slots &&
+	cgit_url "bar/" >/dev/null &&
+	cache_slots >slots &&
+	test_line_count = 1 slots
+'
+
+test_expect_success '--invalidate-repo without cached pages' '
+	CGIT_CONFIG="$PWD/cgitrc" cgit --invalidate-repo=foo >out &&
+	grep "removed 0 cache slots of foo" out
+'
+
+test_expect_success '--warm generates the pages of the repository' '
+	CGIT_CONFIG="$PWD/cgitrc" cgit --warm=foo &&
+	cache_slots >slots &&
+	test_line_count = 5 slots &&
+	cgit_url "foo/" >/dev/null &&
+	cgit_url "foo/log/" >/dev/null &&
+	cgit_url "foo/refs/" >/dev/null &&
+	cgit_query "url=foo/atom/&h=master" >/dev/null &&
+	cache_slots >slots &&
+	test_line_count = 5 slots
+'
+
+test_expect_success 'warmed pages are invalidated' '
+	CGIT_CONFIG="$PWD/cgitrc" cgit --invalidate-repo=foo --warm=foo >out &&
+	grep "removed 4 cache slots of foo" out &&
+	cache_slots >slots &&
+	test_line_count = 5 slots
+'
+
+test_expect_success '--warm of an unknown repository fails' '
+	test_must_fail env CGIT_CONFIG="$PWD/cgitrc" cgit --warm=nope
+'
+
+test_expect_success 'gc drops removed slots from journals' '
+	for i in 1 2 3
+	do
+		rm -f $(cache_slots) &&
+		cgit_url "foo/" >/dev/null || return 1
+	done &&
+	cat cache/.repos/* | sort | uniq -d >dups &&
+	test_line_count = 1 dups &&
+	CGIT_CONFIG="$PWD/cgitrc" cgit --cache-gc &&
+	cat cache/.repos/* >journal &&
+	sort journal | uniq -d >dups &&
+	test_line_count = 0 dups &&
+	test_line_count = 1 journal
+'
+
+test_expect_success 'pages are warmed for cache-warm-url' '
+	echo "cache-warm-url=https://git.example.com:8443/cgit/" >>cgitrc &&
+	CGIT_CONFIG="$PWD/cgitrc" cgit --invalidate-repo=foo --warm=foo &&
+	grep -l "https://git.example.com:8443/" $(cache_slots)
+'
+
+test_expect_success 'nothing is warmed with an auth-filter' '
+	echo "auth-filter=exec:/bin/false" >>cgitrc &&
+	CGIT_CONFIG="$PWD/cgitrc" cgit --invalidate-repo=foo --warm=foo \
+		2>err &&
+	grep "Not warming foo" err &&
+	cache_slots >slots &&
+	test_line_count = 1 slots
+'
+
+test_done
@@ -0,0 +1,60 @@
+#!/bin/sh
+
+test_description='Count cache hits and misses'
+. ./setup.sh
+
+counter() {
+	sed -n "s/^$1 //p" stats
+}
+
+test_expect_success 'setup' '
+	rm -rf cache/* &&
+	cgit_url "foo" >/dev/null &&
+	cgit_url "foo" >/dev/null &&
+	cgit_url "foo/log" >/dev/null
+'
+
+test_expect_success 'hits and misses are counted' '
+	CGIT_CONFIG="$PWD/cgitrc" cgit --cache-stats >stats &&
+	test "$(counter hits)" = 1 &&
+	test "$(counter misses)" = 2 &&
+	test "$(counter fills)" = 2 &&
+	test "$(counter hit_ratio)" = 0.3333 &&
+	test "$(counter bytes_served)" -gt 0
+'
+
+test_expect_success 'fill times are counted in the histogram' '
+	total=0 &&
+	for n in $(sed -n "s/^fill_ms_[lg][et]_[0-9]* //p" stats)
+	do
+		total=$((total + n))
+	done &&
+	test $total = 2
+'
+
+test_expect_success 'the cache_stats page is disabled by default' '
+	cgit_query "p=cache_stats" >page &&
+	grep "^Status: 403" page &&
+	! grep "^hits " page
+'
+
+test_expect_success 'the cache_stats page is not cached' '
+	echo "enable-cache-stats=1" >>cgitrc &&
+	cgit_query "p=cache_stats" >page &&
+	grep "^Content-Type: text/plain" page &&
+	grep "^hits 1$" page &&
+	cache_slots >slots &&
+	test_line_count = 2 slots
+'
+
+test_expect_success 'conditional requests are counted' '
+	cgit_url "foo" >first &&
+	etag=$(sed -n "s/^ETag: //p" first) &&
+	HTTP_IF_NONE_MATCH="$etag" cgit_url "foo" >second &&
+	grep "^Status: 304" second &&
+	CGIT_CONFIG="$PWD/cgitrc" cgit --cache-stats >stats &&
+	test "$(counter hits)" = 3 &&
+	test "$(counter not_modified)" = 1
+'
+
+test_done
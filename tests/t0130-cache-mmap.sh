@@ -0,0 +1,50 @@
+#!/bin/sh
+
+test_description='Serve cache slots from a mapping'
+. ./setup.sh
+
+test_expect_success 'setup' '
+	rm -rf cache/* &&
+	git -C repos/foo checkout -q -b sizes &&
+	test-tool genrandom small 4096 >repos/foo/small &&
+	test-tool genrandom large 409600 >repos/foo/large &&
+	git -C repos/foo add small large &&
+	git -C repos/foo commit -q -m sizes
+'
+
+for size in small large
+do
+	test_expect_success "$size slots are served from the cache" '
+		cgit_query "url=foo/plain/'$size'&h=sizes" >miss &&
+		cgit_query "url=foo/plain/'$size'&h=sizes" >hit &&
+		strip_headers <hit >body &&
+		test_cmp repos/foo/'$size' body &&
+		strip_headers <miss >body &&
+		test_cmp repos/foo/'$size' body
+	'
+done
+
+test_expect_success 'a range of a large slot is served' '
+	HTTP_RANGE="bytes=300000-300009" \
+		cgit_query "url=foo/plain/large&h=sizes" >tmp &&
+	grep "^Status: 206" tmp &&
+	tail -c +300001 repos/foo/large | head -c 10 >expect &&
+	strip_headers <tmp >actual &&
+	test_cmp expect actual
+'
+
+test_expect_success 'slots with keys longer than 4 KiB are filled' '
+	long=$(printf "%05000d" 0) &&
+	cgit_query "url=foo/log&q=$long" >miss &&
+	grep "^Content-Length: " miss &&
+	cgit_query "url=foo/log&q=$long" >hit &&
+	test_cmp miss hit
+'
+
+test_expect_success 'ls_cache lists the keys of mapped slots' '
+	cgit_url "foo/ls_cache" >ls &&
+	grep "path=large" ls &&
+	grep "path=small" ls
+'
+
+test_done
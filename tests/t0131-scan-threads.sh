@@ -0,0 +1,53 @@
+#!/bin/sh
+
+test_description='Scan for repositories with several threads'
+. ./setup.sh
+
+scan_config() {
+	cat >"$1" <<-EOF
+	cache-root=$PWD/$2
+	cache-size=1021
+	scan-threads=$3
+	scan-path=$PWD/repos
+	EOF
+}
+
+print_index() {
+	cgit --print-repo-index="$(rc_file "$1")"
+}
+
+test_expect_success 'setup' '
+	git init --bare repos/nested/one.git &&
+	git init --bare repos/nested/deeper/two.git &&
+	git init --bare repos/nested/three.git &&
+	mkdir -p scan-1 scan-4 &&
+	scan_config cgitrc.1 scan-1 1 &&
+	scan_config cgitrc.4 scan-4 4
+'
+
+test_expect_success 'the scan result is cached with its stats' '
+	CGIT_CONFIG="$PWD/cgitrc.1" QUERY_STRING="url=/" cgit >/dev/null &&
+	CGIT_CONFIG="$PWD/cgitrc.4" QUERY_STRING="url=/" cgit >/dev/null &&
+	print_index scan-1 >index.1 &&
+	print_index scan-4 >index.4 &&
+	grep "^# scan: 8 repositories, .* 1 threads" index.1 &&
+	grep "^# scan: 8 repositories, .* 4 threads" index.4
+'
+
+test_expect_success 'repositories are found in the same order' '
+	grep -v "^#" index.1 >expect &&
+	grep -v "^#" index.4 >actual &&
+	grep "^repo.url=nested/deeper/two.git" actual &&
+	test_cmp expect actual
+'
+
+test_expect_success '--scan-threads applies to --scan-tree' '
+	cgit --scan-tree="$PWD/repos" >expect &&
+	cgit --scan-threads=4 --scan-tree="$PWD/repos" >actual &&
+	grep "^# scan: .* 4 threads" actual &&
+	grep -v "^#" expect >expect.repos &&
+	grep -v "^#" actual >actual.repos &&
+	test_cmp expect.repos actual.repos
+'
+
+test_done
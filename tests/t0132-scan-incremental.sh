@@ -0,0 +1,66 @@
+#!/bin/sh
+
+test_description='Rescan only the directories which changed'
+. ./setup.sh
+
+print_index() {
+	cgit --print-repo-index="$(rc_file scan)" >index &&
+	grep "^# scan:" index >stats &&
+	grep -v "^#" index >repos
+}
+
+rescan() {
+	rm -f "$(rc_file scan)" &&
+	CGIT_CONFIG="$PWD/cgitrc.scan" QUERY_STRING="url=/" cgit >/dev/null &&
+	print_index
+}
+
+test_expect_success 'setup' '
+	mkdir scan &&
+	cat >cgitrc.scan <<-EOF
+	cache-root=$PWD/scan
+	cache-size=1021
+	scan-path=$PWD/repos
+	EOF
+'
+
+test_expect_success 'the first scan reads every directory' '
+	CGIT_CONFIG="$PWD/cgitrc.scan" QUERY_STRING="url=/" cgit >/dev/null &&
+	test -f "$(rc_file scan).dirs" &&
+	print_index &&
+	grep "^# scan: 5 repositories, 6 directories, 0 unchanged" stats
+'
+
+test_expect_success 'unchanged directories are not read again' '
+	cp repos expect &&
+	rescan &&
+	grep "^# scan: 5 repositories, 6 directories, 6 unchanged, 0 entries" stats &&
+	test_cmp expect repos
+'
+
+test_expect_success 'changed directories are read again' '
+	git init --bare repos/new.git &&
+	touch repos/foo/.git/noweb &&
+	rescan &&
+	grep "^# scan: 5 repositories, 7 directories, 4 unchanged" stats &&
+	grep "^repo.url=new.git" repos &&
+	! grep "^repo.url=foo$" repos
+'
+
+test_expect_success 'the result matches a full scan' '
+	cp repos expect &&
+	rm -f "$(rc_file scan).dirs" &&
+	rescan &&
+	grep "^# scan: .* 0 unchanged" stats &&
+	test_cmp expect repos
+'
+
+test_expect_success 'repository files are read even if unchanged' '
+	rescan &&
+	echo "changed description" >repos/bar/.git/description &&
+	rescan &&
+	grep "^# scan: .* 7 unchanged" stats &&
+	grep "^repo.desc=changed description" repos
+'
+
+test_done
@@ -0,0 +1,58 @@
+#!/bin/sh
+
+test_description='Cache the result of scan-path as a repository index'
+. ./setup.sh
+
+cgit_index() {
+	CGIT_CONFIG="$PWD/cgitrc.index" QUERY_STRING="url=$1" cgit
+}
+
+test_expect_success 'setup' '
+	mkdir index-cache &&
+	echo "the indexed bar repo" >repos/bar/.git/description &&
+	cat >cgitrc.index <<-EOF
+	virtual-root=/
+	cache-root=$PWD/index-cache
+	cache-size=1021
+	scan-path=$PWD/repos
+	repo.owner=the last repo
+	EOF
+'
+
+test_expect_success 'the scan is cached as an index' '
+	cgit_index "" >tmp &&
+	grep ">foo+bar<" tmp &&
+	test "$(head -c 7 "$(rc_file index-cache)")" = cgitidx
+'
+
+test_expect_success 'the index page lists the indexed repositories' '
+	cgit_index "" >tmp &&
+	grep ">foo+bar<" tmp &&
+	grep "/with%20space/" tmp &&
+	grep "the indexed bar repo" tmp
+'
+
+test_expect_success 'a repository is looked up in the index' '
+	cgit_index "bar" >tmp &&
+	grep "the indexed bar repo" tmp &&
+	cgit_index "foo/log" >tmp &&
+	grep "commit 5" tmp
+'
+
+test_expect_success 'settings following scan-path apply to the last repo' '
+	cgit --print-repo-index="$(rc_file index-cache)" >index &&
+	! grep "^repo.owner=the last repo" index &&
+	cgit_index "" >tmp &&
+	grep "the last repo" tmp
+'
+
+test_expect_success 'a repolist in the old format is replaced' '
+	printf "repo.url=stale\nrepo.path=%s\n" "$PWD/repos/foo/.git" \
+		>"$(rc_file index-cache)" &&
+	cgit_index "" >tmp &&
+	! grep "stale" tmp &&
+	grep ">foo+bar<" tmp &&
+	test "$(head -c 7 "$(rc_file index-cache)")" = cgitidx
+'
+
+test_done
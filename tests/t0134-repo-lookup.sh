@@ -0,0 +1,83 @@
+#!/bin/sh
+
+test_description='Look up repositories by url'
+. ./setup.sh
+
+cgit_lookup() {
+	CGIT_CONFIG="$PWD/cgitrc.lookup" QUERY_STRING="url=$1" cgit
+}
+
+test_expect_success 'setup' '
+	cat >cgitrc.lookup <<-EOF
+	virtual-root=/
+	repo.url=nested
+	repo.path=$PWD/repos/foo/.git
+	repo.desc=the outer repo
+
+	repo.url=nested/deeper
+	repo.path=$PWD/repos/bar/.git
+	repo.desc=the inner repo
+
+	repo.url=dup
+	repo.path=$PWD/repos/foo/.git
+	repo.desc=the ignored dup
+	repo.ignore=1
+
+	repo.url=dup
+	repo.path=$PWD/repos/bar/.git
+	repo.desc=the second dup
+
+	repo.url=dup
+	repo.path=$PWD/repos/foo/.git
+	repo.desc=the third dup
+	EOF
+'
+
+test_expect_success 'the longest matching url wins' '
+	cgit_lookup "nested/deeper/log/file-1" >tmp &&
+	grep "the inner repo" tmp &&
+	cgit_lookup "nested/log/deeper" >tmp &&
+	grep "the outer repo" tmp
+'
+
+test_expect_success 'a url with or without .git is found' '
+	cgit_lookup "nested.git/log" >tmp &&
+	grep "the outer repo" tmp
+'
+
+test_expect_success 'the first repository which is not ignored is used' '
+	cgit_lookup "dup/log" >tmp &&
+	grep "the second dup" tmp &&
+	grep "commit 50" tmp
+'
+
+test_expect_success 'setup remove-suffix' '
+	git clone -q --bare repos/foo repos/suffix.git &&
+	mkdir suffix-cache &&
+	cat >cgitrc.suffix <<-EOF &&
+	virtual-root=/
+	remove-suffix=1
+	scan-path=$PWD/repos
+	EOF
+	cat >cgitrc.suffix-cached <<-EOF
+	virtual-root=/
+	cache-root=$PWD/suffix-cache
+	cache-size=1021
+	remove-suffix=1
+	scan-path=$PWD/repos
+	EOF
+'
+
+for config in suffix suffix-cached
+do
+	test_expect_success "remove-suffix urls are found with $config" '
+		CGIT_CONFIG="$PWD/cgitrc.'$config'" QUERY_STRING="url=suffix/log" \
+			cgit >tmp &&
+		grep "commit 5" tmp &&
+		CGIT_CONFIG="$PWD/cgitrc.'$config'" QUERY_STRING="url=suffix/log" \
+			cgit >tmp &&
+		grep "commit 5" tmp
+	'
+done
+
+test_done
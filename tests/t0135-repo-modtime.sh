@@ -0,0 +1,39 @@
+#!/bin/sh
+
+test_description='Record the idle time of scanned repositories'
+. ./setup.sh
+
+cgit_idle() {
+	CGIT_CONFIG="$PWD/cgitrc.idle" QUERY_STRING="$1" cgit
+}
+
+test_expect_success 'setup' '
+	mkdir idle-cache &&
+	mkdir -p repos/foo/.git/info/web &&
+	echo "2001-01-01 00:00:00" >repos/foo/.git/info/web/last-modified &&
+	cat >cgitrc.idle <<-EOF
+	virtual-root=/
+	cache-root=$PWD/idle-cache
+	cache-size=1021
+	cache-root-ttl=0
+	scan-path=$PWD/repos
+	EOF
+'
+
+test_expect_success 'the idle time is recorded when scanning' '
+	cgit_idle "" >tmp &&
+	grep "2001-01-01" tmp &&
+	echo "2002-02-02 00:00:00" >repos/foo/.git/info/web/last-modified &&
+	cgit_idle "s=idle" >tmp &&
+	grep "2001-01-01" tmp &&
+	! grep "2002-02-02" tmp
+'
+
+test_expect_success '--invalidate-repo updates the idle time' '
+	CGIT_CONFIG="$PWD/cgitrc.idle" cgit --invalidate-repo=foo &&
+	cgit_idle "s=idle" >tmp &&
+	grep "2002-02-02" tmp &&
+	! grep "2001-01-01" tmp
+'
+
+test_done